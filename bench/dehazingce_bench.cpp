@@ -0,0 +1,554 @@
+// Benchmark of the dehazing pipeline without VapourSynth.
+// Drives the dehazing class like the plugin does with air_interval=0 and temporal=False:
+// AirlightEstimation and RemoveHaze on every frame, one frame at a time.
+// With --yuv420 the frames are converted to YUV 4:2:0 beforehand and run through the YUV path.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "DehazingCE.hpp"
+#include "DehazingCE.cpp"
+
+struct Size
+{
+    int width;
+    int height;
+};
+
+struct Options
+{
+    std::vector<Size> sizes = { { 1920, 1080 } };
+    std::vector<int> bits = { 8 };
+    std::vector<Size> refs = { { 320, 240 } };  // width 0: full resolution
+    std::vector<int> threads;
+    int frames = 30;
+    int warmup = 2;
+    std::string input;                          // Raw planar RGB frames, synthetic frames if empty
+    float trans = 0.3f;
+    float trans_step = 0.1f;
+    float gamma = 1.5f;
+    int guide_size = 40;
+    int guide_step = 1;
+    bool stream = false;
+    int guide_mode = 0;                         // 0: RGB guide, 1: luma guide
+    bool post = false;
+    bool yuv420 = false;                        // Convert the frames to YUV 4:2:0
+    bool internal_ref = false;                  // Downscale the ref in each frame with the internal downscaler
+    int max_memory = 0;                         // MB per frame, 0: no limit
+    bool csv = false;
+};
+
+// Planar frame, planes in R, G, B order like a VapourSynth RGB frame, or Y, U, V with chroma at half width and height
+template <typename T>
+struct Frame
+{
+    int width;
+    int height;
+    std::vector<T> planes[3];
+};
+
+static void usage()
+{
+    std::puts(
+        "Usage: dehazingce_bench [options]\n"
+        "  --size LIST        frame sizes, 720p, 1080p, 4k, 8k or WxH (default 1080p)\n"
+        "  --bits LIST        bit depths, 8 to 16 (default 8)\n"
+        "  --ref LIST         ref clip sizes, WxH or full (default 320x240)\n"
+        "  --threads LIST     thread counts (default 1, 2, 4, ... up to the logical processors)\n"
+        "  --frames N         timed frames per run (default 30)\n"
+        "  --warmup N         untimed frames per run (default 2)\n"
+        "  --input FILE       raw planar RGB frames (R, G, B planes of the first size and bit depth,\n"
+        "                     2 bytes per sample above 8 bit), synthetic frames if not given\n"
+        "  --trans F, --trans-step F, --gamma F, --guide-size N, --guide-step N, --guide-mode N,\n"
+        "  --stream, --post\n"
+        "                     filter parameters, same defaults as the plugin\n"
+        "  --yuv420           convert the frames to YUV 4:2:0 (BT.601) and run the YUV path\n"
+        "  --internal-ref     make the ref of each frame with the internal downscaler, timed with the frame\n"
+        "  --max-memory MB    memory budget of a frame, the guided filter runs in strips to fit\n"
+        "  --csv              print comma separated values");
+}
+
+static bool parseSize(const std::string& text, Size& size, bool allowFull)
+{
+    if (text == "720p")
+        size = { 1280, 720 };
+    else if (text == "1080p")
+        size = { 1920, 1080 };
+    else if (text == "4k" || text == "4K")
+        size = { 3840, 2160 };
+    else if (text == "8k" || text == "8K")
+        size = { 7680, 4320 };
+    else if (allowFull && text == "full")
+        size = { 0, 0 };
+    else if (std::sscanf(text.c_str(), "%dx%d", &size.width, &size.height) != 2 || size.width < 1 || size.height < 1)
+        return false;
+
+    return true;
+}
+
+static std::vector<std::string> split(const std::string& text)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+
+    while (start <= text.size())
+    {
+        const size_t end = std::min(text.find(',', start), text.size());
+        if (end > start)
+            items.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+
+    return items;
+}
+
+static bool parseOptions(int argc, char** argv, Options& opt)
+{
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool consumed = true;
+
+        if (arg == "--stream")
+            opt.stream = true, consumed = false;
+        else if (arg == "--post")
+            opt.post = true, consumed = false;
+        else if (arg == "--yuv420")
+            opt.yuv420 = true, consumed = false;
+        else if (arg == "--internal-ref")
+            opt.internal_ref = true, consumed = false;
+        else if (arg == "--csv")
+            opt.csv = true, consumed = false;
+        else if (value == nullptr)
+            return false;
+        else if (arg == "--size" || arg == "--ref")
+        {
+            std::vector<Size>& list = arg == "--size" ? opt.sizes : opt.refs;
+            list.clear();
+            for (const auto& item : split(value))
+            {
+                Size size;
+                if (!parseSize(item, size, arg == "--ref"))
+                    return false;
+                list.push_back(size);
+            }
+        }
+        else if (arg == "--bits" || arg == "--threads")
+        {
+            std::vector<int>& list = arg == "--bits" ? opt.bits : opt.threads;
+            list.clear();
+            for (const auto& item : split(value))
+                list.push_back(std::atoi(item.c_str()));
+        }
+        else if (arg == "--frames")
+            opt.frames = std::atoi(value);
+        else if (arg == "--warmup")
+            opt.warmup = std::atoi(value);
+        else if (arg == "--input")
+            opt.input = value;
+        else if (arg == "--trans")
+            opt.trans = (float)std::atof(value);
+        else if (arg == "--trans-step")
+            opt.trans_step = (float)std::atof(value);
+        else if (arg == "--gamma")
+            opt.gamma = (float)std::atof(value);
+        else if (arg == "--guide-size")
+            opt.guide_size = std::atoi(value);
+        else if (arg == "--guide-step")
+            opt.guide_step = std::atoi(value);
+        else if (arg == "--guide-mode")
+            opt.guide_mode = std::atoi(value);
+        else if (arg == "--max-memory")
+            opt.max_memory = std::atoi(value);
+        else
+            return false;
+
+        if (consumed)
+            i++;
+    }
+
+    for (auto bits : opt.bits)
+        if (bits < 8 || bits > 16)
+            return false;
+    for (auto threads : opt.threads)
+        if (threads < 1)
+            return false;
+    // 4:2:0 frames have even sizes
+    for (const auto& size : opt.sizes)
+        if (opt.yuv420 && (size.width % 2 != 0 || size.height % 2 != 0))
+            return false;
+
+    return !opt.sizes.empty() && !opt.bits.empty() && !opt.refs.empty() && opt.frames > 0 && opt.warmup >= 0 && opt.trans_step > 0.f && opt.guide_step >= 1 && opt.guide_mode >= 0 && opt.guide_mode <= 1 && opt.max_memory >= 0;
+}
+
+// Peak resident set size in MB. On Linux the peak is reset before each run, elsewhere it is the peak of the process
+static double peakRSS()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1048576.0;
+#else
+    // getrusage keeps the peak of the whole process, the VmHWM line of /proc follows clear_refs
+    FILE* file = std::fopen("/proc/self/status", "r");
+    if (file != nullptr)
+    {
+        char line[256];
+        long kb = -1;
+        while (std::fgets(line, sizeof(line), file) != nullptr)
+            if (std::sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+        std::fclose(file);
+        if (kb >= 0)
+            return kb / 1024.0;
+    }
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static void resetPeakRSS()
+{
+#if defined(__linux__)
+    FILE* file = std::fopen("/proc/self/clear_refs", "w");
+    if (file != nullptr)
+    {
+        std::fputs("5", file);
+        std::fclose(file);
+    }
+#endif
+}
+
+// Hazy test frames: a textured scene behind haze that thickens towards the bottom, shifted for each frame
+template <typename T>
+static void synthesize(Frame<T>& frame, int width, int height, int peak, int index)
+{
+    frame.width = width;
+    frame.height = height;
+
+    for (auto c = 0; c < 3; c++)
+        frame.planes[c].resize((size_t)width * height);
+
+    for (auto j = 0; j < height; j++)
+    {
+        const float fHaze = 0.3f + 0.6f * j / height;
+        const float fY = j * 1080.f / height;
+
+        for (auto i = 0; i < width; i++)
+        {
+            const float fX = i * 1920.f / width + 4.f * index;
+            const float fBase = 0.5f + 0.4f * std::sin(fX * 0.05f) * std::cos(fY * 0.07f);
+            const float afScene[3] = { 1.f - fBase * 0.7f, fBase * 0.8f + 0.1f * std::sin(fY * 0.01f), fBase };
+
+            for (auto c = 0; c < 3; c++)
+            {
+                const float fValue = afScene[c] * (1.f - fHaze) + fHaze * (0.93f + 0.02f * (2 - c));
+                frame.planes[c][(size_t)j * width + i] = (T)clamp((int)(fValue * peak), 0, peak);
+            }
+        }
+    }
+}
+
+template <typename T>
+static bool readFrames(const std::string& path, std::vector<Frame<T>>& frames, int width, int height, int count)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+
+    const size_t planeSize = (size_t)width * height;
+
+    while ((int)frames.size() < count)
+    {
+        Frame<T> frame;
+        frame.width = width;
+        frame.height = height;
+
+        bool complete = true;
+        for (auto c = 0; c < 3 && complete; c++)
+        {
+            frame.planes[c].resize(planeSize);
+            complete = std::fread(frame.planes[c].data(), sizeof(T), planeSize, file) == planeSize;
+        }
+
+        if (!complete)
+            break;
+        frames.push_back(std::move(frame));
+    }
+
+    std::fclose(file);
+    return !frames.empty();
+}
+
+// Area average downscale, the ref clip of the run
+template <typename T>
+static void downscale(const Frame<T>& src, Frame<T>& dst, int width, int height)
+{
+    dst.width = width;
+    dst.height = height;
+
+    for (auto c = 0; c < 3; c++)
+    {
+        dst.planes[c].resize((size_t)width * height);
+
+        for (auto y = 0; y < height; y++)
+        {
+            const int nStartY = (int)((int64_t)y * src.height / height);
+            const int nEndY = std::max((int)((int64_t)(y + 1) * src.height / height), nStartY + 1);
+
+            for (auto x = 0; x < width; x++)
+            {
+                const int nStartX = (int)((int64_t)x * src.width / width);
+                const int nEndX = std::max((int)((int64_t)(x + 1) * src.width / width), nStartX + 1);
+
+                double dSum = 0.0;
+                for (auto j = nStartY; j < nEndY; j++)
+                    for (auto i = nStartX; i < nEndX; i++)
+                        dSum += src.planes[c][(size_t)j * src.width + i];
+
+                dst.planes[c][(size_t)y * width + x] = (T)(dSum / ((nEndY - nStartY) * (nEndX - nStartX)) + 0.5);
+            }
+        }
+    }
+}
+
+// Full range BT.601 YUV 4:2:0, the chroma of each 2x2 block is the mean of its samples
+template <typename T>
+static void toYUV420(Frame<T>& frame, int peak)
+{
+    const int nChromaW = frame.width / 2;
+    const int nChromaH = frame.height / 2;
+    const float fMid = (float)((peak + 1) / 2);
+
+    std::vector<T> planeY((size_t)frame.width * frame.height);
+    std::vector<T> planeU((size_t)nChromaW * nChromaH);
+    std::vector<T> planeV((size_t)nChromaW * nChromaH);
+
+    for (auto y = 0; y < nChromaH; y++)
+    {
+        for (auto x = 0; x < nChromaW; x++)
+        {
+            float fSumU = 0.f;
+            float fSumV = 0.f;
+
+            for (auto j = 2 * y; j < 2 * y + 2; j++)
+            {
+                for (auto i = 2 * x; i < 2 * x + 2; i++)
+                {
+                    const size_t pos = (size_t)j * frame.width + i;
+                    const float fR = frame.planes[0][pos];
+                    const float fG = frame.planes[1][pos];
+                    const float fB = frame.planes[2][pos];
+                    const float fY = 0.299f * fR + 0.587f * fG + 0.114f * fB;
+
+                    planeY[pos] = (T)clamp((int)(fY + 0.5f), 0, peak);
+                    fSumU += 0.564f * (fB - fY);
+                    fSumV += 0.713f * (fR - fY);
+                }
+            }
+
+            planeU[(size_t)y * nChromaW + x] = (T)clamp((int)(fSumU * 0.25f + fMid + 0.5f), 0, peak);
+            planeV[(size_t)y * nChromaW + x] = (T)clamp((int)(fSumV * 0.25f + fMid + 0.5f), 0, peak);
+        }
+    }
+
+    frame.planes[0] = std::move(planeY);
+    frame.planes[1] = std::move(planeU);
+    frame.planes[2] = std::move(planeV);
+}
+
+static double percentile(std::vector<double> values, double fraction)
+{
+    std::sort(values.begin(), values.end());
+    const size_t index = std::min((size_t)(fraction * (values.size() - 1) + 0.5), values.size() - 1);
+    return values[index];
+}
+
+template <typename T>
+static bool run(const Options& opt, Size size, int bits, Size refSize, int threads)
+{
+    const int peak = (1 << bits) - 1;
+    const Size ref = refSize.width == 0 ? size : Size{ std::min(refSize.width, size.width), std::min(refSize.height, size.height) };
+
+    // A few distinct frames are cycled so that the airlight and transmission change between frames
+    std::vector<Frame<T>> frames;
+    if (!opt.input.empty())
+    {
+        if (!readFrames(opt.input, frames, size.width, size.height, 8))
+        {
+            std::fprintf(stderr, "cannot read a %dx%d %d bit frame from %s\n", size.width, size.height, bits, opt.input.c_str());
+            return false;
+        }
+    }
+    else
+    {
+        frames.resize(4);
+        for (auto k = 0; k < (int)frames.size(); k++)
+            synthesize(frames[k], size.width, size.height, peak, k);
+    }
+
+    std::vector<Frame<T>> refs(frames.size());
+    for (size_t k = 0; k < frames.size(); k++)
+    {
+        if (ref.width == size.width && ref.height == size.height)
+            refs[k] = frames[k];
+        else
+            downscale(frames[k], refs[k], ref.width, ref.height);
+    }
+
+    const int chroma_width = opt.yuv420 ? size.width / 2 : size.width;
+    const int chroma_height = opt.yuv420 ? size.height / 2 : size.height;
+
+    if (opt.yuv420)
+    {
+        for (size_t k = 0; k < frames.size(); k++)
+        {
+            toYUV420(frames[k], peak);
+            toYUV420(refs[k], peak);
+        }
+    }
+
+    Frame<T> out;
+    out.planes[0].resize((size_t)size.width * size.height);
+    for (auto c = 1; c < 3; c++)
+        out.planes[c].resize((size_t)chroma_width * chroma_height);
+
+    resetPeakRSS();
+
+    dehazing* dehazing_clip = new dehazing(size.width, size.height, ref.width, ref.height, bits, 200, 16, opt.trans, opt.trans_step, false, opt.post,
+        5.0, 1.f, opt.guide_size, opt.guide_step, opt.stream, opt.guide_mode == 1, threads);
+    dehazing_clip->GammaLUTMaker(opt.gamma);
+    if (opt.yuv420)
+        dehazing_clip->SetYUV(1, 1);
+    const bool internal_ref = opt.internal_ref && (ref.width != size.width || ref.height != size.height);
+    if (internal_ref)
+        dehazing_clip->SetRefDownscale();
+    if (opt.max_memory > 0 && !dehazing_clip->FitMemory((size_t)opt.max_memory << 20))
+        std::fprintf(stderr, "%dx%d: a frame takes at least %zu MB, above --max-memory\n", size.width, size.height,
+            (dehazing_clip->FrameFootprint(dehazing_clip->StripHeight()) >> 20) + 1);
+    DehazeContext* ctx = dehazing_clip->CreateContext();
+
+    std::vector<double> latency;
+    double total = 0.0;
+
+    for (auto n = 0; n < opt.warmup + opt.frames; n++)
+    {
+        const Frame<T>& src = frames[n % frames.size()];
+        const Frame<T>& rf = refs[n % refs.size()];
+
+        const auto start = std::chrono::steady_clock::now();
+
+        // Planes B, G, R of the ref, YUV input has its luma in all three
+        const T* refp[3] = { rf.planes[opt.yuv420 ? 0 : 2].data(), rf.planes[opt.yuv420 ? 0 : 1].data(), rf.planes[0].data() };
+        if (internal_ref)
+        {
+            dehazing_clip->DownscaleRef(*ctx, src.planes[opt.yuv420 ? 0 : 2].data(), src.planes[opt.yuv420 ? 0 : 1].data(), src.planes[0].data(), size.width);
+            for (auto c = 0; c < 3; c++)
+                refp[c] = dehazing_clip->RefPlane<T>(*ctx, c);
+        }
+
+        if (opt.yuv420)
+        {
+            dehazing_clip->AirlightEstimationYUV(*ctx, src.planes[0].data(), src.planes[1].data(), src.planes[2].data(), size.width, chroma_width);
+            dehazing_clip->EstimateTransmission(*ctx, refp[0], refp[1], refp[2], ref.width, nullptr);
+            dehazing_clip->RefineTransmission(*ctx, src.planes[0].data(), src.planes[0].data(), src.planes[0].data(), size.width);
+            dehazing_clip->RestoreImageYUV(*ctx, src.planes[0].data(), src.planes[1].data(), src.planes[2].data(), size.width, chroma_width,
+                out.planes[0].data(), out.planes[1].data(), out.planes[2].data(), size.width, chroma_width);
+        }
+        else
+        {
+            dehazing_clip->AirlightEstimation(*ctx, src.planes[2].data(), src.planes[1].data(), src.planes[0].data(), size.width);
+            dehazing_clip->RemoveHaze(*ctx, src.planes[2].data(), src.planes[1].data(), src.planes[0].data(), size.width,
+                refp[0], refp[1], refp[2], ref.width,
+                out.planes[2].data(), out.planes[1].data(), out.planes[0].data(), size.width, nullptr);
+        }
+
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (n >= opt.warmup)
+        {
+            latency.push_back(ms);
+            total += ms;
+        }
+    }
+
+    const double rss = peakRSS();
+
+    delete ctx;
+    delete dehazing_clip;
+
+    const double fps = 1000.0 * opt.frames / total;
+    const double p50 = percentile(latency, 0.5);
+    const double p90 = percentile(latency, 0.9);
+    const double p99 = percentile(latency, 0.99);
+    const double pmax = *std::max_element(latency.begin(), latency.end());
+
+    if (opt.csv)
+        std::printf("%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f\n", size.width, size.height, bits, ref.width, ref.height, threads,
+            fps, p50, p90, p99, pmax, rss);
+    else
+        std::printf("%5dx%-5d %2d bit  ref %5dx%-5d %3d thr  %8.2f fps  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms  rss %8.1f MB\n",
+            size.width, size.height, bits, ref.width, ref.height, threads, fps, p50, p90, p99, pmax, rss);
+    std::fflush(stdout);
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    if (!parseOptions(argc, argv, opt))
+    {
+        usage();
+        return 1;
+    }
+
+    if (opt.threads.empty())
+    {
+        const int maxThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        for (auto threads = 1; threads < maxThreads; threads *= 2)
+            opt.threads.push_back(threads);
+        opt.threads.push_back(maxThreads);
+    }
+
+    // A raw file holds frames of a single format
+    if (!opt.input.empty())
+    {
+        opt.sizes.resize(1);
+        opt.bits.resize(1);
+    }
+
+    if (opt.csv)
+        std::puts("width,height,bits,ref_width,ref_height,threads,fps,p50_ms,p90_ms,p99_ms,max_ms,peak_rss_mb");
+
+    for (const auto& size : opt.sizes)
+        for (auto bits : opt.bits)
+            for (const auto& ref : opt.refs)
+                for (auto threads : opt.threads)
+                {
+                    const bool ok = bits == 8 ? run<uint8_t>(opt, size, bits, ref, threads) : run<uint16_t>(opt, size, bits, ref, threads);
+                    if (!ok)
+                        return 1;
+                }
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "AnalysisCache.hpp"
+
+static const char CACHE_MAGIC[8] = { 'D', 'H', 'C', 'E', 'A', 'N', 'A', '1' };
+
+// File layout: the header, then one record per frame. A record is a valid flag, the airlight (B, G, R)
+// and the 16 bit transmission, padded to 8 bytes. Records of frames not analysed yet are zero.
+struct CacheHeader
+{
+    char acMagic[8];
+    uint32_t nRecordSize;
+    AnalysisKey key;
+};
+
+static const size_t RECORD_HEADER = sizeof(uint32_t) + 3 * sizeof(float);
+
+AnalysisCache::AnalysisCache(const std::string& path, const AnalysisKey& key)
+{
+    m_nFrames = key.nFrames;
+    m_nCount = key.nRefWidth * key.nRefHeight;
+    m_nRecordSize = (RECORD_HEADER + m_nCount * sizeof(uint16_t) + 7) & ~(size_t)7;
+    m_nSize = sizeof(CacheHeader) + m_nRecordSize * m_nFrames;
+
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.acMagic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.nRecordSize = (uint32_t)m_nRecordSize;
+    header.key = key;
+
+    CacheHeader existing;
+    std::memset(&existing, 0, sizeof(existing));
+
+#if defined(_WIN32)
+    const int nLength = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    std::wstring wpath(nLength > 0 ? nLength : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], nLength);
+
+    m_hFile = CreateFileW(wpath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        throw std::string("cannot open \"cache_file\" " + path);
+
+    LARGE_INTEGER nFileSize;
+    DWORD nRead = 0;
+    const bool bValid = GetFileSizeEx(m_hFile, &nFileSize) && (size_t)nFileSize.QuadPart == m_nSize &&
+                        ReadFile(m_hFile, &existing, sizeof(existing), &nRead, nullptr) && nRead == sizeof(existing) &&
+                        std::memcmp(&existing, &header, sizeof(header)) == 0;
+
+    // Another clip or other parameters, the file is cleared. Extending a file fills it with zeros.
+    if (!bValid)
+    {
+        LARGE_INTEGER nPos;
+        nPos.QuadPart = 0;
+        DWORD nWritten = 0;
+        bool bOk = SetFilePointerEx(m_hFile, nPos, nullptr, FILE_BEGIN) && SetEndOfFile(m_hFile);
+        nPos.QuadPart = (LONGLONG)m_nSize;
+        bOk = bOk && SetFilePointerEx(m_hFile, nPos, nullptr, FILE_BEGIN) && SetEndOfFile(m_hFile);
+        nPos.QuadPart = 0;
+        bOk = bOk && SetFilePointerEx(m_hFile, nPos, nullptr, FILE_BEGIN) &&
+              WriteFile(m_hFile, &header, sizeof(header), &nWritten, nullptr) && nWritten == sizeof(header);
+        if (!bOk)
+        {
+            CloseHandle(m_hFile);
+            throw std::string("cannot resize \"cache_file\" " + path);
+        }
+    }
+
+    m_hMapping = CreateFileMappingW(m_hFile, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    m_pMap = m_hMapping != nullptr ? static_cast<uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, m_nSize)) : nullptr;
+    if (m_pMap == nullptr)
+    {
+        if (m_hMapping != nullptr)
+            CloseHandle(m_hMapping);
+        CloseHandle(m_hFile);
+        throw std::string("cannot map \"cache_file\" " + path);
+    }
+#else
+    m_nFile = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_nFile < 0)
+        throw std::string("cannot open \"cache_file\" " + path);
+
+    struct stat status;
+    const bool bValid = fstat(m_nFile, &status) == 0 && (size_t)status.st_size == m_nSize &&
+                        pread(m_nFile, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+                        std::memcmp(&existing, &header, sizeof(header)) == 0;
+
+    // Another clip or other parameters, the file is cleared. Extending a file fills it with zeros.
+    if (!bValid)
+    {
+        if (ftruncate(m_nFile, 0) != 0 || ftruncate(m_nFile, (off_t)m_nSize) != 0 ||
+            pwrite(m_nFile, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        {
+            close(m_nFile);
+            throw std::string("cannot resize \"cache_file\" " + path);
+        }
+    }
+
+    void* pMap = mmap(nullptr, m_nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFile, 0);
+    if (pMap == MAP_FAILED)
+    {
+        close(m_nFile);
+        throw std::string("cannot map \"cache_file\" " + path);
+    }
+    m_pMap = static_cast<uint8_t*>(pMap);
+#endif
+}
+
+AnalysisCache::~AnalysisCache()
+{
+#if defined(_WIN32)
+    FlushViewOfFile(m_pMap, 0);
+    UnmapViewOfFile(m_pMap);
+    CloseHandle(m_hMapping);
+    CloseHandle(m_hFile);
+#else
+    msync(m_pMap, m_nSize, MS_ASYNC);
+    munmap(m_pMap, m_nSize);
+    close(m_nFile);
+#endif
+}
+
+uint8_t* AnalysisCache::Record(int n) const
+{
+    return m_pMap + sizeof(CacheHeader) + m_nRecordSize * n;
+}
+
+bool AnalysisCache::Load(int n, float* pfAirlight, float* pfSmallTrans) const
+{
+    if (n < 0 || n >= m_nFrames)
+        return false;
+
+    const uint8_t* pRecord = Record(n);
+
+    uint32_t nValid;
+    std::memcpy(&nValid, pRecord, sizeof(nValid));
+    if (nValid == 0)
+        return false;
+
+    // The flag is written last by Store
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    std::memcpy(pfAirlight, pRecord + sizeof(uint32_t), 3 * sizeof(float));
+
+    const uint16_t* pnTrans = reinterpret_cast<const uint16_t*>(pRecord + RECORD_HEADER);
+    for (auto i = 0; i < m_nCount; i++)
+        pfSmallTrans[i] = pnTrans[i] / 65535.f;
+
+    return true;
+}
+
+void AnalysisCache::Store(int n, const float* pfAirlight, float* pfSmallTrans)
+{
+    if (n < 0 || n >= m_nFrames)
+        return;
+
+    uint8_t* pRecord = Record(n);
+
+    std::memcpy(pRecord + sizeof(uint32_t), pfAirlight, 3 * sizeof(float));
+
+    uint16_t* pnTrans = reinterpret_cast<uint16_t*>(pRecord + RECORD_HEADER);
+    for (auto i = 0; i < m_nCount; i++)
+    {
+        pnTrans[i] = (uint16_t)(std::min(std::max(pfSmallTrans[i], 0.f), 1.f) * 65535.f + 0.5f);
+        pfSmallTrans[i] = pnTrans[i] / 65535.f;
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const uint32_t nValid = 1;
+    std::memcpy(pRecord, &nValid, sizeof(nValid));
+}
@@ -0,0 +1,62 @@
+#ifndef ANALYSISCACHE_HPP_
+#define ANALYSISCACHE_HPP_
+
+#include <cstdint>
+#include <string>
+
+// Parameters that decide the airlight and block transmission of a frame. A cache file is only reused
+// when all of them match, otherwise it is cleared.
+struct AnalysisKey
+{
+    int32_t nWidth;
+    int32_t nHeight;
+    int32_t nRefWidth;
+    int32_t nRefHeight;
+    int32_t nBits;
+    int32_t nFormat;
+    int32_t nFrames;
+    int32_t nABlockSize;
+    int32_t nAirInterval;
+    int32_t nTBlockSize;
+    int32_t nTemporal;
+    float fTransInit;
+    float fTransStep;
+    float fLambda1;
+    float fLambda2;
+};
+
+// Memory-mapped file of per-frame analysis: the airlight (B, G, R, or V, U, Y of YUV input) and the block transmission at ref resolution,
+// quantized to 16 bit. Records are written as frames are processed and read in place by later runs.
+// Each frame has its own record, so concurrent frames never write the same bytes.
+class AnalysisCache
+{
+public:
+    // Open or create the file, throws std::string on failure
+    AnalysisCache(const std::string& path, const AnalysisKey& key);
+    ~AnalysisCache();
+
+    // Airlight and transmission of frame n, false if the frame was not analysed yet
+    bool Load(int n, float* pfAirlight, float* pfSmallTrans) const;
+
+    // Write the record of frame n. pfSmallTrans is replaced by its quantized value,
+    // so that a frame gives the same output whether it was analysed or read from the cache.
+    void Store(int n, const float* pfAirlight, float* pfSmallTrans);
+
+private:
+    uint8_t* Record(int n) const;
+
+    int m_nFrames;
+    int m_nCount;               // Transmission samples of a record
+    size_t m_nRecordSize;
+    size_t m_nSize;
+
+    uint8_t* m_pMap;
+#if defined(_WIN32)
+    void* m_hFile;
+    void* m_hMapping;
+#else
+    int m_nFile;
+#endif
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <algorithm>
+#include <immintrin.h>
+
+static inline void Transpose8x8(__m256& v0, __m256& v1, __m256& v2, __m256& v3, __m256& v4, __m256& v5, __m256& v6, __m256& v7)
+{
+    __m256 t0 = _mm256_unpacklo_ps(v0, v1);
+    __m256 t1 = _mm256_unpackhi_ps(v0, v1);
+    __m256 t2 = _mm256_unpacklo_ps(v2, v3);
+    __m256 t3 = _mm256_unpackhi_ps(v2, v3);
+    __m256 t4 = _mm256_unpacklo_ps(v4, v5);
+    __m256 t5 = _mm256_unpackhi_ps(v4, v5);
+    __m256 t6 = _mm256_unpacklo_ps(v6, v7);
+    __m256 t7 = _mm256_unpackhi_ps(v6, v7);
+
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    v0 = _mm256_permute2f128_ps(s0, s4, 0x20);
+    v1 = _mm256_permute2f128_ps(s1, s5, 0x20);
+    v2 = _mm256_permute2f128_ps(s2, s6, 0x20);
+    v3 = _mm256_permute2f128_ps(s3, s7, 0x20);
+    v4 = _mm256_permute2f128_ps(s0, s4, 0x31);
+    v5 = _mm256_permute2f128_ps(s1, s5, 0x31);
+    v6 = _mm256_permute2f128_ps(s2, s6, 0x31);
+    v7 = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+/*
+    Function: BoxFilterVertical_AVX2
+    Description: vertical pass of BoxFilter, 8 columns per instruction.
+ */
+void BoxFilterVertical_AVX2(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
+{
+    const int nVecWidth = width & ~7;
+
+    // Cumulative sum over Y axis
+    for (auto i = 0; i < width; i++)
+        pfArrayCum[i] = pfInArray[i];
+
+    for (auto j = 1; j < height; j++)
+    {
+        const float* pfIn = pfInArray + j * stride;
+        const float* pfPrev = pfArrayCum + (j - 1) * stride;
+        float* pfCum = pfArrayCum + j * stride;
+
+        int i = 0;
+        for (; i < nVecWidth; i += 8)
+            _mm256_storeu_ps(pfCum + i, _mm256_add_ps(_mm256_loadu_ps(pfPrev + i), _mm256_loadu_ps(pfIn + i)));
+        for (; i < width; i++)
+            pfCum[i] = pfPrev[i] + pfIn[i];
+    }
+
+    // Difference over Y axis
+    for (auto j = 0; j < height; j++)
+    {
+        const float* pfHi = pfArrayCum + std::min(j + nR, height - 1) * stride;
+        float* pfOut = pfOutArray + j * stride;
+
+        if (j - nR - 1 < 0)
+        {
+            for (auto i = 0; i < width; i++)
+                pfOut[i] = pfHi[i];
+            continue;
+        }
+
+        const float* pfLo = pfArrayCum + (j - nR - 1) * stride;
+
+        int i = 0;
+        for (; i < nVecWidth; i += 8)
+            _mm256_storeu_ps(pfOut + i, _mm256_sub_ps(_mm256_loadu_ps(pfHi + i), _mm256_loadu_ps(pfLo + i)));
+        for (; i < width; i++)
+            pfOut[i] = pfHi[i] - pfLo[i];
+    }
+
+    _mm256_zeroupper();
+}
+
+/*
+    Function: BoxFilterHorizontal_AVX2
+    Description: horizontal pass of BoxFilter. The cumulative sum runs over blocks of 8 rows,
+        each 8x8 tile is transposed so that one add advances the running sums of 8 rows.
+ */
+void BoxFilterHorizontal_AVX2(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
+{
+    const int nVecWidth = width & ~7;
+    const int nVecHeight = height & ~7;
+
+    // Cumulative sum over X axis
+    for (auto j = 0; j < nVecHeight; j += 8)
+    {
+        const float* pfIn = pfInArray + j * stride;
+        float* pfCum = pfArrayCum + j * stride;
+        __m256 vAcc = _mm256_setzero_ps();
+
+        int i = 0;
+        for (; i < nVecWidth; i += 8)
+        {
+            __m256 v0 = _mm256_loadu_ps(pfIn + i);
+            __m256 v1 = _mm256_loadu_ps(pfIn + stride + i);
+            __m256 v2 = _mm256_loadu_ps(pfIn + 2 * stride + i);
+            __m256 v3 = _mm256_loadu_ps(pfIn + 3 * stride + i);
+            __m256 v4 = _mm256_loadu_ps(pfIn + 4 * stride + i);
+            __m256 v5 = _mm256_loadu_ps(pfIn + 5 * stride + i);
+            __m256 v6 = _mm256_loadu_ps(pfIn + 6 * stride + i);
+            __m256 v7 = _mm256_loadu_ps(pfIn + 7 * stride + i);
+            Transpose8x8(v0, v1, v2, v3, v4, v5, v6, v7);
+
+            v0 = vAcc = _mm256_add_ps(vAcc, v0);
+            v1 = vAcc = _mm256_add_ps(vAcc, v1);
+            v2 = vAcc = _mm256_add_ps(vAcc, v2);
+            v3 = vAcc = _mm256_add_ps(vAcc, v3);
+            v4 = vAcc = _mm256_add_ps(vAcc, v4);
+            v5 = vAcc = _mm256_add_ps(vAcc, v5);
+            v6 = vAcc = _mm256_add_ps(vAcc, v6);
+            v7 = vAcc = _mm256_add_ps(vAcc, v7);
+
+            Transpose8x8(v0, v1, v2, v3, v4, v5, v6, v7);
+            _mm256_storeu_ps(pfCum + i, v0);
+            _mm256_storeu_ps(pfCum + stride + i, v1);
+            _mm256_storeu_ps(pfCum + 2 * stride + i, v2);
+            _mm256_storeu_ps(pfCum + 3 * stride + i, v3);
+            _mm256_storeu_ps(pfCum + 4 * stride + i, v4);
+            _mm256_storeu_ps(pfCum + 5 * stride + i, v5);
+            _mm256_storeu_ps(pfCum + 6 * stride + i, v6);
+            _mm256_storeu_ps(pfCum + 7 * stride + i, v7);
+        }
+
+        alignas(32) float afAcc[8];
+        _mm256_store_ps(afAcc, vAcc);
+
+        for (auto k = 0; k < 8; k++)
+        {
+            float fAcc = afAcc[k];
+            for (auto x = i; x < width; x++)
+            {
+                fAcc += pfIn[k * stride + x];
+                pfCum[k * stride + x] = fAcc;
+            }
+        }
+    }
+
+    for (auto j = nVecHeight; j < height; j++)
+    {
+        pfArrayCum[j * stride] = pfInArray[j * stride];
+        for (auto i = 1; i < width; i++)
+            pfArrayCum[j * stride + i] = pfArrayCum[j * stride + i - 1] + pfInArray[j * stride + i];
+    }
+
+    // Difference over X axis
+    for (auto j = 0; j < height; j++)
+    {
+        const float* pfCum = pfArrayCum + j * stride;
+        float* pfOut = pfOutArray + j * stride;
+
+        for (auto i = 0; i < nR + 1; i++)
+            pfOut[i] = pfCum[i + nR];
+
+        int i = nR + 1;
+        for (; i + 8 <= width - nR; i += 8)
+            _mm256_storeu_ps(pfOut + i, _mm256_sub_ps(_mm256_loadu_ps(pfCum + i + nR), _mm256_loadu_ps(pfCum + i - nR - 1)));
+        for (; i < width - nR; i++)
+            pfOut[i] = pfCum[i + nR] - pfCum[i - nR - 1];
+
+        for (i = width - nR; i < width; i++)
+            pfOut[i] = pfCum[width - 1] - pfCum[i - nR - 1];
+    }
+
+    _mm256_zeroupper();
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <algorithm>
+#include <smmintrin.h>
+
+/*
+    Function: BoxFilterVertical_SSE41
+    Description: vertical pass of BoxFilter, 4 columns per instruction.
+ */
+void BoxFilterVertical_SSE41(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
+{
+    const int nVecWidth = width & ~3;
+
+    // Cumulative sum over Y axis
+    for (auto i = 0; i < width; i++)
+        pfArrayCum[i] = pfInArray[i];
+
+    for (auto j = 1; j < height; j++)
+    {
+        const float* pfIn = pfInArray + j * stride;
+        const float* pfPrev = pfArrayCum + (j - 1) * stride;
+        float* pfCum = pfArrayCum + j * stride;
+
+        int i = 0;
+        for (; i < nVecWidth; i += 4)
+            _mm_storeu_ps(pfCum + i, _mm_add_ps(_mm_loadu_ps(pfPrev + i), _mm_loadu_ps(pfIn + i)));
+        for (; i < width; i++)
+            pfCum[i] = pfPrev[i] + pfIn[i];
+    }
+
+    // Difference over Y axis
+    for (auto j = 0; j < height; j++)
+    {
+        const float* pfHi = pfArrayCum + std::min(j + nR, height - 1) * stride;
+        float* pfOut = pfOutArray + j * stride;
+
+        if (j - nR - 1 < 0)
+        {
+            for (auto i = 0; i < width; i++)
+                pfOut[i] = pfHi[i];
+            continue;
+        }
+
+        const float* pfLo = pfArrayCum + (j - nR - 1) * stride;
+
+        int i = 0;
+        for (; i < nVecWidth; i += 4)
+            _mm_storeu_ps(pfOut + i, _mm_sub_ps(_mm_loadu_ps(pfHi + i), _mm_loadu_ps(pfLo + i)));
+        for (; i < width; i++)
+            pfOut[i] = pfHi[i] - pfLo[i];
+    }
+}
+
+/*
+    Function: BoxFilterHorizontal_SSE41
+    Description: horizontal pass of BoxFilter. The cumulative sum runs over blocks of 4 rows,
+        each 4x4 tile is transposed so that one add advances the running sums of 4 rows.
+ */
+void BoxFilterHorizontal_SSE41(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
+{
+    const int nVecWidth = width & ~3;
+    const int nVecHeight = height & ~3;
+
+    // Cumulative sum over X axis
+    for (auto j = 0; j < nVecHeight; j += 4)
+    {
+        const float* pfIn = pfInArray + j * stride;
+        float* pfCum = pfArrayCum + j * stride;
+        __m128 vAcc = _mm_setzero_ps();
+
+        int i = 0;
+        for (; i < nVecWidth; i += 4)
+        {
+            __m128 v0 = _mm_loadu_ps(pfIn + i);
+            __m128 v1 = _mm_loadu_ps(pfIn + stride + i);
+            __m128 v2 = _mm_loadu_ps(pfIn + 2 * stride + i);
+            __m128 v3 = _mm_loadu_ps(pfIn + 3 * stride + i);
+            _MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+
+            v0 = vAcc = _mm_add_ps(vAcc, v0);
+            v1 = vAcc = _mm_add_ps(vAcc, v1);
+            v2 = vAcc = _mm_add_ps(vAcc, v2);
+            v3 = vAcc = _mm_add_ps(vAcc, v3);
+
+            _MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+            _mm_storeu_ps(pfCum + i, v0);
+            _mm_storeu_ps(pfCum + stride + i, v1);
+            _mm_storeu_ps(pfCum + 2 * stride + i, v2);
+            _mm_storeu_ps(pfCum + 3 * stride + i, v3);
+        }
+
+        alignas(16) float afAcc[4];
+        _mm_store_ps(afAcc, vAcc);
+
+        for (auto k = 0; k < 4; k++)
+        {
+            float fAcc = afAcc[k];
+            for (auto x = i; x < width; x++)
+            {
+                fAcc += pfIn[k * stride + x];
+                pfCum[k * stride + x] = fAcc;
+            }
+        }
+    }
+
+    for (auto j = nVecHeight; j < height; j++)
+    {
+        pfArrayCum[j * stride] = pfInArray[j * stride];
+        for (auto i = 1; i < width; i++)
+            pfArrayCum[j * stride + i] = pfArrayCum[j * stride + i - 1] + pfInArray[j * stride + i];
+    }
+
+    // Difference over X axis
+    for (auto j = 0; j < height; j++)
+    {
+        const float* pfCum = pfArrayCum + j * stride;
+        float* pfOut = pfOutArray + j * stride;
+
+        for (auto i = 0; i < nR + 1; i++)
+            pfOut[i] = pfCum[i + nR];
+
+        int i = nR + 1;
+        for (; i + 4 <= width - nR; i += 4)
+            _mm_storeu_ps(pfOut + i, _mm_sub_ps(_mm_loadu_ps(pfCum + i + nR), _mm_loadu_ps(pfCum + i - nR - 1)));
+        for (; i < width - nR; i++)
+            pfOut[i] = pfCum[i + nR] - pfCum[i - nR - 1];
+
+        for (i = width - nR; i < width; i++)
+            pfOut[i] = pfCum[width - 1] - pfCum[i - nR - 1];
+    }
+}
+
+#endif
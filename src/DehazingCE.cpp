@@ -1,16 +1,38 @@
+#include <chrono>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
 #include "DehazingCE.hpp"
 #include "Helper.hpp"
 
-constexpr float SQRT_3 = 1.733f;
+// Sample value accumulated in the airlight tables, float input is quantized to 16 bit
+template <typename T>
+static inline uint64_t AirlightSample(T value)
+{
+    return value;
+}
 
-dehazing::dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABlockSize, int nTBlockSize, float fTransInit, bool bPrevFlag, bool bPosFlag, double dL1, float fL2, int nGBlockSize)
+static inline uint64_t AirlightSample(float value)
+{
+    return (uint64_t)(clamp(value, 0.f, 1.f) * 65535.f + 0.5f);
+}
+
+// Microseconds elapsed since tStart on the monotonic clock
+static inline int64_t ElapsedMicroseconds(std::chrono::steady_clock::time_point tStart)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+dehazing::dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABlockSize, int nTBlockSize, float fTransInit, float fTransStep, bool bPrevFlag, bool bPosFlag, double dL1, float fL2, int nGBlockSize, int nGStepSize, bool bStreamFlag, bool bLumaGuide, int nThreads)
 {
     width = nW;
     height = nH;
     ref_width = n_refW;
     ref_height = n_refH;
 
-    peak = (1 << nBits) - 1;
+    // 32 bit input is float with a nominal range of [0, 1]
+    peak = nBits == 32 ? 1 : (1 << nBits) - 1;
     bits = nBits;
 
     // Flags for temporal coherence & post processing
@@ -25,9 +47,60 @@ dehazing::dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABloc
     TBlockSize = nTBlockSize;
     TransInit = fTransInit;
 
+    // Candidates cover [TransInit, TransInit + 0.6]. Grids finer than the lanes of the per-sample kernel
+    // are evaluated from the histograms of the block.
+    TransStep = fTransStep;
+    m_nTransCandidates = (int)(0.6f / fTransStep + 0.5f) + 1;
+    m_TransHistFlag = m_nTransCandidates > TRANS_CANDIDATES;
+
     // Guided filter block size, step size(sampling step), & LookUpTable parameter
     GBlockSize = nGBlockSize;
-    StepSize = 2;
+    StepSize = nGStepSize;
+    m_StreamFlag = bStreamFlag;
+    m_LumaGuideFlag = bLumaGuide;
+
+    // RGB input until SetYUV
+    m_YUVFlag = false;
+    m_nSubSamplingW = 0;
+    m_nSubSamplingH = 0;
+    m_nStripHeight = 0;
+
+    // Ref clip given by the caller until SetRefDownscale
+    m_RefDownscaleFlag = false;
+    m_pnRefColumn = nullptr;
+
+    // Full analysis contexts until SetRestoreOnly
+    m_RestoreOnlyFlag = false;
+
+    // Box filter and transmission cost kernels for the instruction set of the CPU
+    m_pfnBoxFilterV = BoxFilterVertical_C;
+    m_pfnBoxFilterH = BoxFilterHorizontal_C;
+    m_pfnTransCostRow = TransCostRow_C;
+    m_pfnRestoreRow16 = RestoreRow16_C;
+    m_pfnRestoreTableRow8 = RestoreTableRow8_C;
+    m_pfnRestoreTableRow16 = RestoreTableRow16_C;
+    m_pfnAccumulateRow8 = AccumulateRow8_C;
+    m_pfnAccumulateRow16 = AccumulateRow16_C;
+#if defined(DEHAZING_X86)
+    const SimdLevel simd = GetSimdLevel();
+    if (simd >= SIMD_AVX2)
+    {
+        m_pfnBoxFilterV = BoxFilterVertical_AVX2;
+        m_pfnBoxFilterH = BoxFilterHorizontal_AVX2;
+        m_pfnTransCostRow = TransCostRow_AVX2;
+        m_pfnRestoreRow16 = RestoreRow16_AVX2;
+        m_pfnRestoreTableRow8 = RestoreTableRow8_AVX2;
+        m_pfnRestoreTableRow16 = RestoreTableRow16_AVX2;
+        m_pfnAccumulateRow8 = AccumulateRow8_AVX2;
+        m_pfnAccumulateRow16 = AccumulateRow16_AVX2;
+    }
+    else if (simd >= SIMD_SSE41)
+    {
+        m_pfnBoxFilterV = BoxFilterVertical_SSE41;
+        m_pfnBoxFilterH = BoxFilterHorizontal_SSE41;
+        m_pfnTransCostRow = TransCostRow_SSE41;
+    }
+#endif
     GSigma = 10.f;
 
     // Block size for air estimation
@@ -38,140 +111,996 @@ dehazing::dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABloc
     TopLeftY = 0;
     BottomRightX = width;
     BottomRightY = height;
+    AirlightGridMaker();
+
+    // Built on demand by GuideLUTMaker and GammaLUTMaker
+    m_pfGuidedLUT = nullptr;
+    m_pGammaLUT = nullptr;
+
+    m_pfRestoreScale = new float[RESTORE_LEVELS];
+    m_pnRestoreLevel = new uint16_t[RESTORE_BINS + 1]();  // Padding for 32 bit gathers
+    RestoreLUTMaker();
+
+    m_pPool = new ThreadPool(nThreads);
+}
+
+dehazing::~dehazing()
+{
+    delete[] m_pfGuidedLUT;
+    if (m_pGammaLUT != nullptr)
+        GammaLUT::Release(m_pGammaLUT);
+    delete[] m_pfRestoreScale;
+    delete[] m_pnRestoreLevel;
+    delete[] m_pnRefColumn;
+    delete[] m_pnAirX;
+    delete[] m_pnAirY;
+
+    delete m_pPool;
+}
+
+DehazeContext::DehazeContext(int nW, int nH, int n_refW, int n_refH, int nTBlockSize, bool bPrevFlag, bool bTransHist, bool bLumaGuide, bool bRestoreOnly,
+    int nChromaW, size_t nAirTableSize, size_t nRefImageSize, size_t nScratchSize, int nThreads)
+    : m_Scratch(nScratchSize)
+{
+    m_pfTransmissionR = new float[nW * nH];
+    m_pfChromaRow = nChromaW > 0 ? new float[(nW + nChromaW) * nThreads] : nullptr;
+
+    // A restore-only context reads the refined transmission of an analysis pass, nothing else is estimated
+    if (bRestoreOnly)
+    {
+        m_pfTransRow = nullptr;
+        m_pdTransHist = nullptr;
+        m_pnAirSum = nullptr;
+        m_pnAirSquare = nullptr;
+        m_pfTransmission = nullptr;
+        m_pfSmallTrans = nullptr;
+        m_pfRImg = m_pfGImg = m_pfBImg = m_pfYImg = nullptr;
+        m_pfRefY = nullptr;
+        m_pRefImage = nullptr;
+        m_pRefSum = nullptr;
+        return;
+    }
+
+    m_pfTransRow = new float[nTBlockSize * 3 * nThreads];
+    m_pdTransHist = bTransHist ? new double[(nTBlockSize * nTBlockSize + 1) * 4 * 3 * nThreads] : nullptr;
+
+    m_pnAirSum    = new uint64_t[nAirTableSize];
+    m_pnAirSquare = new uint64_t[nAirTableSize];
+
+    m_pfTransmission  = new float[nW * nH];
+    m_pfSmallTrans    = new float[n_refW * n_refH];
+
+    m_pfRImg = bLumaGuide ? nullptr : new float[nW * nH];
+    m_pfGImg = bLumaGuide ? nullptr : new float[nW * nH];
+    m_pfBImg = bLumaGuide ? nullptr : new float[nW * nH];
+    m_pfYImg = bLumaGuide ? new float[nW * nH] : nullptr;
+
+    m_pfRefY = bPrevFlag ? new float[n_refW * n_refH] : nullptr;
+
+    // The column sums are 32 bit, uint32_t for integer input and float for float input
+    m_pRefImage = nRefImageSize > 0 ? new uint8_t[nRefImageSize] : nullptr;
+    m_pRefSum   = nRefImageSize > 0 ? new uint8_t[(size_t)nW * 4 * nThreads] : nullptr;
+}
+
+DehazeContext::~DehazeContext()
+{
+    delete[] m_pfTransRow;
+    delete[] m_pfChromaRow;
+    delete[] m_pdTransHist;
+
+    delete[] m_pnAirSum;
+    delete[] m_pnAirSquare;
+
+    delete[] m_pfTransmission;
+    delete[] m_pfTransmissionR;
+    delete[] m_pfSmallTrans;
+
+    delete[] m_pfRImg;
+    delete[] m_pfGImg;
+    delete[] m_pfBImg;
+    delete[] m_pfYImg;
+
+    delete[] m_pfRefY;
+
+    delete[] m_pRefImage;
+    delete[] m_pRefSum;
+
+    delete[] m_pRestoreTable;
+}
+
+TemporalState::TemporalState(int n_refW, int n_refH)
+{
+    m_pfSmallTrans = new float[n_refW * n_refH];
+    m_pfRefY       = new float[n_refW * n_refH];
+}
+
+TemporalState::~TemporalState()
+{
+    delete[] m_pfSmallTrans;
+    delete[] m_pfRefY;
+}
+
+DehazeContext* dehazing::CreateContext() const
+{
+    return new DehazeContext(width, height, ref_width, ref_height, TBlockSize, m_PreviousFlag, m_TransHistFlag, m_LumaGuideFlag, m_RestoreOnlyFlag,
+        m_YUVFlag ? width >> m_nSubSamplingW : 0, AirlightTableSize(), RefImageSize(), m_RestoreOnlyFlag ? 0 : GuidedScratchSize(m_nStripHeight), m_pPool->Threads());
+}
+
+TemporalState* dehazing::CreateTemporalState() const
+{
+    return new TemporalState(ref_width, ref_height);
+}
+
+/*
+    Function: StoreTemporalState
+    Description: keep the airlight and block transmission of frame n for the temporal coherence cost of frame n + 1.
+ */
+void dehazing::StoreTemporalState(const DehazeContext& ctx, TemporalState& state, int n) const
+{
+    state.m_nFrame = n;
+    for (auto c = 0; c < 3; c++)
+        state.m_afAirlight[c] = ctx.m_afAirlight[c];
+
+    std::copy(ctx.m_pfSmallTrans, ctx.m_pfSmallTrans + ref_width * ref_height, state.m_pfSmallTrans);
+    std::copy(ctx.m_pfRefY, ctx.m_pfRefY + ref_width * ref_height, state.m_pfRefY);
+}
+
+/*
+    Function: MeanTransmission
+    Description: mean of the refined transmission of the last frame.
+        Rows are summed separately and then in order, so the result does not depend on the number of threads.
+ */
+float dehazing::MeanTransmission(const DehazeContext& ctx) const
+{
+    std::vector<double> adRowSum(height);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            double dSum = 0.0;
+            for (auto i = 0; i < width; i++)
+                dSum += ctx.m_pfTransmissionR[j * width + i];
+            adRowSum[j] = dSum;
+        }
+    });
+
+    double dSum = 0.0;
+    for (auto j = 0; j < height; j++)
+        dSum += adRowSum[j];
+
+    return (float)(dSum / ((double)width * height));
+}
+
+/*
+    Function: FrameFootprint
+    Description: bytes of the working state of one frame in flight (a DehazeContext), when the guided filter
+        runs in strips of nStripHeight rows (0 for the whole frame).
+ */
+size_t dehazing::FrameFootprint(int nStripHeight) const
+{
+    const size_t nPixels = (size_t)width * height;
+    const size_t nRefPixels = (size_t)ref_width * ref_height;
+    const int nThreads = m_pPool->Threads();
 
-    m_pfTransmission  = new float[width * height];
-    m_pfTransmissionR = new float[width * height];
-    m_pfSmallTrans    = new float[ref_width * ref_height];
+    // Restore tables of 8-10 bit input
+    size_t nRestore = bits <= 10 ? (size_t)3 * RESTORE_LEVELS * (peak + 1) * (bits == 8 ? 1 : 2) : 0;
 
-    m_pnRImg = new int[width * height];
-    m_pnGImg = new int[width * height];
-    m_pnBImg = new int[width * height];
+    // Chroma restoration of each thread
+    if (m_YUVFlag)
+        nRestore += ((size_t)width + (width >> m_nSubSamplingW)) * nThreads * sizeof(float);
+
+    // Refined transmission of a restore-only context
+    if (m_RestoreOnlyFlag)
+        return nPixels * sizeof(float) + nRestore + ScratchArena::ALIGNMENT;
+
+    // Guidance image, preliminary and refined transmission
+    size_t nBytes = nPixels * (m_LumaGuideFlag ? 3 : 5) * sizeof(float);
+
+    // Summed-area tables of the airlight estimation
+    nBytes += AirlightTableSize() * 2 * sizeof(uint64_t);
+
+    // Block transmission and ref luminance
+    nBytes += nRefPixels * (m_PreviousFlag ? 2 : 1) * sizeof(float);
+
+    // Ref clip of the internal downscaler and the column sums of each thread
+    if (m_RefDownscaleFlag)
+        nBytes += RefImageSize() + (size_t)width * 4 * nThreads;
+
+    // Transmission search of each thread
+    nBytes += (size_t)TBlockSize * 3 * nThreads * sizeof(float);
+    if (m_TransHistFlag)
+        nBytes += ((size_t)TBlockSize * TBlockSize + 1) * 4 * 3 * nThreads * sizeof(double);
+
+    return nBytes + nRestore + GuidedScratchSize(nStripHeight) + ScratchArena::ALIGNMENT;
+}
+
+/*
+    Function: SetYUV
+    Description: take YUV input, with the planes Y, U, V in the places of R, G, B. The airlight is estimated
+        by AirlightEstimationYUV and the frame restored by RestoreImageYUV. The transmission is estimated and
+        refined on the luma alone: pass it in the places of B, G and R. The guided filter uses the luma guide.
+        Call before FitMemory and before creating the contexts.
+    Parameter:
+        nSubSamplingW, nSubSamplingH - log2 of the chroma subsampling
+ */
+void dehazing::SetYUV(int nSubSamplingW, int nSubSamplingH)
+{
+    m_YUVFlag = true;
+    m_LumaGuideFlag = true;
+    m_nSubSamplingW = nSubSamplingW;
+    m_nSubSamplingH = nSubSamplingH;
+}
+
+/*
+    Function: SetRefDownscale
+    Description: make the ref clip from the source with DownscaleRef instead of taking it from the caller.
+        Call before FitMemory and before creating the contexts.
+ */
+void dehazing::SetRefDownscale()
+{
+    m_RefDownscaleFlag = true;
+
+    // Each ref column averages the source columns [m_pnRefColumn[x], m_pnRefColumn[x + 1])
+    delete[] m_pnRefColumn;
+    m_pnRefColumn = new int[ref_width + 1];
+    for (auto x = 0; x <= ref_width; x++)
+        m_pnRefColumn[x] = (int)((int64_t)x * width / ref_width);
+}
+
+/*
+    Function: SetRestoreOnly
+    Description: create contexts that only restore the refined transmission of an analysis pass,
+        with RestoreImage or RestoreImageYUV. Call before FitMemory and before creating the contexts.
+ */
+void dehazing::SetRestoreOnly()
+{
+    m_RestoreOnlyFlag = true;
+}
+
+/*
+    Function: FitMemory
+    Description: choose the tallest strip of the guided filter that keeps FrameFootprint within nBudget bytes.
+        The whole frame is kept when it fits. Only the full resolution guided filter is split,
+        the fast and the row-streaming guided filter already take little scratch.
+        Call before creating the contexts.
+    Return:
+        false if the budget cannot be met, the strips are then one row high
+ */
+bool dehazing::FitMemory(size_t nBudget)
+{
+    m_nStripHeight = 0;
+    if (FrameFootprint(0) <= nBudget)
+        return true;
+
+    if (StepSize > 1 || m_StreamFlag || m_RestoreOnlyFlag)
+        return false;
+
+    // The footprint grows with the strip height
+    int nLow = 1;
+    int nHigh = height - 1;
+    if (FrameFootprint(nLow) > nBudget)
+    {
+        m_nStripHeight = nLow;
+        return false;
+    }
+
+    while (nLow < nHigh)
+    {
+        const int nMid = nLow + (nHigh - nLow + 1) / 2;
+        if (FrameFootprint(nMid) <= nBudget)
+            nLow = nMid;
+        else
+            nHigh = nMid - 1;
+    }
+
+    m_nStripHeight = nLow;
+    return true;
+}
+
+/*
+    Function: AccumulateRow_C
+    Description: add one row of samples to the column sums of the ref downscaler.
+    Parameters:
+        pnSrc - source row
+        nCount - number of samples
+    Return:
+        pnSum - column sums
+ */
+template <typename T>
+static void AccumulateRow_C(const T* pnSrc, int nCount, uint32_t* pnSum)
+{
+    for (auto i = 0; i < nCount; i++)
+        pnSum[i] += pnSrc[i];
+}
+
+void AccumulateRow8_C(const uint8_t* pnSrc, int nCount, uint32_t* pnSum)
+{
+    AccumulateRow_C(pnSrc, nCount, pnSum);
+}
+
+void AccumulateRow16_C(const uint16_t* pnSrc, int nCount, uint32_t* pnSum)
+{
+    AccumulateRow_C(pnSrc, nCount, pnSum);
+}
+
+inline void dehazing::AccumulateRow(const uint8_t* pnSrc, int nCount, uint32_t* pnSum) const
+{
+    m_pfnAccumulateRow8(pnSrc, nCount, pnSum);
+}
+
+inline void dehazing::AccumulateRow(const uint16_t* pnSrc, int nCount, uint32_t* pnSum) const
+{
+    m_pfnAccumulateRow16(pnSrc, nCount, pnSum);
+}
+
+inline void dehazing::AccumulateRow(const float* pfSrc, int nCount, float* pfSum) const
+{
+    for (auto i = 0; i < nCount; i++)
+        pfSum[i] += pfSrc[i];
+}
+
+// Bytes of the ref clip made by DownscaleRef, 0 without the internal downscaler
+size_t dehazing::RefImageSize() const
+{
+    if (!m_RefDownscaleFlag)
+        return 0;
+
+    const size_t nBytes = bits == 8 ? 1 : bits <= 16 ? 2 : 4;
+    return (size_t)(m_YUVFlag ? 1 : 3) * ref_width * ref_height * nBytes;
+}
+
+/*
+    Function: DownscaleRef
+    Description: make the ref clip from the source by area averaging, in place of a ref clip of the caller.
+        Each ref sample is the mean of the source samples it covers. The source rows of a ref row are added
+        to column sums, which are then summed over the source columns of each ref column, so each source sample
+        is read once. Integer sums are exact and rounded once, the result does not depend on the number of threads.
+        YUV input only makes the ref of its luma, passed in the place of R.
+    Return:
+        m_pRefImage - ref clip, read with RefPlane
+ */
+template <typename T>
+void dehazing::DownscaleRef(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride) const
+{
+    typedef typename std::conditional<std::is_integral<T>::value, uint32_t, float>::type TSum;
+    typedef typename std::conditional<std::is_integral<T>::value, uint64_t, double>::type TTotal;
+
+    const int nPlanes = m_YUVFlag ? 1 : 3;
+    const T* const apSrc[3] = { m_YUVFlag ? srcpR : srcpB, srcpG, srcpR };
+    const int nRefSize = ref_width * ref_height;
+
+    ParallelRows(ref_height, 1, [&](int nBegin, int nEnd, int nTask) {
+        TSum* pSum = reinterpret_cast<TSum*>(ctx.m_pRefSum) + nTask * width;
+
+        for (auto y = nBegin; y < nEnd; y++)
+        {
+            const int nStartY = (int)((int64_t)y * height / ref_height);
+            const int nEndY = (int)((int64_t)(y + 1) * height / ref_height);
+
+            for (auto c = 0; c < nPlanes; c++)
+            {
+                std::fill(pSum, pSum + width, (TSum)0);
+                for (auto j = nStartY; j < nEndY; j++)
+                    AccumulateRow(apSrc[c] + j * src_stride, width, pSum);
+
+                T* pDst = reinterpret_cast<T*>(ctx.m_pRefImage) + c * nRefSize + y * ref_width;
+
+                for (auto x = 0; x < ref_width; x++)
+                {
+                    TTotal tTotal = 0;
+                    for (auto i = m_pnRefColumn[x]; i < m_pnRefColumn[x + 1]; i++)
+                        tTotal += pSum[i];
+
+                    const int64_t nArea = (int64_t)(nEndY - nStartY) * (m_pnRefColumn[x + 1] - m_pnRefColumn[x]);
+                    if (std::is_integral<T>::value)
+                        pDst[x] = (T)(((uint64_t)tTotal + nArea / 2) / nArea);
+                    else
+                        pDst[x] = (T)(tTotal / nArea);
+                }
+            }
+        }
+    });
+}
+
+// Plane of the ref clip made by DownscaleRef, nPlane 0, 1, 2 for B, G, R. YUV input has its luma in all three
+template <typename T>
+const T* dehazing::RefPlane(const DehazeContext& ctx, int nPlane) const
+{
+    return reinterpret_cast<const T*>(ctx.m_pRefImage) + (m_YUVFlag ? 0 : nPlane) * ref_width * ref_height;
+}
+
+/*
+    Function: EstimateTransmission
+    Description: block transmission of a frame, without refinement or restoration.
+        m_afAirlight must be set, by AirlightEstimation() or from a previous frame.
+    Parameter:
+        pPrev - state of the previous frame for the temporal coherence cost, nullptr if there is none.
+    Return:
+        m_pfSmallTrans (and m_pfRefY in temporal mode)
+ */
+template <typename T>
+void dehazing::EstimateTransmission(DehazeContext& ctx, const T* refpB, const T* refpG, const T* refpR, int ref_stride, const TemporalState* pPrev) const
+{
+    const auto tStart = std::chrono::steady_clock::now();
+    TransmissionEstimationColor(ctx, refpB, refpG, refpR, ref_stride, pPrev);
+    ctx.m_anStageTime[STAGE_TRANSMISSION] = ElapsedMicroseconds(tStart);
+}
+
+/*
+    Function: ReuseTransmission
+    Description: the block transmission in m_pfSmallTrans was set by the caller, from a cache of an earlier run.
+        Only the luminance of the ref clip is calculated, for the temporal coherence cost of the next frame.
+    Return:
+        m_pfRefY in temporal mode
+ */
+template <typename T>
+void dehazing::ReuseTransmission(DehazeContext& ctx, const T* refpB, const T* refpG, const T* refpR, int ref_stride) const
+{
+    if (m_PreviousFlag)
+        RefLuminance(ctx, refpB, refpG, refpR, ref_stride);
+}
+
+/*
+    Function: RemoveHaze
+    Description: estimate and refine the transmission, then restore the frame.
+        The airlight is read from m_afAirlight, set by AirlightEstimation() or by the caller.
+ */
+template <typename T>
+void dehazing::RemoveHaze(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride,
+    const T* refpB, const T* refpG, const T* refpR, int ref_stride, T* dstpB, T* dstpG, T* dstpR, int dst_stride,
+    const TemporalState* pPrev) const
+{
+    EstimateTransmission(ctx, refpB, refpG, refpR, ref_stride, pPrev);
+    RefineTransmission(ctx, srcpB, srcpG, srcpR, src_stride);
+    RestoreImage(ctx, srcpB, srcpG, srcpR, src_stride, dstpB, dstpG, dstpR, dst_stride);
+}
+
+/*
+    Function: RefineTransmission
+    Description: upsample the block transmission of m_pfSmallTrans and refine it with the source as guidance image.
+    Return:
+        m_pfTransmissionR - refined transmission
+ */
+template <typename T>
+void dehazing::RefineTransmission(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride) const
+{
+    // Regularization of the guided filter, relative to a guidance image normalized to [0, 1]
+    float fEps = 0.001f * peak * peak;
+
+    auto tStart = std::chrono::steady_clock::now();
+
+    // Guidance image for the guided filter. The luma of integer input is rounded to an integer (BT.601 weights
+    // in 10 bit fixed point), so that its statistics are computed exactly like the ones of R, G, B.
+    // YUV input guides with its own luma.
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            if (m_YUVFlag)
+            {
+                for (auto i = 0; i < width; i++)
+                    ctx.m_pfYImg[j * width + i] = (float)srcpR[j * src_stride + i];
+            }
+            else if (m_LumaGuideFlag && bits <= 16)
+            {
+                for (auto i = 0; i < width; i++)
+                {
+                    const auto pos = j * src_stride + i;
+                    ctx.m_pfYImg[j * width + i] = (float)((306 * (int)srcpR[pos] + 601 * (int)srcpG[pos] + 117 * (int)srcpB[pos] + 512) >> 10);
+                }
+            }
+            else if (m_LumaGuideFlag)
+            {
+                for (auto i = 0; i < width; i++)
+                {
+                    const auto pos = j * src_stride + i;
+                    ctx.m_pfYImg[j * width + i] = 0.299f * srcpR[pos] + 0.587f * srcpG[pos] + 0.114f * srcpB[pos];
+                }
+            }
+            else
+            {
+                for (auto i = 0; i < width; i++)
+                {
+                    ctx.m_pfBImg[j * width + i] = (float)srcpB[j * src_stride + i];
+                    ctx.m_pfGImg[j * width + i] = (float)srcpG[j * src_stride + i];
+                    ctx.m_pfRImg[j * width + i] = (float)srcpR[j * src_stride + i];
+                }
+            }
+        }
+    });
+
+    const int64_t nGuideTime = ElapsedMicroseconds(tStart);
+
+    tStart = std::chrono::steady_clock::now();
+    UpsampleTransmission(ctx);
+    ctx.m_anStageTime[STAGE_UPSAMPLE] = ElapsedMicroseconds(tStart);
+
+    tStart = std::chrono::steady_clock::now();
+    if (m_StreamFlag && StepSize <= 1)
+        GuidedFilterStream(ctx, width, height, fEps);
+    else
+        GuidedFilter(ctx, width, height, fEps);
+    ctx.m_anStageTime[STAGE_GUIDED_FILTER] = nGuideTime + ElapsedMicroseconds(tStart);
+}
+
+/*
+    Function: RestoreSample
+    Description: clamp a restored sample to the valid range and apply the gamma correction.
+        Integer samples read the gamma table, float samples compute the power directly.
+ */
+template <typename T>
+inline T dehazing::RestoreSample(float fValue, const T* pGammaLUT) const
+{
+    return pGammaLUT[clamp((int)fValue, 0, peak)];
+}
+
+template <>
+inline float dehazing::RestoreSample<float>(float fValue, const float*) const
+{
+    return std::pow(clamp(fValue, 0.f, 1.f), m_fGammaExp);
+}
+
+/*
+    Function: RestoreTable
+    Description: build the restore tables of 8-10 bit input for the airlight of the frame.
+        For each channel and transmission level, the table maps a sample to its restored,
+        clamped and gamma corrected value. The tables are kept while the airlight is unchanged.
+    Return:
+        m_pRestoreTable - tables of type T, RESTORE_LEVELS rows of peak + 1 samples per channel
+ */
+template <typename T>
+void dehazing::RestoreTable(DehazeContext& ctx) const
+{
+    const int nTableW = peak + 1;
+
+    if (ctx.m_pRestoreTable != nullptr && ctx.m_afRestoreAir[0] == ctx.m_afAirlight[0] &&
+        ctx.m_afRestoreAir[1] == ctx.m_afAirlight[1] && ctx.m_afRestoreAir[2] == ctx.m_afAirlight[2])
+        return;
+
+    // 4 bytes of padding, the SIMD kernels read the tables with 32 bit gathers
+    if (ctx.m_pRestoreTable == nullptr)
+        ctx.m_pRestoreTable = new uint8_t[3 * RESTORE_LEVELS * nTableW * sizeof(T) + 4]();
+
+    T* pTable = reinterpret_cast<T*>(ctx.m_pRestoreTable);
+    const T* pGammaLUT = m_pGammaLUT->Table<T>();
+
+    ParallelRows(3 * RESTORE_LEVELS, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nRow = nBegin; nRow < nEnd; nRow++)
+        {
+            const float fAirlight = ctx.m_afAirlight[nRow / RESTORE_LEVELS];
+            const float fScale = m_pfRestoreScale[nRow % RESTORE_LEVELS];
+            T* pRow = pTable + nRow * nTableW;
+
+            for (auto i = 0; i < nTableW; i++)
+                pRow[i] = RestoreSample<T>((i - fAirlight) * fScale + fAirlight, pGammaLUT);
+        }
+    });
+
+    for (auto c = 0; c < 3; c++)
+        ctx.m_afRestoreAir[c] = ctx.m_afAirlight[c];
+}
+
+/*
+    Function: RestoreTableRow
+    Description: restore one row of 8-10 bit samples, reading the restore table row of the quantized transmission.
+    Parameters:
+        pSrcB, pSrcG, pSrcR - hazy samples
+        pfTrans - refined transmission
+        nCount - number of samples
+        pnLevel - restore level of each transmission bin
+        pTableB, pTableG, pTableR - restore tables
+    Return:
+        pDstB, pDstG, pDstR - dehazed samples
+ */
+template <typename T>
+static void RestoreTableRow(const T* pSrcB, const T* pSrcG, const T* pSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const T* pTableB, const T* pTableG, const T* pTableR, int nPeak, T* pDstB, T* pDstG, T* pDstR)
+{
+    const int nTableW = nPeak + 1;
+
+    for (auto i = 0; i < nCount; i++)
+    {
+        const int nRow = pnLevel[(int)(clamp(pfTrans[i], 0.f, 1.f) * (RESTORE_BINS - 1) + 0.5f)] * nTableW;
+
+        pDstB[i] = pTableB[nRow + std::min((int)pSrcB[i], nPeak)];
+        pDstG[i] = pTableG[nRow + std::min((int)pSrcG[i], nPeak)];
+        pDstR[i] = pTableR[nRow + std::min((int)pSrcR[i], nPeak)];
+    }
+}
+
+void RestoreTableRow8_C(const uint8_t* pnSrcB, const uint8_t* pnSrcG, const uint8_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint8_t* pnTableB, const uint8_t* pnTableG, const uint8_t* pnTableR, int nPeak, uint8_t* pnDstB, uint8_t* pnDstG, uint8_t* pnDstR)
+{
+    RestoreTableRow(pnSrcB, pnSrcG, pnSrcR, pfTrans, nCount, pnLevel, pnTableB, pnTableG, pnTableR, nPeak, pnDstB, pnDstG, pnDstR);
+}
+
+void RestoreTableRow16_C(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint16_t* pnTableB, const uint16_t* pnTableG, const uint16_t* pnTableR, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR)
+{
+    RestoreTableRow(pnSrcB, pnSrcG, pnSrcR, pfTrans, nCount, pnLevel, pnTableB, pnTableG, pnTableR, nPeak, pnDstB, pnDstG, pnDstR);
+}
+
+/*
+    Function: RestoreRow16_C
+    Description: restore one row of 16 bit samples. The reciprocal of the transmission is calculated once
+        per pixel and shared by the three channels.
+    Parameters:
+        pnSrcB, pnSrcG, pnSrcR - hazy samples
+        pfTrans - refined transmission
+        nCount - number of samples
+        pfAirlight - airlight (B, G, R)
+        pnGammaLUT - gamma table, nPeak + 1 entries
+    Return:
+        pnDstB, pnDstG, pnDstR - dehazed samples
+ */
+void RestoreRow16_C(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount,
+    const float* pfAirlight, const uint16_t* pnGammaLUT, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR)
+{
+    const uint16_t* apnSrc[3] = { pnSrcB, pnSrcG, pnSrcR };
+    uint16_t* apnDst[3] = { pnDstB, pnDstG, pnDstR };
+
+    for (auto i = 0; i < nCount; i++)
+    {
+        const float fScale = 1.f / clamp(pfTrans[i], RESTORE_TRANS_MIN, 1.f);
+
+        for (auto c = 0; c < 3; c++)
+        {
+            const float fOut = clamp((apnSrc[c][i] - pfAirlight[c]) * fScale + pfAirlight[c], 0.f, (float)nPeak);
+            apnDst[c][i] = pnGammaLUT[(int)fOut];
+        }
+    }
+}
+
+/*
+    Function: RestoreRows
+    Description: I' = (I - Airlight) / Transmission + Airlight and Gamma correction of the whole frame.
+        8-10 bit input reads the restore tables, 11-16 bit input multiplies by the reciprocal of the
+        transmission, float input computes the gamma correction directly.
+ */
+void dehazing::RestoreRows(DehazeContext& ctx, const uint8_t* srcpB, const uint8_t* srcpG, const uint8_t* srcpR, int src_stride,
+    uint8_t* dstpB, uint8_t* dstpG, uint8_t* dstpR, int dst_stride) const
+{
+    RestoreTable<uint8_t>(ctx);
+
+    const uint8_t* pnTableB = ctx.m_pRestoreTable;
+    const uint8_t* pnTableG = pnTableB + RESTORE_LEVELS * (peak + 1);
+    const uint8_t* pnTableR = pnTableG + RESTORE_LEVELS * (peak + 1);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            m_pfnRestoreTableRow8(srcpB + j * src_stride, srcpG + j * src_stride, srcpR + j * src_stride, ctx.m_pfTransmissionR + j * width, width,
+                m_pnRestoreLevel, pnTableB, pnTableG, pnTableR, peak, dstpB + j * dst_stride, dstpG + j * dst_stride, dstpR + j * dst_stride);
+        }
+    });
+}
+
+void dehazing::RestoreRows(DehazeContext& ctx, const uint16_t* srcpB, const uint16_t* srcpG, const uint16_t* srcpR, int src_stride,
+    uint16_t* dstpB, uint16_t* dstpG, uint16_t* dstpR, int dst_stride) const
+{
+    if (bits <= 10)
+    {
+        RestoreTable<uint16_t>(ctx);
+
+        const uint16_t* pnTableB = reinterpret_cast<const uint16_t*>(ctx.m_pRestoreTable);
+        const uint16_t* pnTableG = pnTableB + RESTORE_LEVELS * (peak + 1);
+        const uint16_t* pnTableR = pnTableG + RESTORE_LEVELS * (peak + 1);
+
+        ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+            for (auto j = nBegin; j < nEnd; j++)
+            {
+                m_pfnRestoreTableRow16(srcpB + j * src_stride, srcpG + j * src_stride, srcpR + j * src_stride, ctx.m_pfTransmissionR + j * width, width,
+                    m_pnRestoreLevel, pnTableB, pnTableG, pnTableR, peak, dstpB + j * dst_stride, dstpG + j * dst_stride, dstpR + j * dst_stride);
+            }
+        });
+    }
+    else
+    {
+        const uint16_t* pnGammaLUT = m_pGammaLUT->Table<uint16_t>();
+
+        ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+            for (auto j = nBegin; j < nEnd; j++)
+            {
+                m_pfnRestoreRow16(srcpB + j * src_stride, srcpG + j * src_stride, srcpR + j * src_stride, ctx.m_pfTransmissionR + j * width, width,
+                    ctx.m_afAirlight, pnGammaLUT, peak, dstpB + j * dst_stride, dstpG + j * dst_stride, dstpR + j * dst_stride);
+            }
+        });
+    }
+}
+
+void dehazing::RestoreRows(DehazeContext& ctx, const float* srcpB, const float* srcpG, const float* srcpR, int src_stride,
+    float* dstpB, float* dstpG, float* dstpR, int dst_stride) const
+{
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            const float* pfTrans = ctx.m_pfTransmissionR + j * width;
+            const float* const apfSrc[3] = { srcpB + j * src_stride, srcpG + j * src_stride, srcpR + j * src_stride };
+            float* const apfDst[3] = { dstpB + j * dst_stride, dstpG + j * dst_stride, dstpR + j * dst_stride };
+
+            for (auto i = 0; i < width; i++)
+            {
+                const float fScale = 1.f / clamp(pfTrans[i], RESTORE_TRANS_MIN, 1.f);
+
+                for (auto c = 0; c < 3; c++)
+                    apfDst[c][i] = RestoreSample<float>((apfSrc[c][i] - ctx.m_afAirlight[c]) * fScale + ctx.m_afAirlight[c], nullptr);
+            }
+        }
+    });
+}
+
+/*
+    Function: RestoreImage
+    Description: Dehazed the image using estimated transmission and atmospheric light.
+    Parameter:
+        srcpB, srcpG, srcpR - Input hazy image.
+    Return:
+        dstpB, dstpG, dstpR - Dehazed image.
+ */
+template <typename T>
+void dehazing::RestoreImage(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride,
+    T* dstpB, T* dstpG, T* dstpR, int dst_stride) const
+{
+    auto tStart = std::chrono::steady_clock::now();
+    RestoreRows(ctx, srcpB, srcpG, srcpR, src_stride, dstpB, dstpG, dstpR, dst_stride);
+    ctx.m_anStageTime[STAGE_RESTORE] = ElapsedMicroseconds(tStart);
+
+    // Post processing flag
+    ctx.m_anStageTime[STAGE_POST_PROCESSING] = 0;
+    if (m_PostFlag == true)
+    {
+        tStart = std::chrono::steady_clock::now();
+        PostProcessing(ctx, dstpB, dstpG, dstpR, dst_stride);
+        ctx.m_anStageTime[STAGE_POST_PROCESSING] = ElapsedMicroseconds(tStart);
+    }
+}
+
+/*
+    Function: RestoreImageYUV
+    Description: RestoreImage of YUV input. The luma is restored and gamma corrected at full resolution,
+        the chroma at its own resolution without gamma correction.
+    Parameter:
+        srcpY, srcpU, srcpV - Input hazy image.
+    Return:
+        dstpY, dstpU, dstpV - Dehazed image.
+ */
+template <typename T>
+void dehazing::RestoreImageYUV(DehazeContext& ctx, const T* srcpY, const T* srcpU, const T* srcpV, int src_stride, int src_chroma_stride,
+    T* dstpY, T* dstpU, T* dstpV, int dst_stride, int dst_chroma_stride) const
+{
+    auto tStart = std::chrono::steady_clock::now();
+    RestoreLuma(ctx, srcpY, src_stride, dstpY, dst_stride);
+    RestoreChroma(ctx, srcpU, src_chroma_stride, dstpU, dst_chroma_stride, ctx.m_afAirlight[1]);
+    RestoreChroma(ctx, srcpV, src_chroma_stride, dstpV, dst_chroma_stride, ctx.m_afAirlight[0]);
+    ctx.m_anStageTime[STAGE_RESTORE] = ElapsedMicroseconds(tStart);
 
-    m_pfGuidedLUT = new float[GBlockSize * GBlockSize];
+    ctx.m_anStageTime[STAGE_POST_PROCESSING] = 0;
+    if (m_PostFlag == true)
+    {
+        tStart = std::chrono::steady_clock::now();
+        PostProcessing(ctx, dstpY, dstpY, dstpY, dst_stride);
+        ctx.m_anStageTime[STAGE_POST_PROCESSING] = ElapsedMicroseconds(tStart);
+    }
 }
 
-dehazing::~dehazing()
+/*
+    Function: RestoreLuma
+    Description: I' = (I - Airlight) / Transmission + Airlight and Gamma correction of the luma of YUV input.
+        8-10 bit input reads the restore table of the luma airlight, kept in the place of R.
+ */
+template <typename T>
+void dehazing::RestoreLuma(DehazeContext& ctx, const T* srcp, int src_stride, T* dstp, int dst_stride) const
 {
-    delete[] m_pfTransmission;
-    delete[] m_pfTransmissionR;
-    delete[] m_pfSmallTrans;
+    if (std::is_integral<T>::value && bits <= 10)
+    {
+        RestoreTable<T>(ctx);
 
-    delete[] m_pnRImg;
-    delete[] m_pnGImg;
-    delete[] m_pnBImg;
+        // Locals, the stores of 8 bit samples may alias the members
+        const int nWidth = width;
+        const int nPeak = peak;
+        const int nTableW = peak + 1;
+        const uint16_t* pnLevel = m_pnRestoreLevel;
+        const T* pTable = reinterpret_cast<const T*>(ctx.m_pRestoreTable) + 2 * RESTORE_LEVELS * nTableW;
 
-    delete[] m_pfGuidedLUT;
-}
+        ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+            for (auto j = nBegin; j < nEnd; j++)
+            {
+                const float* pfTrans = ctx.m_pfTransmissionR + j * nWidth;
+                const T* pSrc = srcp + j * src_stride;
+                T* pDst = dstp + j * dst_stride;
 
-template <typename T>
-void dehazing::RemoveHaze(const T* src, const T* refpB, const T* refpG, const T* refpR, T* dst, int stride)
-{
-    float fEps = 0.001f;
+                for (auto i = 0; i < nWidth; i++)
+                {
+                    const int nRow = pnLevel[(int)(clamp(pfTrans[i], 0.f, 1.f) * (RESTORE_BINS - 1) + 0.5f)] * nTableW;
+                    pDst[i] = pTable[nRow + std::min((int)pSrc[i], nPeak)];
+                }
+            }
+        });
+        return;
+    }
 
-    AirlightEstimation(src, width, height, stride);
-    TransmissionEstimationColor(refpB, refpG, refpR);
-    UpsampleTransmission();
-    GuidedFilter(width, height, fEps);
-    RestoreImage(src, dst, width, height, stride);
+    const T* pGammaLUT = std::is_integral<T>::value ? m_pGammaLUT->Table<T>() : nullptr;
+    const float fAirlight = ctx.m_afAirlight[2];
+    const int nWidth = width;
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            const float* pfTrans = ctx.m_pfTransmissionR + j * nWidth;
+            const T* pSrc = srcp + j * src_stride;
+            T* pDst = dstp + j * dst_stride;
+
+            for (auto i = 0; i < nWidth; i++)
+            {
+                const float fScale = 1.f / clamp(pfTrans[i], RESTORE_TRANS_MIN, 1.f);
+                pDst[i] = RestoreSample<T>((pSrc[i] - fAirlight) * fScale + fAirlight, pGammaLUT);
+            }
+        }
+    });
 }
 
 /*
-    Function: RestoreImage
-    Description: Dehazed the image using estimated transmission and atmospheric light.
+    Function: RestoreChroma
+    Description: I' = (I - Airlight) / Transmission + Airlight of a chroma plane of YUV input, at chroma resolution.
+        The transmission of a chroma sample is the mean over the luma samples it covers, the rows it covers
+        are summed first so that the loops stay vectorizable.
     Parameter:
-        imInput - Input hazy image.
-    Return:
-        imOutput - Dehazed image.
+        fAirlight - airlight of the plane
  */
 template <typename T>
-void dehazing::RestoreImage(const T* src, T* dst, int width, int height, int stride)
+void dehazing::RestoreChroma(const DehazeContext& ctx, const T* srcp, int src_stride, T* dstp, int dst_stride, float fAirlight) const
 {
-    for (auto j = 0; j < height; j++)
-    {
-        for (auto i = 0; i < width; i++)
+    const int nWidth = width;
+    const int nChromaW = width >> m_nSubSamplingW;
+    const int nChromaH = height >> m_nSubSamplingH;
+    const int nBlockW = 1 << m_nSubSamplingW;
+    const int nBlockH = 1 << m_nSubSamplingH;
+    const float fAverage = 1.f / (nBlockW * nBlockH);
+    const float* pfTransmission = ctx.m_pfTransmissionR;
+
+    // Float chroma is centered on 0
+    const float fMin = std::is_integral<T>::value ? 0.f : -0.5f;
+    const float fMax = std::is_integral<T>::value ? (float)peak : 0.5f;
+    const float fRound = std::is_integral<T>::value ? 0.5f : 0.f;
+
+    ParallelRows(nChromaH, 1, [&](int nBegin, int nEnd, int nTask) {
+        float* pfColumn = ctx.m_pfChromaRow + nTask * (nWidth + nChromaW);
+        float* pfChromaTrans = pfColumn + nWidth;
+
+        for (auto y = nBegin; y < nEnd; y++)
         {
-            // I' = (I - Airlight) / Transmission + Airlight and Gamma correction using Lut
-            const auto pos = (j * width + i) * 3;
-            const float transmission = clamp(m_pfTransmissionR[j * width + i], 0.f, 1.f); // m_pfTransmissionR calculated in GuideFilter
+            const float* pfTrans = pfTransmission + y * nBlockH * nWidth;
+            const T* pSrc = srcp + y * src_stride;
+            T* pDst = dstp + y * dst_stride;
 
-            dst[pos]     = (T)m_pucGammaLUT[clamp((int)((src[pos]     - m_anAirlight[0]) / transmission + m_anAirlight[0]), 0, peak)];
-            dst[pos + 1] = (T)m_pucGammaLUT[clamp((int)((src[pos + 1] - m_anAirlight[1]) / transmission + m_anAirlight[1]), 0, peak)];
-            dst[pos + 2] = (T)m_pucGammaLUT[clamp((int)((src[pos + 2] - m_anAirlight[2]) / transmission + m_anAirlight[2]), 0, peak)];
-        }
-    }
+            std::copy(pfTrans, pfTrans + nWidth, pfColumn);
+            for (auto j = 1; j < nBlockH; j++)
+                for (auto i = 0; i < nWidth; i++)
+                    pfColumn[i] += pfTrans[j * nWidth + i];
 
-    // Post processing flag
-    if (m_PostFlag == true)
-    {
-        PostProcessing(dst, width, height, stride);
-    }
+            for (auto x = 0; x < nChromaW; x++)
+            {
+                float fTrans = 0.f;
+                for (auto i = 0; i < nBlockW; i++)
+                    fTrans += pfColumn[x * nBlockW + i];
+                pfChromaTrans[x] = fTrans * fAverage;
+            }
+
+            for (auto x = 0; x < nChromaW; x++)
+            {
+                const float fScale = 1.f / clamp(pfChromaTrans[x], RESTORE_TRANS_MIN, 1.f);
+                const float fOut = clamp((pSrc[x] - fAirlight) * fScale + fAirlight, fMin, fMax);
+                pDst[x] = (T)(fOut + fRound);
+            }
+        }
+    });
 }
 
 /*
     Function: PostProcessing
     Description: deblocking for blocking artifacts of mpeg video sequence.
+        The edge thresholds are in 8 bit units and scaled to the sample range.
+        YUV input deblocks its luma alone, passed in the place of R.
     Return:
-        imOutput - Dehazed frame by post processing.
+        dstpB, dstpG, dstpR - Dehazed frame by post processing.
  */
 template <typename T>
-void dehazing::PostProcessing(T* dst, int width, int height, int stride)
+void dehazing::PostProcessing(const DehazeContext& ctx, T* dstpB, T* dstpG, T* dstpR, int stride) const
 {
     const int nNumStep = 10;
     const int nDisPos = 20;
+    const float fMaxEdge = 20.f * peak / 255.f;
+    const float fMaxFlat = 30.f * peak / 255.f;
+    const int nFirst = m_YUVFlag ? 2 : 0;
 
-    for (auto j = 0; j < height; j++)
-    {
-        for (auto i = 0; i < width; i++)
+    // Each row only reads and writes its own samples
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
         {
-            // If transmission is less than 0.4, apply post processing because more dehazed block yields more artifacts
-            if (i > nDisPos + nNumStep && m_pfTransmissionR[j * width + i - nDisPos] < 0.4)
+            T* const apDst[3] = { dstpB + j * stride, dstpG + j * stride, dstpR + j * stride };
+
+            for (auto i = 0; i < width; i++)
             {
-                const auto posD  = (j * width + (i - nDisPos)) * 3;
-                const auto posDp = (j * width + (i - nDisPos - 1)) * 3;
-
-                float nAD0 = (float)(dst[posD]     - dst[posDp]);
-                float nAD1 = (float)(dst[posD + 1] - dst[posDp + 1]);
-                float nAD2 = (float)(dst[posD + 2] - dst[posDp + 2]);
-
-                if (std::max(std::max(abs(nAD0), abs(nAD1)), abs(nAD2)) < 20 &&
-                      abs(dst[posDp]     - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3])
-                    + abs(dst[posDp + 1] - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3 + 1])
-                    + abs(dst[posDp + 2] - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3 + 2])
-                    + abs(dst[posD]      - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3])
-                    + abs(dst[posD + 1]  - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3 + 1])
-                    + abs(dst[posD + 2]  - dst[(j * width + (i - nDisPos - 1 - nNumStep)) * 3 + 2]) < 30)
+                // If transmission is less than 0.4, apply post processing because more dehazed block yields more artifacts
+                if (i > nDisPos + nNumStep && ctx.m_pfTransmissionR[j * width + i - nDisPos] < 0.4)
                 {
-                    for (auto nS = 1; nS < nNumStep + 1; nS++)
+                    const auto posD  = i - nDisPos;
+                    const auto posDp = i - nDisPos - 1;
+                    const auto posDs = i - nDisPos - 1 - nNumStep;
+
+                    float afAD[3];
+                    float fMaxAD = 0.f;
+                    float fSumAD = 0.f;
+                    for (auto c = nFirst; c < 3; c++)
+                    {
+                        afAD[c] = (float)apDst[c][posD] - (float)apDst[c][posDp];
+                        fMaxAD = std::max(fMaxAD, std::abs(afAD[c]));
+                        fSumAD += std::abs((float)apDst[c][posDp] - (float)apDst[c][posDs]) + std::abs((float)apDst[c][posD] - (float)apDst[c][posDs]);
+                    }
+
+                    if (fMaxAD < fMaxEdge && fSumAD < fMaxFlat)
                     {
-                        dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3]     = (T)clamp((float)dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3]     + (float)nS * nAD0 / nNumStep, 0.f, (float)peak);
-                        dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3 + 1] = (T)clamp((float)dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3 + 1] + (float)nS * nAD1 / nNumStep, 0.f, (float)peak);
-                        dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3 + 2] = (T)clamp((float)dst[(j * width + (i - nDisPos - 1 + nS - nNumStep)) * 3 + 2] + (float)nS * nAD2 / nNumStep, 0.f, (float)peak);
+                        for (auto nS = 1; nS < nNumStep + 1; nS++)
+                        {
+                            for (auto c = nFirst; c < 3; c++)
+                            {
+                                T& out = apDst[c][posDp + nS - nNumStep];
+                                out = (T)clamp((float)out + (float)nS * afAD[c] / nNumStep, 0.f, (float)peak);
+                            }
+                        }
                     }
                 }
             }
         }
-    }
+    });
 }
 
+// Luminance of the ref clip, compared with the previous frame by the temporal coherence cost
 template <typename T>
-void dehazing::TransmissionEstimationColor(const T* pnImageB, const T* pnImageG, const T* pnImageR)
+void dehazing::RefLuminance(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride) const
 {
-    for (auto y = 0; y < ref_height; y += TBlockSize)
-    {
-        for (auto x = 0; x < ref_width; x += TBlockSize)
+    ParallelRows(ref_height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            for (auto i = 0; i < ref_width; i++)
+            {
+                const auto pos = j * ref_stride + i;
+                ctx.m_pfRefY[j * ref_width + i] = 0.299f * pnImageR[pos] + 0.587f * pnImageG[pos] + 0.114f * pnImageB[pos];
+            }
+        }
+    });
+}
+
+template <typename T>
+void dehazing::TransmissionEstimationColor(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride,
+    const TemporalState* pPrev) const
+{
+    if (m_PreviousFlag)
+        RefLuminance(ctx, pnImageB, pnImageG, pnImageR, ref_stride);
+
+    // Each thread estimates a band of block rows with its own row buffer
+    const int nBlockRows = (ref_height + TBlockSize - 1) / TBlockSize;
+
+    ParallelRows(nBlockRows, 1, [&](int nBegin, int nEnd, int nTask) {
+        float* pfRow = ctx.m_pfTransRow + nTask * TBlockSize * 3;
+        double* pdHist = m_TransHistFlag ? ctx.m_pdTransHist + nTask * (TBlockSize * TBlockSize + 1) * 4 * 3 : nullptr;
+
+        for (auto y = nBegin * TBlockSize; y < nEnd * TBlockSize; y += TBlockSize)
         {
-            float fTrans = NFTrsEstimationColor(pnImageB, pnImageG, pnImageR, x, y);
-            for (auto yStep = y; yStep < y + TBlockSize; yStep++)
+            for (auto x = 0; x < ref_width; x += TBlockSize)
             {
-                for (auto xStep = x; xStep < x + TBlockSize; xStep++)
+                float fTrans = NFTrsEstimationColor(ctx, pnImageB, pnImageG, pnImageR, ref_stride, x, y, pPrev, pfRow, pdHist);
+                for (auto yStep = y; yStep < y + TBlockSize; yStep++)
                 {
-                    int ly = std::min(yStep, ref_height - 1);
-                    int lx = std::min(xStep, ref_width - 1);
-                    m_pfSmallTrans[ly * ref_width + lx] = fTrans;
+                    for (auto xStep = x; xStep < x + TBlockSize; xStep++)
+                    {
+                        int ly = std::min(yStep, ref_height - 1);
+                        int lx = std::min(xStep, ref_width - 1);
+                        ctx.m_pfSmallTrans[ly * ref_width + lx] = fTrans;
+                    }
                 }
             }
         }
-    }
+    });
 }
 
 /*
@@ -184,357 +1113,630 @@ void dehazing::TransmissionEstimationColor(const T* pnImageB, const T* pnImageG,
         m_pfTransmission - output transmission
 
 */
-void dehazing::UpsampleTransmission()
+void dehazing::UpsampleTransmission(DehazeContext& ctx) const
 {
     // Upsample ratio
     float fRatioX = (float)ref_width / width;
     float fRatioY = (float)ref_height / height;
 
-    for (auto j = 0; j < height; j++)
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            for (auto i = 0; i < width; i++)
+            {
+                // Upsample variable, from m_pfSmallTrans to m_pfTransmission
+                ctx.m_pfTransmission[j * width + i] = ctx.m_pfSmallTrans[(int)(j * fRatioY) * ref_width + (int)(i * fRatioX)];
+            }
+        }
+    });
+}
+
+/*
+    Function: TransCostRow_C
+    Description: accumulate the terms of the transmission cost of one block row for all candidates at once.
+        For each sample, the output of candidate k is A + (I - A) * pfScale[k].
+    Parameters:
+        pfB, pfG, pfR - samples of the row
+        nChannels - number of channels, the first ones of B, G, R
+        nCount - number of samples
+        pfAirlight - airlight (B, G, R)
+        pfScale - 1 / transmission of each candidate
+        fPeak - maximum sample value
+    Return:
+        pdLoss - sum of squared out-of-range values
+        pdSum - sum of outputs
+        pdSquare - sum of squared outputs
+ */
+void TransCostRow_C(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare)
+{
+    float afLoss[TRANS_CANDIDATES] = { 0.f };
+    float afSum[TRANS_CANDIDATES] = { 0.f };
+    float afSquare[TRANS_CANDIDATES] = { 0.f };
+    const float* const apfIn[3] = { pfB, pfG, pfR };
+
+    for (auto i = 0; i < nCount; i++)
+    {
+        for (auto c = 0; c < nChannels; c++)
+        {
+            const float fDiff = apfIn[c][i] - pfAirlight[c];
+
+            for (auto k = 0; k < TRANS_CANDIDATES; k++)
+            {
+                const float fOut = fDiff * pfScale[k] + pfAirlight[c];
+                const float fOver = std::max(fOut - fPeak, 0.f);
+                const float fUnder = std::min(fOut, 0.f);
+
+                afLoss[k] += fOver * fOver + fUnder * fUnder;
+                afSum[k] += fOut;
+                afSquare[k] += fOut * fOut;
+            }
+        }
+    }
+
+    for (auto k = 0; k < TRANS_CANDIDATES; k++)
+    {
+        pdLoss[k] += afLoss[k];
+        pdSum[k] += afSum[k];
+        pdSquare[k] += afSquare[k];
+    }
+}
+
+/*
+    Function: BlockHistogram
+    Description: cumulative histogram of one channel of a block.
+        8 bit samples are counted in 256 bins, other depths are sorted. Only the values present in the block are kept.
+    Parameters:
+        pnImage - channel of the ref clip
+        nStartX, nStartY, nEndX, nEndY - the block
+    Return:
+        pdValue - distinct sample values in increasing order
+        pdCount, pdSum, pdSquare - count, sum and sum of squares of the samples below pdValue[i], at index i
+        number of distinct values
+ */
+template <typename T>
+int dehazing::BlockHistogram(const T* pnImage, int ref_stride, int nStartX, int nStartY, int nEndX, int nEndY,
+    double* pdValue, double* pdCount, double* pdSum, double* pdSquare) const
+{
+    int nDistinct = 0;
+
+    // Distinct values and their counts, the count of pdValue[i] is kept in pdCount[i + 1] first
+    if (bits == 8)
+    {
+        int anBin[256] = { 0 };
+        for (auto y = nStartY; y < nEndY; y++)
+            for (auto x = nStartX; x < nEndX; x++)
+                anBin[(int)pnImage[y * ref_stride + x]]++;
+
+        for (auto v = 0; v < 256; v++)
+        {
+            if (anBin[v] > 0)
+            {
+                pdValue[nDistinct] = v;
+                pdCount[++nDistinct] = anBin[v];
+            }
+        }
+    }
+    else
     {
-        for (auto i = 0; i < width; i++)
+        int nCount = 0;
+        for (auto y = nStartY; y < nEndY; y++)
+            for (auto x = nStartX; x < nEndX; x++)
+                pdValue[nCount++] = (double)pnImage[y * ref_stride + x];
+
+        std::sort(pdValue, pdValue + nCount);
+
+        for (auto i = 0; i < nCount; i++)
         {
-            // Upsample variable, from m_pfSmallTrans to m_pfTransmission
-            m_pfTransmission[j * width + i] = m_pfSmallTrans[(int)(j * fRatioY) * ref_width + (int)(i * fRatioX)];
+            if (nDistinct > 0 && pdValue[nDistinct - 1] == pdValue[i])
+            {
+                pdCount[nDistinct] += 1.0;
+            }
+            else
+            {
+                pdValue[nDistinct] = pdValue[i];
+                pdCount[++nDistinct] = 1.0;
+            }
         }
     }
+
+    pdCount[0] = 0.0;
+    pdSum[0] = 0.0;
+    pdSquare[0] = 0.0;
+    for (auto i = 0; i < nDistinct; i++)
+    {
+        const double dCount = pdCount[i + 1];
+        pdCount[i + 1] = pdCount[i] + dCount;
+        pdSum[i + 1] = pdSum[i] + dCount * pdValue[i];
+        pdSquare[i + 1] = pdSquare[i] + dCount * pdValue[i] * pdValue[i];
+    }
+
+    return nDistinct;
 }
 
 /*
     Function: NFTrsEstimation
     Description: Estiamte the transmission in the block. (COLOR)
         The algorithm use exhaustive searching method and its step size
-        is sampled to 0.1
+        is TransStep (0.1 by default). Each sample is loaded once and updates the cost of all candidates.
+        In histogram mode, the outputs of a channel are linear in the sample, so their sum and sum of squares come from
+        the sums of the block, and the clipped samples are the ones above or below a threshold of the cumulative histogram.
+        A candidate then costs two binary searches per channel instead of a pass over the samples.
+        With a previous frame, the squared distance to its transmission is added to the cost,
+        weighted by the similarity of the block between the two frames.
+        A block whose luminance did not change keeps its transmission.
 
     Parameters:
+        ref_stride - stride of the ref clip
         nStartx - top left point of a block
         nStarty - top left point of a block
-        nWid - frame width
-        nHei - frame height.
+        pPrev - state of the previous frame, nullptr if there is none
+        pfRow - scratch for one block row (B, G, R)
+        pdHist - scratch for the cumulative histograms of the block (B, G, R), nullptr without histogram mode
     Return:
         fOptTrs
  */
 template <typename T>
-float dehazing::NFTrsEstimationColor(const T* pnImageB, const T* pnImageG, const T* pnImageR, int nStartX, int nStartY)
+float dehazing::NFTrsEstimationColor(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride, int nStartX, int nStartY,
+    const TemporalState* pPrev, float* pfRow, double* pdHist) const
 {
-    int nOutR, nOutG, nOutB;
-    float fOptTrs;
-    double dCost, dMinCost, dMean;
+    const int nCandidates = m_nTransCandidates;
 
     int nEndX = std::min(nStartX + TBlockSize, ref_width);
     int nEndY = std::min(nStartY + TBlockSize, ref_height);
 
-    int nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX) * 3;
+    // YUV input passes its luma in the three places: one channel over a third of the samples gives the cost of three equal channels
+    const int nChannels = m_YUVFlag ? 1 : 3;
+    int nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX) * nChannels;
 
-    float fTrans = TransInit;
-    int nTrans = (int)(((peak + 1) >> 1) / TransInit);
-
-    for (auto nCounter = 0; nCounter < 7; nCounter++)
+    // Temporal coherence: similarity of the block to the previous frame and its transmission there
+    float fWeight = 0.f;
+    float fPrevTrans = 0.f;
+    if (pPrev != nullptr)
     {
-        long long int nSumofSLoss = 0;
-        int nLossCount = 0;
-        long long int nSumofSquaredOuts = 0;
-        long long int nSumofOuts = 0;
+        fPrevTrans = pPrev->m_pfSmallTrans[nStartY * ref_width + nStartX];
+        const float fExpScale = 255.f / peak;  // ExpLUT is indexed by 8 bit differences
+
+        bool bStatic = ctx.m_afAirlight[0] == pPrev->m_afAirlight[0] && ctx.m_afAirlight[1] == pPrev->m_afAirlight[1] &&
+                       ctx.m_afAirlight[2] == pPrev->m_afAirlight[2];
+        float fSumWeight = 0.f;
 
-        int half_peak = ((peak + 1) >> 1);
         for (auto y = nStartY; y < nEndY; y++)
         {
             for (auto x = nStartX; x < nEndX; x++)
             {
-                // (I-A)/t + A --> ((I-A) * k * ((peak + 1)/2) + A * ((peak+1)/2)) / ((peak+1)/2)
-                nOutB = (((int)pnImageB[y * ref_width + x] - m_anAirlight[0]) * nTrans + half_peak * m_anAirlight[0]) / half_peak;
-                nOutG = (((int)pnImageG[y * ref_width + x] - m_anAirlight[1]) * nTrans + half_peak * m_anAirlight[1]) / half_peak;
-                nOutR = (((int)pnImageR[y * ref_width + x] - m_anAirlight[2]) * nTrans + half_peak * m_anAirlight[2]) / half_peak;
+                const float fY = ctx.m_pfRefY[y * ref_width + x];
+                const float fPrevY = pPrev->m_pfRefY[y * ref_width + x];
+                const float fDiff = std::abs(fY - fPrevY);
 
-                if (nOutR > peak)
-                {
-                    nSumofSLoss += (nOutR - peak) * (nOutR - peak);
-                    nLossCount++;
-                }
-                else if (nOutR < 0)
-                {
-                    nSumofSLoss += nOutR * nOutR;
-                    nLossCount++;
-                }
-                if (nOutG > peak)
-                {
-                    nSumofSLoss += (nOutG - peak) * (nOutG - peak);
-                    nLossCount++;
-                }
-                else if (nOutG < 0)
-                {
-                    nSumofSLoss += nOutG * nOutG;
-                    nLossCount++;
-                }
-                if (nOutB > peak)
-                {
-                    nSumofSLoss += (nOutB - peak) * (nOutB - peak);
-                    nLossCount++;
-                }
-                else if (nOutB < 0)
-                {
-                    nSumofSLoss += nOutB * nOutB;
-                    nLossCount++;
-                }
-                nSumofSquaredOuts += nOutB * nOutB + nOutR * nOutR + nOutG * nOutG;;
-                nSumofOuts += nOutR + nOutG + nOutB;
+                bStatic = bStatic && fDiff == 0.f;
+                fSumWeight += ExpLUT[std::min((int)(fDiff * fExpScale), 255)];
             }
         }
 
-        dMean = (double)nSumofOuts / nNumberofPixels;
-        dCost = Lambda1 * (double)nSumofSLoss / nNumberofPixels
-                -((double)nSumofSquaredOuts / nNumberofPixels - dMean * dMean);
+        // Unchanged block, the previous optimum is kept without evaluating the candidates
+        if (bStatic)
+            return fPrevTrans;
+
+        fWeight = fSumWeight / (nNumberofPixels / nChannels);
+    }
+
+    // With the airlight of the luma for YUV input
+    const float afAirlight[3] = { (float)ctx.m_afAirlight[m_YUVFlag ? 2 : 0], (float)ctx.m_afAirlight[m_YUVFlag ? 2 : 1], (float)ctx.m_afAirlight[2] };
+
+    float fOptTrs = TransInit;
+    double dMinCost = 0.0;
+
+    auto evaluate = [&](int nCounter, float fTrans, double dSumofSLoss, double dSumofOuts, double dSumofSquaredOuts) {
+        double dMean = dSumofOuts / nNumberofPixels;
+        double dCost = Lambda1 * dSumofSLoss / nNumberofPixels
+                       - (dSumofSquaredOuts / nNumberofPixels - dMean * dMean);
+
+        if (pPrev != nullptr)
+        {
+            const double dDelta = fTrans - fPrevTrans;
+            dCost += (double)Lambda2 * fWeight * dDelta * dDelta * peak * peak;
+        }
 
         if (nCounter == 0 || dMinCost > dCost)
         {
             dMinCost = dCost;
             fOptTrs = fTrans;
         }
+    };
 
-        fTrans += 0.1f;
-        nTrans = (int)(1.f / fTrans * ((peak + 1) >> 1));
-    }
-    return fOptTrs;
-}
-
-/*
-    Function: AirlightEstimation
-    Description: estimate the atmospheric light value in a hazy image.
-                 it divides the hazy image into 4 sub-block and selects the optimal block,
-                 which has minimum std-dev and maximum average value.
-                 *Repeat* the dividing process until the size of sub-block is smaller than
-                 pre-specified threshold value. Then, We select the most similar value to
-                 the pure white.
-                 IT IS A RECURSIVE FUNCTION.
-    Parameter:
-        imInput - input image
-    Return:
-        m_anAirlight: estimated atmospheric light value
- */
-template <typename T>
-void dehazing::AirlightEstimation(const T* src, int _width, int _height, int stride)
-{
-    int nMinDistance = (int)(peak * SQRT_3);
-
-    int nMaxIndex;
-    double dpScore[3];
-    double dpMean[3] = { 0.0 };
-    double dpStds[3] = { 0.0 };
-    double variance[3] = { 0.0 };
-
-    float afMean[4] = { 0.f };
-    float afScore[4] = { 0.f };
-    float nMaxScore = 0.f;
+    if (m_TransHistFlag)
+    {
+        const int nSize = TBlockSize * TBlockSize + 1;
+        const T* const apImage[3] = { pnImageB, pnImageG, pnImageR };
+        int anDistinct[3];
 
-    // 4 sub-block
-    int half_w = _width / 2;
-    int half_h = _height / 2;
+        for (auto c = 0; c < nChannels; c++)
+        {
+            double* pdValue = pdHist + c * nSize * 4;
+            anDistinct[c] = BlockHistogram(apImage[c], ref_stride, nStartX, nStartY, nEndX, nEndY,
+                pdValue, pdValue + nSize, pdValue + nSize * 2, pdValue + nSize * 3);
+        }
 
-    T* iplUpperLeft  = new T[half_w * half_h * 3];
-    T* iplUpperRight = new T[half_w * half_h * 3];
-    T* iplLowerLeft  = new T[half_w * half_h * 3];
-    T* iplLowerRight = new T[half_w * half_h * 3];
+        for (auto nCounter = 0; nCounter < nCandidates; nCounter++)
+        {
+            const float fTrans = TransInit + nCounter * TransStep;
+            const double dScale = 1.0 / fTrans;
 
-    memcpy(iplUpperLeft,  src, half_w * half_h * 3 * sizeof(T));
-    memcpy(iplUpperRight, src + half_w * half_h * 3, half_w * half_h * 3 * sizeof(T));
-    memcpy(iplLowerLeft,  src + half_w * half_h * 6, half_w * half_h * 3 * sizeof(T));
-    memcpy(iplLowerRight, src + half_w * half_h * 9, half_w * half_h * 3 * sizeof(T));
+            double dSumofSLoss = 0.0;
+            double dSumofOuts = 0.0;
+            double dSumofSquaredOuts = 0.0;
 
-    if (_width * _height > ABlockSize)
-    {
-        // Compute the mean and std-dev in the sub-block
-        T* iplR = new T[half_h * half_w + 1];
-        T* iplG = new T[half_h * half_w + 1];
-        T* iplB = new T[half_h * half_w + 1];
-
-        //////////////////////////////////
-        // Upper left sub-block
-        for (auto j = 0; j < half_h; j++)
-        {
-            for (auto i = 0; i < half_w; i++)
+            for (auto c = 0; c < nChannels; c++)
             {
-                const auto pos = (j * half_w + i) * 3;
-                iplB[i] = iplUpperLeft[pos];
-                iplG[i] = iplUpperLeft[pos + 1];
-                iplR[i] = iplUpperLeft[pos + 2];
+                const double* pdValue = pdHist + c * nSize * 4;
+                const double* pdCount = pdValue + nSize;
+                const double* pdSum = pdValue + nSize * 2;
+                const double* pdSquare = pdValue + nSize * 3;
+                const int nLast = anDistinct[c];
+
+                // Output A + (I - A) / t = dOffset + I * dScale
+                const double dAir = afAirlight[c];
+                const double dOffset = dAir * (1.0 - dScale);
+
+                // Sum of (dShift + I * dScale)^2 over the values [nFirst, nEnd)
+                auto squares = [&](int nFirst, int nEnd, double dShift) {
+                    const double dCount = pdCount[nEnd] - pdCount[nFirst];
+                    const double dSum = pdSum[nEnd] - pdSum[nFirst];
+                    const double dSquare = pdSquare[nEnd] - pdSquare[nFirst];
+                    return dCount * dShift * dShift + 2.0 * dShift * dScale * dSum + dScale * dScale * dSquare;
+                };
+
+                dSumofOuts += pdCount[nLast] * dOffset + dScale * pdSum[nLast];
+                dSumofSquaredOuts += squares(0, nLast, dOffset);
+
+                // Clipped above the peak: I > A + (peak - A) * t, below 0: I < A * (1 - t)
+                const int nOver = (int)(std::upper_bound(pdValue, pdValue + nLast, dAir + (peak - dAir) * fTrans) - pdValue);
+                const int nUnder = (int)(std::lower_bound(pdValue, pdValue + nLast, dAir * (1.0 - fTrans)) - pdValue);
+
+                dSumofSLoss += squares(nOver, nLast, dOffset - peak) + squares(0, nUnder, dOffset);
             }
 
-            iplB += half_w;
-            iplG += half_w;
-            iplR += half_w;
+            evaluate(nCounter, fTrans, dSumofSLoss, dSumofOuts, dSumofSquaredOuts);
         }
 
-        meanStdDev(iplR, dpMean[0], dpStds[0], variance[0], half_w, half_h);
-        meanStdDev(iplG, dpMean[1], dpStds[1], variance[1], half_w, half_h);
-        meanStdDev(iplB, dpMean[2], dpStds[2], variance[2], half_w, half_h);
-        // dpScore: mean - std-dev
-        dpScore[0] = dpMean[0] - dpStds[0];
-        dpScore[1] = dpMean[1] - dpStds[1];
-        dpScore[2] = dpMean[2] - dpStds[2];
+        return fOptTrs;
+    }
+
+    // Candidates TransInit, TransInit + TransStep, ..., the unused lanes repeat the last one
+    float afTrans[TRANS_CANDIDATES];
+    float afScale[TRANS_CANDIDATES];
+    float fTrans = TransInit;
+    for (auto nCounter = 0; nCounter < TRANS_CANDIDATES; nCounter++)
+    {
+        afTrans[nCounter] = fTrans;
+        afScale[nCounter] = 1.f / fTrans;
+        if (nCounter < nCandidates - 1)
+            fTrans += TransStep;
+    }
 
-        afScore[0] = (float)(dpScore[0] + dpScore[1] + dpScore[2]);
+    double adSumofSLoss[TRANS_CANDIDATES] = { 0.0 };
+    double adSumofOuts[TRANS_CANDIDATES] = { 0.0 };
+    double adSumofSquaredOuts[TRANS_CANDIDATES] = { 0.0 };
 
-        nMaxScore = afScore[0];
-        nMaxIndex = 0;
+    float* pfRowB = pfRow;
+    float* pfRowG = pfRow + TBlockSize;
+    float* pfRowR = pfRow + TBlockSize * 2;
 
-        //////////////////////////////////
-        iplB -= half_h * half_w;
-        iplG -= half_h * half_w;
-        iplR -= half_h * half_w;
+    for (auto y = nStartY; y < nEndY; y++)
+    {
+        for (auto x = nStartX; x < nEndX; x++)
+            pfRowB[x - nStartX] = (float)pnImageB[y * ref_stride + x];
 
-        // Upper right sub-block
-        for (auto j = 0; j < half_h; j++)
+        if (nChannels == 3)
         {
-            for (auto i = 0; i < half_w; i++)
+            for (auto x = nStartX; x < nEndX; x++)
             {
-                const auto pos = (j * half_w + i) * 3;
-                iplB[i] = iplUpperRight[pos];
-                iplG[i] = iplUpperRight[pos + 1];
-                iplR[i] = iplUpperRight[pos + 2];
+                pfRowG[x - nStartX] = (float)pnImageG[y * ref_stride + x];
+                pfRowR[x - nStartX] = (float)pnImageR[y * ref_stride + x];
             }
-
-            iplB += half_w;
-            iplG += half_w;
-            iplR += half_w;
         }
 
-        meanStdDev(iplR, dpMean[0], dpStds[0], variance[0], half_w, half_h);
-        meanStdDev(iplG, dpMean[1], dpStds[1], variance[1], half_w, half_h);
-        meanStdDev(iplB, dpMean[2], dpStds[2], variance[2], half_w, half_h);
+        m_pfnTransCostRow(pfRowB, pfRowG, pfRowR, nChannels, nEndX - nStartX, afAirlight, afScale, (float)peak,
+            adSumofSLoss, adSumofOuts, adSumofSquaredOuts);
+    }
+
+    for (auto nCounter = 0; nCounter < nCandidates; nCounter++)
+        evaluate(nCounter, afTrans[nCounter], adSumofSLoss[nCounter], adSumofOuts[nCounter], adSumofSquaredOuts[nCounter]);
 
-        dpScore[0] = dpMean[0] - dpStds[0];
-        dpScore[1] = dpMean[1] - dpStds[1];
-        dpScore[2] = dpMean[2] - dpStds[2];
+    return fOptTrs;
+}
 
-        afScore[1] = (float)(dpScore[0] + dpScore[1] + dpScore[2]);
+/*
+    Function: AirlightGridMaker
+    Description: rows and columns of the block corners read by AirlightBlock. The sub-blocks of each level
+        have fixed sizes, so their corners only depend on the frame size and ABlockSize, not on the frame.
+    Return:
+        m_pnAirX, m_pnAirY - sorted corner columns and rows, the first is 0
+ */
+void dehazing::AirlightGridMaker()
+{
+    std::vector<int> anOriginX(1, 0), anOriginY(1, 0);
+    std::vector<int> anX(1, 0), anY(1, 0);
 
-        if (afScore[1] > nMaxScore)
+    // Corners and origins of the sub-blocks, the same loop as AirlightBlock
+    const auto fnSplit = [](std::vector<int>& anOrigin, std::vector<int>& anCorner, int nHalf) {
+        std::vector<int> anNext;
+        for (auto nOrigin : anOrigin)
         {
-            nMaxScore = afScore[1];
-            nMaxIndex = 1;
+            anCorner.push_back(nOrigin + nHalf);
+            anCorner.push_back(nOrigin + 2 * nHalf);
+            anNext.push_back(nOrigin);
+            anNext.push_back(nOrigin + nHalf);
         }
+        std::sort(anNext.begin(), anNext.end());
+        anNext.erase(std::unique(anNext.begin(), anNext.end()), anNext.end());
+        anOrigin.swap(anNext);
+    };
+
+    int nBlockW = width;
+    int nBlockH = height;
+
+    while (nBlockW * nBlockH > ABlockSize && nBlockW / 2 > 0 && nBlockH / 2 > 0)
+    {
+        fnSplit(anOriginX, anX, nBlockW / 2);
+        fnSplit(anOriginY, anY, nBlockH / 2);
+        nBlockW /= 2;
+        nBlockH /= 2;
+    }
+
+    for (auto* panCorner : { &anX, &anY })
+    {
+        std::sort(panCorner->begin(), panCorner->end());
+        panCorner->erase(std::unique(panCorner->begin(), panCorner->end()), panCorner->end());
+    }
+
+    m_nAirX = (int)anX.size();
+    m_nAirY = (int)anY.size();
+    m_pnAirX = new int[m_nAirX];
+    m_pnAirY = new int[m_nAirY];
+    std::copy(anX.begin(), anX.end(), m_pnAirX);
+    std::copy(anY.begin(), anY.end(), m_pnAirY);
+}
 
-        //////////////////////////////////
-        iplB -= half_h * half_w;
-        iplG -= half_h * half_w;
-        iplR -= half_h * half_w;
+// Entries of m_pnAirSum and m_pnAirSquare: a table of each channel with one row for each corner row, and a row of column sums
+size_t dehazing::AirlightTableSize() const
+{
+    return (size_t)m_nAirX * (m_nAirY + 1) * (m_YUVFlag ? 1 : 3);
+}
+
+/*
+    Function: AirlightTable
+    Description: build the summed-area tables of each channel and of its square, used by AirlightEstimation.
+        The tables are only kept at the corners of AirlightGridMaker, m_nAirX * m_nAirY entries per channel.
+        The first row and column are zero. The last row of each table sums the columns of the rows read so far.
+        Float input is quantized to 16 bit, which is enough to rank the sub-blocks.
+        YUV input has the tables of its luma alone, passed in the place of R.
+    Parameter:
+        srcpB, srcpG, srcpR - input image
+    Return:
+        m_pnAirSum, m_pnAirSquare - summed-area tables (B, G, R)
+ */
+template <typename T>
+void dehazing::AirlightTable(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int stride) const
+{
+    const int nTableSize = m_nAirX * (m_nAirY + 1);
+    const int nPlanes = m_YUVFlag ? 1 : 3;
+    const T* const apSrc[3] = { m_YUVFlag ? srcpR : srcpB, srcpG, srcpR };
 
-        // Lower left sub-block
-        for (auto j = 0; j < half_h; j++)
+    // The channels are split between the threads
+    ParallelRows(nPlanes, 1, [&](int nBegin, int nEnd, int) {
+        for (auto c = nBegin; c < nEnd; c++)
         {
-            for (auto i = 0; i < half_w; i++)
+            uint64_t* pnSum = ctx.m_pnAirSum + c * nTableSize;
+            uint64_t* pnSquare = ctx.m_pnAirSquare + c * nTableSize;
+            uint64_t* pnColumnSum = pnSum + m_nAirY * m_nAirX;
+            uint64_t* pnColumnSquare = pnSquare + m_nAirY * m_nAirX;
+
+            std::fill(pnSum, pnSum + m_nAirX, 0);
+            std::fill(pnSquare, pnSquare + m_nAirX, 0);
+            std::fill(pnColumnSum, pnColumnSum + m_nAirX, 0);
+            std::fill(pnColumnSquare, pnColumnSquare + m_nAirX, 0);
+
+            int nRow = 1;
+            for (auto j = 0; j < m_pnAirY[m_nAirY - 1]; j++)
             {
-                const auto pos = (j * half_w + i) * 3;
-                iplB[i] = iplLowerLeft[pos];
-                iplG[i] = iplLowerLeft[pos + 1];
-                iplR[i] = iplLowerLeft[pos + 2];
-            }
+                const T* pSrc = apSrc[c] + j * stride;
+                uint64_t nRowSum = 0;
+                uint64_t nRowSquare = 0;
+
+                for (auto nColumn = 1; nColumn < m_nAirX; nColumn++)
+                {
+                    for (auto i = m_pnAirX[nColumn - 1]; i < m_pnAirX[nColumn]; i++)
+                    {
+                        const uint64_t nValue = AirlightSample(pSrc[i]);
+                        nRowSum += nValue;
+                        nRowSquare += nValue * nValue;
+                    }
+                    pnColumnSum[nColumn] += nRowSum;
+                    pnColumnSquare[nColumn] += nRowSquare;
+                }
 
-            iplB += half_w;
-            iplG += half_w;
-            iplR += half_w;
+                if (j + 1 == m_pnAirY[nRow])
+                {
+                    std::copy(pnColumnSum, pnColumnSum + m_nAirX, pnSum + nRow * m_nAirX);
+                    std::copy(pnColumnSquare, pnColumnSquare + m_nAirX, pnSquare + nRow * m_nAirX);
+                    nRow++;
+                }
+            }
         }
+    });
+}
 
-        meanStdDev(iplR, dpMean[0], dpStds[0], variance[0], half_w, half_h);
-        meanStdDev(iplG, dpMean[1], dpStds[1], variance[1], half_w, half_h);
-        meanStdDev(iplB, dpMean[2], dpStds[2], variance[2], half_w, half_h);
+/*
+    Function: AirlightBlock
+    Description: divide the image into 4 sub-blocks and select the optimal block, which has minimum std-dev
+        and maximum average value. *Repeat* the dividing process until the size of sub-block is smaller than
+        pre-specified threshold value.
+        The mean and std-dev of each sub-block are read from the summed-area tables of AirlightTable.
+    Return:
+        nX, nY, nBlockW, nBlockH - the selected sub-block
+ */
+void dehazing::AirlightBlock(const DehazeContext& ctx, int& nX, int& nY, int& nBlockW, int& nBlockH) const
+{
+    const int nTableSize = m_nAirX * (m_nAirY + 1);
+    const int nPlanes = m_YUVFlag ? 1 : 3;
 
-        dpScore[0] = dpMean[0] - dpStds[0];
-        dpScore[1] = dpMean[1] - dpStds[1];
-        dpScore[2] = dpMean[2] - dpStds[2];
+    // Index of a corner column or row in the tables
+    const auto fnColumn = [&](int x) { return (int)(std::lower_bound(m_pnAirX, m_pnAirX + m_nAirX, x) - m_pnAirX); };
+    const auto fnRow = [&](int y) { return (int)(std::lower_bound(m_pnAirY, m_pnAirY + m_nAirY, y) - m_pnAirY); };
 
-        afScore[2] = (float)(dpScore[0] + dpScore[1] + dpScore[2]);
+    // Current block
+    nX = 0;
+    nY = 0;
+    nBlockW = width;
+    nBlockH = height;
 
-        if (afScore[2] > nMaxScore)
-        {
-            nMaxScore = afScore[2];
-            nMaxIndex = 2;
-        }
+    while (nBlockW * nBlockH > ABlockSize && nBlockW / 2 > 0 && nBlockH / 2 > 0)
+    {
+        // 4 sub-block: upper left, upper right, lower left, lower right
+        const int half_w = nBlockW / 2;
+        const int half_h = nBlockH / 2;
+        const int anX[4] = { nX, nX + half_w, nX, nX + half_w };
+        const int anY[4] = { nY, nY, nY + half_h, nY + half_h };
+        const double dScale = 1.0 / ((double)half_w * half_h);
 
-        //////////////////////////////////
-        iplB -= half_h * half_w;
-        iplG -= half_h * half_w;
-        iplR -= half_h * half_w;
+        float nMaxScore = 0.f;
+        int nMaxIndex = 0;
 
-        // Lower right sub-block
-        for (auto j = 0; j < half_h; j++)
+        for (auto nBlock = 0; nBlock < 4; nBlock++)
         {
-            for (auto i = 0; i < half_w; i++)
+            const int nLeft = fnColumn(anX[nBlock]);
+            const int nRight = fnColumn(anX[nBlock] + half_w);
+            const int nTop = fnRow(anY[nBlock]) * m_nAirX;
+            const int nBottom = fnRow(anY[nBlock] + half_h) * m_nAirX;
+            const int nTL = nTop + nLeft;
+            const int nTR = nTop + nRight;
+            const int nBL = nBottom + nLeft;
+            const int nBR = nBottom + nRight;
+
+            // dpScore: mean - std-dev
+            double dScore = 0.0;
+            for (auto c = 0; c < nPlanes; c++)
             {
-                const auto pos = (j * half_w + i) * 3;
-                iplB[i] = iplLowerRight[pos];
-                iplG[i] = iplLowerRight[pos + 1];
-                iplR[i] = iplLowerRight[pos + 2];
+                const uint64_t* pnSum = ctx.m_pnAirSum + c * nTableSize;
+                const uint64_t* pnSquare = ctx.m_pnAirSquare + c * nTableSize;
+
+                const double dMean = (double)(pnSum[nBR] - pnSum[nTR] - pnSum[nBL] + pnSum[nTL]) * dScale;
+                const double dSquare = (double)(pnSquare[nBR] - pnSquare[nTR] - pnSquare[nBL] + pnSquare[nTL]) * dScale;
+                const double dStd = std::sqrt(std::max(dSquare - dMean * dMean, 0.0));
+
+                dScore += dMean - dStd;
             }
 
-            iplB += half_w;
-            iplG += half_w;
-            iplR += half_w;
+            if (nBlock == 0 || (float)dScore > nMaxScore)
+            {
+                nMaxScore = (float)dScore;
+                nMaxIndex = nBlock;
+            }
         }
 
-        meanStdDev(iplR, dpMean[0], dpStds[0], variance[0], half_w, half_h);
-        meanStdDev(iplG, dpMean[1], dpStds[1], variance[1], half_w, half_h);
-        meanStdDev(iplB, dpMean[2], dpStds[2], variance[2], half_w, half_h);
+        // Select the sub-block, which has maximum score
+        nX = anX[nMaxIndex];
+        nY = anY[nMaxIndex];
+        nBlockW = half_w;
+        nBlockH = half_h;
+    }
+}
+
+/*
+    Function: AirlightEstimation
+    Description: estimate the atmospheric light value in a hazy image.
+                 The sub-block of AirlightBlock is searched for the most similar value to the pure white.
+    Parameter:
+        srcpB, srcpG, srcpR - input image
+    Return:
+        m_afAirlight: estimated atmospheric light value
+ */
+template <typename T>
+void dehazing::AirlightEstimation(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int stride) const
+{
+    const auto tStart = std::chrono::steady_clock::now();
 
-        dpScore[0] = dpMean[0] - dpStds[0];
-        dpScore[1] = dpMean[1] - dpStds[1];
-        dpScore[2] = dpMean[2] - dpStds[2];
+    AirlightTable(ctx, srcpB, srcpG, srcpR, stride);
 
-        afScore[3] = (float)(dpScore[0] + dpScore[1] + dpScore[2]);
+    int nX, nY, _width, _height;
+    AirlightBlock(ctx, nX, nY, _width, _height);
 
-        if (afScore[3] > nMaxScore)
-        {
-            nMaxScore = afScore[3];
-            nMaxIndex = 3;
-        }
+    float fMinDistance = std::numeric_limits<float>::max();
 
-        // Select the sub-block, which has maximum score
-        switch (nMaxIndex)
+    // Select the atmospheric light value in the sub-block
+    for (auto j = nY; j < nY + _height; j++)
+    {
+        for (auto i = nX; i < nX + _width; i++)
         {
-        case 0:
-            AirlightEstimation(iplUpperLeft, half_w, half_h, stride / 2); break;
-        case 1:
-            AirlightEstimation(iplUpperRight, half_w, half_h, stride / 2); break;
-        case 2:
-            AirlightEstimation(iplLowerLeft, half_w, half_h, stride / 2); break;
-        case 3:
-            AirlightEstimation(iplLowerRight, half_w, half_h, stride / 2); break;
+            const auto pos = j * stride + i;
+            // peak-r, peak-g, peak-b
+            float fDistance = std::sqrt((float)(peak - srcpB[pos]) * (peak - srcpB[pos]) +
+                                        (float)(peak - srcpG[pos]) * (peak - srcpG[pos]) +
+                                        (float)(peak - srcpR[pos]) * (peak - srcpR[pos]));
+            // Integer input compares whole distances, the first pixel of a tie is kept
+            if (std::is_integral<T>::value)
+                fDistance = std::floor(fDistance);
+            if (fMinDistance > fDistance)
+            {
+                // Atmospheric light value
+                fMinDistance = fDistance;
+                ctx.m_afAirlight[0] = srcpB[pos];
+                ctx.m_afAirlight[1] = srcpG[pos];
+                ctx.m_afAirlight[2] = srcpR[pos];
+            }
         }
+    }
 
-        iplB -= half_h * half_w;
-        iplG -= half_h * half_w;
-        iplR -= half_h * half_w;
+    ctx.m_anStageTime[STAGE_AIRLIGHT] = ElapsedMicroseconds(tStart);
+}
 
-        delete[] iplR;
-        delete[] iplG;
-        delete[] iplB;
-    }
-    else
+/*
+    Function: AirlightEstimationYUV
+    Description: AirlightEstimation of YUV input. The sub-block is selected on the luma, then the pixel
+        nearest to the pure white (peak luma and neutral chroma) is searched with the chroma sample covering it.
+    Parameter:
+        srcpY, srcpU, srcpV - input image
+        chroma_stride - stride of the chroma planes
+    Return:
+        m_afAirlight: estimated atmospheric light value (V, U, Y)
+ */
+template <typename T>
+void dehazing::AirlightEstimationYUV(DehazeContext& ctx, const T* srcpY, const T* srcpU, const T* srcpV, int stride, int chroma_stride) const
+{
+    const auto tStart = std::chrono::steady_clock::now();
+
+    AirlightTable(ctx, srcpY, srcpY, srcpY, stride);
+
+    int nX, nY, nBlockW, nBlockH;
+    AirlightBlock(ctx, nX, nY, nBlockW, nBlockH);
+
+    // Neutral chroma, float chroma is centered on 0
+    const float fNeutral = std::is_integral<T>::value ? (float)(1 << (bits - 1)) : 0.f;
+    float fMinDistance = std::numeric_limits<float>::max();
+
+    for (auto j = nY; j < nY + nBlockH; j++)
     {
-        // Select the atmospheric light value in the sub-block
-        for (auto j = 0; j < _height; j++)
+        for (auto i = nX; i < nX + nBlockW; i++)
         {
-            for (auto i = 0; i < _width; i++)
+            const auto pos = j * stride + i;
+            const auto chroma_pos = (j >> m_nSubSamplingH) * chroma_stride + (i >> m_nSubSamplingW);
+
+            float fDistance = std::sqrt((float)(peak - srcpY[pos]) * (peak - srcpY[pos]) +
+                                        (srcpU[chroma_pos] - fNeutral) * (srcpU[chroma_pos] - fNeutral) +
+                                        (srcpV[chroma_pos] - fNeutral) * (srcpV[chroma_pos] - fNeutral));
+            if (std::is_integral<T>::value)
+                fDistance = std::floor(fDistance);
+            if (fMinDistance > fDistance)
             {
-                const auto pos = (j * _width + i) * 3;
-                // peak-r, peak-g, peak-b
-                int nDistance = (int)std::sqrt((float)(peak - src[pos]) * (peak - src[pos]) +
-                                               (float)(peak - src[pos + 1]) * (peak - src[pos + 1]) +
-                                               (float)(peak - src[pos + 2]) * (peak - src[pos + 2]));
-                if (nMinDistance > nDistance)
-                {
-                    // Atmospheric light value
-                    nMinDistance = nDistance;
-                    m_anAirlight[0] = src[pos];
-                    m_anAirlight[1] = src[pos + 1];
-                    m_anAirlight[2] = src[pos + 2];
-                }
+                fMinDistance = fDistance;
+                ctx.m_afAirlight[0] = srcpV[chroma_pos];
+                ctx.m_afAirlight[1] = srcpU[chroma_pos];
+                ctx.m_afAirlight[2] = srcpY[pos];
             }
         }
     }
 
-    delete[] iplUpperLeft;
-    delete[] iplUpperRight;
-    delete[] iplLowerLeft;
-    delete[] iplLowerRight;
+    ctx.m_anStageTime[STAGE_AIRLIGHT] = ElapsedMicroseconds(tStart);
 }
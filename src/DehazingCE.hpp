@@ -1,17 +1,182 @@
 #ifndef DEHAZINGCE_HPP_
 #define DEHAZINGCE_HPP_
 
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
 #include "vapoursynth/VapourSynth.h"
 #include "vapoursynth/VSHelper.h"
 
+#include "ScratchArena.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+// Gamma correction table of one bit depth and gamma, shared by reference count between instances.
+// The table holds peak + 1 samples of the output type and is built on first use.
+class GammaLUT
+{
+public:
+    static GammaLUT* Acquire(int nBits, float fGamma);
+    static void Release(GammaLUT* pLUT);
+
+    template <typename T>
+    const T* Table();
+
+private:
+    GammaLUT(int nBits, float fGamma);
+    ~GammaLUT();
+    void Build();
+
+    int m_nBits;
+    float m_fGamma;
+    int m_nRefCount;
+
+    std::once_flag m_Built;
+    uint8_t* m_pTable;
+};
+
+template <typename T>
+inline const T* GammaLUT::Table()
+{
+    std::call_once(m_Built, &GammaLUT::Build, this);
+    return reinterpret_cast<const T*>(m_pTable);
+}
+
+// Stages of a frame, timed in DehazeContext::m_anStageTime
+enum DehazeStage
+{
+    STAGE_AIRLIGHT,
+    STAGE_TRANSMISSION,
+    STAGE_UPSAMPLE,
+    STAGE_GUIDED_FILTER,
+    STAGE_RESTORE,
+    STAGE_POST_PROCESSING,
+    STAGE_COUNT
+};
+
+// Box filtered planes of GuidedCoefficients, each strip of GuidedFilterStrips carries one cumulative row for each
+constexpr int GUIDED_BOX_PLANES = 18;
+
+// Frame rows held by the arrays of one strip of GuidedFilterStrips
+struct StripRows
+{
+    int nFrameHeight;
+    int nTop;                  // First row of the guidance and statistics
+    int nNextTop;              // nTop of the next strip
+    int nCoefTop;              // First and last + 1 rows of the valid coefficients
+    int nCoefEnd;
+    int nNextCoefTop;          // nCoefTop of the next strip
+    float* pfCarry;            // Cumulative row above the strip of each box filtered plane
+};
+
+// Per-frame working state. The filter keeps a pool of these so that
+// concurrent frame requests never share scratch buffers.
+struct DehazeContext
+{
+    DehazeContext(int nW, int nH, int n_refW, int n_refH, int nTBlockSize, bool bPrevFlag, bool bTransHist, bool bLumaGuide, bool bRestoreOnly, int nChromaW, size_t nAirTableSize,
+        size_t nRefImageSize, size_t nScratchSize, int nThreads);
+    ~DehazeContext();
+
+    float m_afAirlight[3] = { 0.f };
+
+    float* m_pfRImg;           // Guidance image, not allocated in luma guide mode
+    float* m_pfGImg;
+    float* m_pfBImg;
+    float* m_pfYImg;           // Luma guidance image, only allocated in luma guide mode
+
+    float* m_pfTransmission;   // Preliminary transmission
+    float* m_pfTransmissionR;  // Refined transmission, the only plane of a restore-only context
+    float* m_pfSmallTrans;
+
+    float* m_pfTransRow;       // One block row of the ref clip (B, G, R) for each thread
+    float* m_pfChromaRow;      // Summed luma rows and chroma transmission of one chroma row for each thread, only allocated for YUV input
+    double* m_pdTransHist;     // Cumulative histograms of one block (B, G, R) for each thread, only allocated in histogram mode
+
+    uint64_t* m_pnAirSum;      // Summed-area tables for airlight estimation at the block corners (B, G, R, or Y alone for YUV input)
+    uint64_t* m_pnAirSquare;
+
+    float* m_pfRefY;           // Luminance of the ref clip, only allocated in temporal mode
+
+    uint8_t* m_pRefImage;      // Ref clip made by DownscaleRef (B, G, R, or Y alone for YUV input), only allocated with the internal downscaler
+    uint8_t* m_pRefSum;        // Column sums of the source rows of one ref row for each thread, only allocated with the internal downscaler
+
+    ScratchArena m_Scratch;    // Temporaries of the guided filter, reset for each frame
+
+    uint8_t* m_pRestoreTable = nullptr;         // Restore tables of 8-10 bit input (B, G, R), built for m_afRestoreAir
+    float m_afRestoreAir[3] = { 0.f };
+
+    int64_t m_anStageTime[STAGE_COUNT] = { 0 };  // Microseconds spent in each stage of the last frame, 0 if skipped
+};
+
+// Analysis of the last processed frame, read by the temporal coherence cost of the next one.
+struct TemporalState
+{
+    TemporalState(int n_refW, int n_refH);
+    ~TemporalState();
+
+    int m_nFrame = -1;         // Frame number the state belongs to, -1 if empty
+    float m_afAirlight[3] = { 0.f };
+
+    float* m_pfSmallTrans;
+    float* m_pfRefY;
+};
+
 class dehazing
 {
 public:
-    dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABlockSize, int nTBlockSize, float fTransInit, bool bPrevFlag, bool bPosFlag, double dL1, float fL2, int nGBlockSize);
+    dehazing(int nW, int nH, int n_refW, int n_refH, int nBits, int nABlockSize, int nTBlockSize, float fTransInit, float fTransStep, bool bPrevFlag, bool bPosFlag, double dL1, float fL2, int nGBlockSize, int nGStepSize, bool bStreamFlag, bool bLumaGuide, int nThreads);
     ~dehazing();
 
+    DehazeContext* CreateContext() const;
+    TemporalState* CreateTemporalState() const;
+
+    void SetYUV(int nSubSamplingW, int nSubSamplingH);
+    void SetRefDownscale();
+    void SetRestoreOnly();
+
     template <typename T>
-    void RemoveHaze(const T* src, const T* refpB, const T* refpG, const T* refpR, T* dst, int stride);
+    void DownscaleRef(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride) const;
+
+    template <typename T>
+    const T* RefPlane(const DehazeContext& ctx, int nPlane) const;
+    int RefStride() const { return ref_width; }
+
+    template <typename T>
+    void AirlightEstimation(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int stride) const;
+
+    template <typename T>
+    void AirlightEstimationYUV(DehazeContext& ctx, const T* srcpY, const T* srcpU, const T* srcpV, int stride, int chroma_stride) const;
+
+    template <typename T>
+    void EstimateTransmission(DehazeContext& ctx, const T* refpB, const T* refpG, const T* refpR, int ref_stride, const TemporalState* pPrev) const;
+
+    template <typename T>
+    void RemoveHaze(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride,
+        const T* refpB, const T* refpG, const T* refpR, int ref_stride, T* dstpB, T* dstpG, T* dstpR, int dst_stride,
+        const TemporalState* pPrev) const;
+
+    template <typename T>
+    void ReuseTransmission(DehazeContext& ctx, const T* refpB, const T* refpG, const T* refpR, int ref_stride) const;
+
+    template <typename T>
+    void RefineTransmission(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride) const;
+
+    template <typename T>
+    void RestoreImage(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int src_stride,
+        T* dstpB, T* dstpG, T* dstpR, int dst_stride) const;
+
+    template <typename T>
+    void RestoreImageYUV(DehazeContext& ctx, const T* srcpY, const T* srcpU, const T* srcpV, int src_stride, int src_chroma_stride,
+        T* dstpY, T* dstpU, T* dstpV, int dst_stride, int dst_chroma_stride) const;
+
+    void StoreTemporalState(const DehazeContext& ctx, TemporalState& state, int n) const;
+
+    float MeanTransmission(const DehazeContext& ctx) const;
+
+    size_t FrameFootprint(int nStripHeight) const;
+    bool FitMemory(size_t nBudget);
+    int StripHeight() const { return m_nStripHeight; }
 
     void MakeExpLUT();
     void GuideLUTMaker();
@@ -19,26 +184,81 @@ public:
 
 private:
     template <typename T>
-    void AirlightEstimation(const T* src, int _width, int _height, int stride);
+    void AirlightTable(DehazeContext& ctx, const T* srcpB, const T* srcpG, const T* srcpR, int stride) const;
+
+    void AirlightBlock(const DehazeContext& ctx, int& nX, int& nY, int& nBlockW, int& nBlockH) const;
+    void AirlightGridMaker();
+    size_t AirlightTableSize() const;
+
+    template <typename T>
+    float NFTrsEstimationColor(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride, int nStartX, int nStartY,
+        const TemporalState* pPrev, float* pfRow, double* pdHist) const;
+
+    template <typename T>
+    int BlockHistogram(const T* pnImage, int ref_stride, int nStartX, int nStartY, int nEndX, int nEndY,
+        double* pdValue, double* pdCount, double* pdSum, double* pdSquare) const;
+
+    void AccumulateRow(const uint8_t* pnSrc, int nCount, uint32_t* pnSum) const;
+    void AccumulateRow(const uint16_t* pnSrc, int nCount, uint32_t* pnSum) const;
+    void AccumulateRow(const float* pfSrc, int nCount, float* pfSum) const;
+    size_t RefImageSize() const;
+
+    void UpsampleTransmission(DehazeContext& ctx) const;
 
     template <typename T>
-    float NFTrsEstimationColor(const T* pnImageR, const T* pnImageG, const T* pnImageB, int nStartX, int nStartY);
+    void RefLuminance(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride) const;
 
-    void UpsampleTransmission();
+    template <typename T>
+    void TransmissionEstimationColor(DehazeContext& ctx, const T* pnImageB, const T* pnImageG, const T* pnImageR, int ref_stride,
+        const TemporalState* pPrev) const;
 
     template <typename T>
-    void TransmissionEstimationColor(const T* pnImageR, const T* pnImageG, const T* pnImageB);
+    void PostProcessing(const DehazeContext& ctx, T* dstpB, T* dstpG, T* dstpR, int stride) const;  // Called by RestoreImage();
 
     template <typename T>
-    void PostProcessing(T* dst, int width, int height, int stride);  // Called by RestoreImage();
+    T RestoreSample(float fValue, const T* pGammaLUT) const;
 
     template <typename T>
-    void RestoreImage(const T* src, T* dst, int height, int width, int stride);
+    void RestoreLuma(DehazeContext& ctx, const T* srcp, int src_stride, T* dstp, int dst_stride) const;
+
+    template <typename T>
+    void RestoreChroma(const DehazeContext& ctx, const T* srcp, int src_stride, T* dstp, int dst_stride, float fAirlight) const;
+
+    template <typename T>
+    void RestoreTable(DehazeContext& ctx) const;
+
+    void RestoreRows(DehazeContext& ctx, const uint8_t* srcpB, const uint8_t* srcpG, const uint8_t* srcpR, int src_stride,
+        uint8_t* dstpB, uint8_t* dstpG, uint8_t* dstpR, int dst_stride) const;
+    void RestoreRows(DehazeContext& ctx, const uint16_t* srcpB, const uint16_t* srcpG, const uint16_t* srcpR, int src_stride,
+        uint16_t* dstpB, uint16_t* dstpG, uint16_t* dstpR, int dst_stride) const;
+    void RestoreRows(DehazeContext& ctx, const float* srcpB, const float* srcpG, const float* srcpR, int src_stride,
+        float* dstpB, float* dstpG, float* dstpR, int dst_stride) const;
 
-    void CalcAcoeff(float* pfSigma, float* pfCov, float* pfA1, float* pfA2, float* pfA3, int nIdx);
-    void BoxFilter(float* pfInArray, int nR, int nWid, int nHei, float*& fOutArray);
-    void BoxFilter(float* pfInArray1, float* pfInArray2, float* pfInArray3, int nR, int nWid, int nHei, float*& pfOutArray1, float*& pfOutArray2, float*& pfOutArray3);
-    void GuidedFilter(int nW, int nH, float fEps);
+    void RestoreLUTMaker();
+
+    template <typename F>
+    void ParallelRows(int nCount, int nAlign, const F& fnRange) const;
+
+    void CalcAcoeff(float* pfSigma, float* pfCov, float* pfA1, float* pfA2, float* pfA3, int nIdx) const;
+    void BoxFilterPlane(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int nR, int nWid, int nHei) const;
+    void BoxFilter(ScratchArena& arena, float* pfInArray, int nR, int nWid, int nHei, float*& fOutArray) const;
+    void BoxFilterStrip(ScratchArena& arena, const float* pfInArray, int nR, int nWid, int nHei, int nTop, int nNextTop, int nFrameHeight,
+        float* pfCarry, float* pfOutArray) const;
+    template <typename TSum>
+    void GuideStatistics(ScratchArena& arena, const float* pfImageR, const float* pfImageG, const float* pfImageB, int nW, int nH, int nR,
+        float* pfMeanIr, float* pfMeanIg, float* pfMeanIb, float* pfVarIrr, float* pfVarIrg, float* pfVarIrb, float* pfVarIgg, float* pfVarIgb, float* pfVarIbb) const;
+    void GuidedCoefficients(ScratchArena& arena, float* pfImageR, float* pfImageG, float* pfImageB, float* pfP, int nW, int nH, int nR, float fEps,
+        float* pfOutA1, float* pfOutA2, float* pfOutA3, float* pfOutB, bool bIntegerGuide, const StripRows* pStrip) const;
+    template <typename TSum>
+    void LumaStatistics(ScratchArena& arena, const float* pfImageY, int nW, int nH, int nR, float* pfMeanI, float* pfVarI) const;
+    void LumaCoefficients(ScratchArena& arena, float* pfImageY, float* pfP, int nW, int nH, int nR, float fEps,
+        float* pfOutA, float* pfOutB, bool bIntegerGuide, const StripRows* pStrip) const;
+    void GuidedFilter(DehazeContext& ctx, int nW, int nH, float fEps) const;
+    void GuidedFilterStrips(DehazeContext& ctx, int nW, int nH, float fEps) const;
+    void GuidedFilterStream(DehazeContext& ctx, int nW, int nH, float fEps) const;
+    void GuidedFilterStreamStrip(ScratchArena& arena, DehazeContext& ctx, int nW, int nH, float fEps, int nFirst, int nLast) const;
+    size_t StreamStripSize(int nW, int nH) const;
+    size_t GuidedScratchSize(int nStripHeight) const;
 
 private:
     int width;
@@ -51,24 +271,33 @@ private:
 
     int TBlockSize;
     float TransInit;
-    float fParameter;
+    float TransStep;           // Step between the candidates of the transmission search
+    int m_nTransCandidates;
+    bool m_TransHistFlag;      // Evaluate the candidates from block histograms instead of per sample
+    float m_fGammaExp;         // 1 / gamma, float input applies it directly instead of the table
 
     int GBlockSize;
     int StepSize;
+    int m_nStripHeight;        // Output rows of a strip of the guided filter, 0 for the whole frame
     float GSigma;
 
     int ABlockSize;
-    int m_anAirlight[3] = { 0 };
-    int m_nAirlight;
-
-    // Airlight search range
-    int m_nTopLeftX;
-    int m_nTopLeftY;
-    int m_nBottomRightX;
-    int m_nBottomRightY;
 
-    bool m_PreviousFlag;
+    bool m_PreviousFlag;       // Flag for temporal coherence
     bool m_PostFlag;           // Flag for post processing (deblocking)
+    bool m_StreamFlag;         // Flag for row-streaming guided filter
+    bool m_LumaGuideFlag;      // Flag for a single luma guidance image instead of R, G, B
+    bool m_YUVFlag;            // Flag for YUV input, Y, U, V take the places of R, G, B
+    int m_nSubSamplingW;       // Log2 of the chroma subsampling of YUV input
+    int m_nSubSamplingH;
+    bool m_RefDownscaleFlag;   // Flag for the ref clip made from the source by DownscaleRef
+    int* m_pnRefColumn;        // First source column of each ref column and the end of the last, nullptr without the internal downscaler
+    bool m_RestoreOnlyFlag;    // Flag for contexts that only restore a given transmission
+
+    int* m_pnAirX;             // Columns and rows of the airlight block corners
+    int* m_pnAirY;
+    int m_nAirX;
+    int m_nAirY;
 
     double Lambda1;
     float Lambda2;
@@ -78,18 +307,40 @@ private:
     int BottomRightX;
     int BottomRightY;
 
-    int* m_pnRImg;
-    int* m_pnGImg;
-    int* m_pnBImg;
+    BoxFilterPass m_pfnBoxFilterV;
+    BoxFilterPass m_pfnBoxFilterH;
+    TransCostRow m_pfnTransCostRow;
+    RestoreRow16 m_pfnRestoreRow16;
+    RestoreTableRow8 m_pfnRestoreTableRow8;
+    RestoreTableRow16 m_pfnRestoreTableRow16;
+    AccumulateRow8 m_pfnAccumulateRow8;
+    AccumulateRow16 m_pfnAccumulateRow16;
 
-    float* m_pfTransmission;   // Preliminary transmission
-    float* m_pfTransmissionR;  // Refined transmission
-    float* m_pfSmallTrans;
-
-    float ExpLUT[65536];
-    float m_pucGammaLUT[65536];
+    float ExpLUT[256];
+    GammaLUT* m_pGammaLUT;     // nullptr for float input
     float* m_pfGuidedLUT;
+    float* m_pfRestoreScale;   // 1 / transmission of each restore level
+    uint16_t* m_pnRestoreLevel;
+
+    ThreadPool* m_pPool;       // Threads of the stages within one frame
 };
 
+/*
+    Function: ParallelRows
+    Description: split nCount rows (or columns) into one range per thread and run fnRange(nBegin, nEnd, nTask) on each.
+        The ranges start at multiples of nAlign, nTask is below the number of threads.
+ */
+template <typename F>
+inline void dehazing::ParallelRows(int nCount, int nAlign, const F& fnRange) const
+{
+    const int nThreads = m_pPool->Threads();
+    const int nChunk = ((nCount + nThreads - 1) / nThreads + nAlign - 1) / nAlign * nAlign;
+    const int nTasks = nChunk > 0 ? (nCount + nChunk - 1) / nChunk : 0;
+
+    m_pPool->Run(nTasks, [&](int nTask) {
+        fnRange(nTask * nChunk, std::min((nTask + 1) * nChunk, nCount), nTask);
+    });
+}
+
 
 #endif
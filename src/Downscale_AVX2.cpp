@@ -0,0 +1,51 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <immintrin.h>
+
+/*
+    Function: AccumulateRow8_AVX2
+    Description: AccumulateRow8_C on 16 samples at a time, widened to 32 bit.
+ */
+void AccumulateRow8_AVX2(const uint8_t* pnSrc, int nCount, uint32_t* pnSum)
+{
+    int i = 0;
+    for (; i + 16 <= nCount; i += 16)
+    {
+        const __m128i vSrc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pnSrc + i));
+        const __m256i vLow = _mm256_cvtepu8_epi32(vSrc);
+        const __m256i vHigh = _mm256_cvtepu8_epi32(_mm_srli_si128(vSrc, 8));
+
+        __m256i* pvSum = reinterpret_cast<__m256i*>(pnSum + i);
+        _mm256_storeu_si256(pvSum, _mm256_add_epi32(_mm256_loadu_si256(pvSum), vLow));
+        _mm256_storeu_si256(pvSum + 1, _mm256_add_epi32(_mm256_loadu_si256(pvSum + 1), vHigh));
+    }
+
+    if (i < nCount)
+        AccumulateRow8_C(pnSrc + i, nCount - i, pnSum + i);
+}
+
+/*
+    Function: AccumulateRow16_AVX2
+    Description: AccumulateRow16_C on 16 samples at a time, widened to 32 bit.
+ */
+void AccumulateRow16_AVX2(const uint16_t* pnSrc, int nCount, uint32_t* pnSum)
+{
+    int i = 0;
+    for (; i + 16 <= nCount; i += 16)
+    {
+        const __m256i vSrc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pnSrc + i));
+        const __m256i vLow = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(vSrc));
+        const __m256i vHigh = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(vSrc, 1));
+
+        __m256i* pvSum = reinterpret_cast<__m256i*>(pnSum + i);
+        _mm256_storeu_si256(pvSum, _mm256_add_epi32(_mm256_loadu_si256(pvSum), vLow));
+        _mm256_storeu_si256(pvSum + 1, _mm256_add_epi32(_mm256_loadu_si256(pvSum + 1), vHigh));
+    }
+
+    if (i < nCount)
+        AccumulateRow16_C(pnSrc + i, nCount - i, pnSum + i);
+}
+
+#endif
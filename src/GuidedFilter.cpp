@@ -1,4 +1,6 @@
 #include "DehazingCE.hpp"
+#include "Helper.hpp"
+#include "Simd.hpp"
 
 /*
     Function: CalcAcoeff (called after Boxfilter)
@@ -10,7 +12,7 @@
     Return:
         pfA1, pfA2, pfA3 - coefficient of "a" at each color channel
  */
-void dehazing::CalcAcoeff(float* pfSigma, float* pfCov, float* pfA1, float* pfA2, float* pfA3, int nIdx)
+void dehazing::CalcAcoeff(float* pfSigma, float* pfCov, float* pfA1, float* pfA2, float* pfA3, int nIdx) const
 {
     float fDet;
     float fOneOverDeterminant;
@@ -42,387 +44,1282 @@ void dehazing::CalcAcoeff(float* pfSigma, float* pfCov, float* pfA1, float* pfA2
 }
 
 /*
-    Function: BoxFilter
-    Description: cummulative function for calculating the integral image (It may apply other arraies.)
+    Function: BoxFilterVertical_C
+    Description: vertical pass of BoxFilter, cumulative sum over Y axis and difference over Y axis.
     Parameters:
         pfInArray - input array
-        nR - radius of filter window
+        pfArrayCum - scratch array for the cumulative sum
         width - width of array
         height - height of array
+        stride - distance between rows
+        nR - radius of filter window
     Return:
-        fOutArray - output array (integrated array)
+        pfOutArray - output array
  */
-void dehazing::BoxFilter(float* pfInArray, int nR, int width, int height, float*& fOutArray)
+void BoxFilterVertical_C(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
 {
-    float* pfArrayCum = new float[width * height];
-
     // Cumulative sum over Y axis
     for (auto i = 0; i < width; i++)
         pfArrayCum[i] = pfInArray[i];
 
-    for (int nIdx = width; nIdx < width * height; nIdx++)
-        pfArrayCum[nIdx] = pfArrayCum[nIdx - width] + pfInArray[nIdx];
+    for (auto j = 1; j < height; j++)
+        for (auto i = 0; i < width; i++)
+            pfArrayCum[j * stride + i] = pfArrayCum[(j - 1) * stride + i] + pfInArray[j * stride + i];
 
     // Difference over Y axis
-    for (int nIdx = 0; nIdx < width * (nR + 1); nIdx++)
-        fOutArray[nIdx] = pfArrayCum[nIdx + nR * width];
+    for (auto j = 0; j < nR + 1; j++)
+        for (auto i = 0; i < width; i++)
+            pfOutArray[j * stride + i] = pfArrayCum[(j + nR) * stride + i];
 
-    for (int nIdx = (nR + 1) * width; nIdx < (height - nR) * width; nIdx++)
-        fOutArray[nIdx] = pfArrayCum[nIdx + nR * width] - pfArrayCum[nIdx - nR * width - width];
+    for (auto j = nR + 1; j < height - nR; j++)
+        for (auto i = 0; i < width; i++)
+            pfOutArray[j * stride + i] = pfArrayCum[(j + nR) * stride + i] - pfArrayCum[(j - nR - 1) * stride + i];
 
     for (auto j = height - nR; j < height; j++)
         for (auto i = 0; i < width; i++)
-            fOutArray[j * width + i] = pfArrayCum[(height - 1) * width + i] - pfArrayCum[(j - nR - 1) * width + i];
+            pfOutArray[j * stride + i] = pfArrayCum[(height - 1) * stride + i] - pfArrayCum[(j - nR - 1) * stride + i];
+}
 
+/*
+    Function: BoxFilterHorizontal_C
+    Description: horizontal pass of BoxFilter, cumulative sum over X axis and difference over X axis.
+        pfInArray and pfOutArray may be the same array.
+    Parameters:
+        pfInArray - input array
+        pfArrayCum - scratch array for the cumulative sum
+        width - width of array
+        height - height of array
+        stride - distance between rows
+        nR - radius of filter window
+    Return:
+        pfOutArray - output array
+ */
+void BoxFilterHorizontal_C(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR)
+{
     // Cumulative sum over X axis
-    for (int nIdx = 0; nIdx < width * height; nIdx += width)
-        pfArrayCum[nIdx] = fOutArray[nIdx];
+    for (int nIdx = 0; nIdx < stride * height; nIdx += stride)
+        pfArrayCum[nIdx] = pfInArray[nIdx];
 
-    for (auto j = 0; j < width * height; j += width)
+    for (auto j = 0; j < stride * height; j += stride)
         for (auto i = 1; i < width; i++)
-            pfArrayCum[j + i] = pfArrayCum[j + i - 1] + fOutArray[j + i];
+            pfArrayCum[j + i] = pfArrayCum[j + i - 1] + pfInArray[j + i];
 
-    // Difference over Y axis
-    for (auto j = 0; j < width * height; j += width)
+    // Difference over X axis
+    for (auto j = 0; j < stride * height; j += stride)
         for (auto i = 0; i < nR + 1; i++)
-            fOutArray[j + i] = pfArrayCum[j + i + nR];
+            pfOutArray[j + i] = pfArrayCum[j + i + nR];
 
-    for (auto j = 0; j < width * height; j += width)
+    for (auto j = 0; j < stride * height; j += stride)
         for (auto i = nR + 1; i < width - nR; i++)
-            fOutArray[j + i] = pfArrayCum[j + i + nR] - pfArrayCum[j + i - nR - 1];
+            pfOutArray[j + i] = pfArrayCum[j + i + nR] - pfArrayCum[j + i - nR - 1];
 
-    for (auto j = 0; j < width * height; j += width)
+    for (auto j = 0; j < stride * height; j += stride)
         for (auto i = width - nR; i < width; i++)
-            fOutArray[j + i] = pfArrayCum[j + width - 1] - pfArrayCum[j + i - nR - 1];
+            pfOutArray[j + i] = pfArrayCum[j + width - 1] - pfArrayCum[j + i - nR - 1];
+}
 
-    delete[] pfArrayCum;
+/*
+    Function: BoxFilterPlane
+    Description: both passes of BoxFilter on one array, split between the threads.
+        The vertical pass runs on column strips and the horizontal pass on row strips,
+        each strip holds whole cumulative sums so the result does not depend on the number of threads.
+    Parameters:
+        pfInArray - input array
+        pfArrayCum - scratch array for the cumulative sum
+        nR - radius of filter window
+        width - width of array
+        height - height of array
+    Return:
+        pfOutArray - output array
+ */
+void dehazing::BoxFilterPlane(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int nR, int width, int height) const
+{
+    ParallelRows(width, 8, [&](int nBegin, int nEnd, int) {
+        m_pfnBoxFilterV(pfInArray + nBegin, pfArrayCum + nBegin, pfOutArray + nBegin, nEnd - nBegin, height, width, nR);
+    });
+
+    ParallelRows(height, 8, [&](int nBegin, int nEnd, int) {
+        const int nOffset = nBegin * width;
+        m_pfnBoxFilterH(pfOutArray + nOffset, pfArrayCum + nOffset, pfOutArray + nOffset, width, nEnd - nBegin, width, nR);
+    });
 }
 
 /*
-    Function: BoxFilter (for 3D array)
+    Function: BoxFilter
     Description: cummulative function for calculating the integral image (It may apply other arraies.)
+        The passes are dispatched to the SIMD kernels supported by the CPU.
     Parameters:
-        pfInArray1 - input array D1
-        pfInArray2 - input array D2
-        pfInArray3 - input array D3
+        pfInArray - input array
         nR - radius of filter window
         width - width of array
         height - height of array
     Return:
-        fOutArray1 - output array D1(integrated array)
-        fOutArray1 - output array D2(integrated array)
-        fOutArray1 - output array D3(integrated array)
+        fOutArray - output array (integrated array)
  */
-void dehazing::BoxFilter(float* pfInArray1, float* pfInArray2, float* pfInArray3, int nR, int width, int height, float*& pfOutArray1, float*& pfOutArray2, float*& pfOutArray3)
+void dehazing::BoxFilter(ScratchArena& arena, float* pfInArray, int nR, int width, int height, float*& fOutArray) const
 {
-    float* pfArrayCum1 = new float[width * height];
-    float* pfArrayCum2 = new float[width * height];
-    float* pfArrayCum3 = new float[width * height];
+    const size_t nMark = arena.Mark();
+    float* pfArrayCum = arena.Alloc<float>(width * height);
 
-    // Cumulative sum over Y axis
-    for (auto i = 0; i < width; i++)
-    {
-        pfArrayCum1[i] = pfInArray1[i];
-        pfArrayCum2[i] = pfInArray2[i];
-        pfArrayCum3[i] = pfInArray3[i];
-    }
+    BoxFilterPlane(pfInArray, pfArrayCum, fOutArray, nR, width, height);
 
-    for (auto nIdx = width; nIdx < width * height; nIdx++)
-    {
-        pfArrayCum1[nIdx] = pfArrayCum1[nIdx - width] + pfInArray1[nIdx];
-        pfArrayCum2[nIdx] = pfArrayCum2[nIdx - width] + pfInArray2[nIdx];
-        pfArrayCum3[nIdx] = pfArrayCum3[nIdx - width] + pfInArray3[nIdx];
-    }
+    arena.Rewind(nMark);
+}
 
-    // Difference over Y axis
-    for (auto nIdx = 0; nIdx < (nR + 1) * width; nIdx++)
+/*
+    Function: BoxFilterStrip
+    Description: BoxFilter of the frame rows nTop to nTop + height - 1, continuing the vertical cumulative sum
+        of the strip above from its row nTop - 1. The sums are the same as the ones of the whole frame,
+        so the rows whose window lies inside the strip are the same as BoxFilter. The other rows are zero.
+    Parameters:
+        pfInArray - input rows
+        nR - radius of filter window
+        width - width of array
+        height - rows of the strip
+        nTop - frame row of the first row
+        nNextTop - nTop of the next strip
+        nFrameHeight - height of the frame
+        pfCarry - cumulative row nTop - 1 of the frame, replaced by the row nNextTop - 1 for the next strip
+    Return:
+        pfOutArray - output rows
+ */
+void dehazing::BoxFilterStrip(ScratchArena& arena, const float* pfInArray, int nR, int width, int height, int nTop, int nNextTop, int nFrameHeight,
+    float* pfCarry, float* pfOutArray) const
+{
+    const size_t nMark = arena.Mark();
+    float* pfArrayCum = arena.Alloc<float>(width * height);
+
+    ParallelRows(width, 8, [&](int nBegin, int nEnd, int) {
+        // Cumulative sum over Y axis, from the carried row
+        for (auto i = nBegin; i < nEnd; i++)
+            pfArrayCum[i] = nTop > 0 ? pfCarry[i] + pfInArray[i] : pfInArray[i];
+
+        for (auto j = 1; j < height; j++)
+            for (auto i = nBegin; i < nEnd; i++)
+                pfArrayCum[j * width + i] = pfArrayCum[(j - 1) * width + i] + pfInArray[j * width + i];
+
+        // Difference over Y axis, in frame rows
+        for (auto j = 0; j < height; j++)
+        {
+            const int nHi = std::min(nTop + j + nR, nFrameHeight - 1) - nTop;
+            const int nLo = nTop + j - nR - 1;
+            float* pfOut = pfOutArray + j * width;
+
+            if (nHi >= height || (nLo >= 0 && nLo < nTop - 1))
+            {
+                std::fill(pfOut + nBegin, pfOut + nEnd, 0.f);
+            }
+            else if (nLo < 0)
+            {
+                for (auto i = nBegin; i < nEnd; i++)
+                    pfOut[i] = pfArrayCum[nHi * width + i];
+            }
+            else
+            {
+                const float* pfLo = nLo == nTop - 1 ? pfCarry : pfArrayCum + (nLo - nTop) * width;
+                for (auto i = nBegin; i < nEnd; i++)
+                    pfOut[i] = pfArrayCum[nHi * width + i] - pfLo[i];
+            }
+        }
+
+        if (nNextTop > 0 && nNextTop - 1 >= nTop && nNextTop - 1 < nTop + height)
+            std::copy(pfArrayCum + (nNextTop - 1 - nTop) * width + nBegin, pfArrayCum + (nNextTop - 1 - nTop) * width + nEnd, pfCarry + nBegin);
+    });
+
+    ParallelRows(height, 8, [&](int nBegin, int nEnd, int) {
+        const int nOffset = nBegin * width;
+        m_pfnBoxFilterH(pfOutArray + nOffset, pfArrayCum + nOffset, pfOutArray + nOffset, width, nEnd - nBegin, width, nR);
+    });
+
+    arena.Rewind(nMark);
+}
+
+/*
+    Function: GuideStatistics
+    Description: exact local means and covariances of an integer guidance image.
+        The window sums of the samples and of their products are accumulated in TSum: column sums slide down
+        the rows and a window slides along each row, so no running sum grows with the frame size.
+        The covariance is (N * sum(I_c * I_d) - sum(I_c) * sum(I_d)) / N^2 with an exact 64 bit numerator,
+        only the quotient is rounded to float.
+    Parameters:
+        pfImageR, pfImageG, pfImageB - guidance image, integer values
+        nR - radius of filter window
+    Return:
+        pfMeanIr, pfMeanIg, pfMeanIb - local means
+        pfVarIrr, pfVarIrg, pfVarIrb, pfVarIgg, pfVarIgb, pfVarIbb - local covariances
+ */
+template <typename TSum>
+void dehazing::GuideStatistics(ScratchArena& arena, const float* pfImageR, const float* pfImageG, const float* pfImageB, int width, int height, int nR,
+    float* pfMeanIr, float* pfMeanIg, float* pfMeanIb, float* pfVarIrr, float* pfVarIrg, float* pfVarIrb, float* pfVarIgg, float* pfVarIgb, float* pfVarIbb) const
+{
+    // Sums: R, G, B, RR, RG, RB, GG, GB, BB
+    const int nStat = 9;
+
+    // Column sums of each thread
+    const size_t nMark = arena.Mark();
+    TSum* pnColumns = arena.Alloc<TSum>(m_pPool->Threads() * nStat * width);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int nTask) {
+        TSum* anColumn = pnColumns + nTask * nStat * width;
+        std::fill(anColumn, anColumn + nStat * width, (TSum)0);
+
+        auto addRow = [&](int y, bool bAdd) {
+            for (auto i = 0; i < width; i++)
+            {
+                const TSum nRed = (TSum)pfImageR[y * width + i];
+                const TSum nGreen = (TSum)pfImageG[y * width + i];
+                const TSum nBlue = (TSum)pfImageB[y * width + i];
+                const TSum anValue[nStat] = { nRed, nGreen, nBlue, nRed * nRed, nRed * nGreen, nRed * nBlue, nGreen * nGreen, nGreen * nBlue, nBlue * nBlue };
+
+                // Unsigned wrap-around makes the subtraction exact
+                for (auto k = 0; k < nStat; k++)
+                    anColumn[k * width + i] += bAdd ? anValue[k] : (TSum)0 - anValue[k];
+            }
+        };
+
+        for (auto y = std::max(nBegin - nR, 0); y <= std::min(nBegin + nR, height - 1); y++)
+            addRow(y, true);
+
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            if (j > nBegin)
+            {
+                if (j + nR < height)
+                    addRow(j + nR, true);
+                if (j - nR - 1 >= 0)
+                    addRow(j - nR - 1, false);
+            }
+
+            const uint64_t nCountY = std::min(j + nR, height - 1) - std::max(j - nR, 0) + 1;
+
+            TSum anWindow[nStat] = { 0 };
+            for (auto i = 0; i <= std::min(nR, width - 1); i++)
+                for (auto k = 0; k < nStat; k++)
+                    anWindow[k] += anColumn[k * width + i];
+
+            for (auto i = 0; i < width; i++)
+            {
+                const uint64_t nN = nCountY * (std::min(i + nR, width - 1) - std::max(i - nR, 0) + 1);
+                const double dN = (double)nN;
+                const double dN2 = dN * dN;
+                const uint64_t anSum[3] = { anWindow[0], anWindow[1], anWindow[2] };
+                const int nIdx = j * width + i;
+
+                pfMeanIr[nIdx] = (float)(anSum[0] / dN);
+                pfMeanIg[nIdx] = (float)(anSum[1] / dN);
+                pfMeanIb[nIdx] = (float)(anSum[2] / dN);
+
+                pfVarIrr[nIdx] = (float)((int64_t)(nN * anWindow[3] - anSum[0] * anSum[0]) / dN2);
+                pfVarIrg[nIdx] = (float)((int64_t)(nN * anWindow[4] - anSum[0] * anSum[1]) / dN2);
+                pfVarIrb[nIdx] = (float)((int64_t)(nN * anWindow[5] - anSum[0] * anSum[2]) / dN2);
+                pfVarIgg[nIdx] = (float)((int64_t)(nN * anWindow[6] - anSum[1] * anSum[1]) / dN2);
+                pfVarIgb[nIdx] = (float)((int64_t)(nN * anWindow[7] - anSum[1] * anSum[2]) / dN2);
+                pfVarIbb[nIdx] = (float)((int64_t)(nN * anWindow[8] - anSum[2] * anSum[2]) / dN2);
+
+                if (i + nR + 1 < width)
+                    for (auto k = 0; k < nStat; k++)
+                        anWindow[k] += anColumn[k * width + i + nR + 1];
+                if (i - nR >= 0)
+                    for (auto k = 0; k < nStat; k++)
+                        anWindow[k] -= anColumn[k * width + i - nR];
+            }
+        }
+    });
+
+    arena.Rewind(nMark);
+}
+
+/*
+    Function: GuidedCoefficients
+    Description: calculate the box-averaged linear coefficients of the guided filter for rgb color image.
+        The refined value at each pixel is A1 * I_r + A2 * I_g + A3 * I_b + B.
+    Parameter:
+        pfImageR, pfImageG, pfImageB - guidance image
+        pfP - input to be filtered (block-based transmission)
+        width - width of array
+        height - height of array
+        nR - radius of filter window
+        fEps - epsilon
+        bIntegerGuide - the guidance image holds integer samples, its statistics are computed exactly
+        pStrip - rows of the frame held by the arrays, nullptr for the whole frame
+    Return:
+        pfOutA1, pfOutA2, pfOutA3, pfOutB - mean coefficients
+ */
+void dehazing::GuidedCoefficients(ScratchArena& arena, float* pfImageR, float* pfImageG, float* pfImageB, float* pfP, int width, int height, int nR, float fEps,
+    float* pfOutA1, float* pfOutA2, float* pfOutA3, float* pfOutB, bool bIntegerGuide, const StripRows* pStrip) const
+{
+    // Window sums of the guidance products fit in 32 bit for 8 bit input, the exact covariance numerator
+    // N * sum(I_c * I_d) needs peak * N < 2^32 in 64 bit. Larger windows keep the float statistics.
+    const uint64_t nMaxN = (uint64_t)(2 * nR + 1) * (2 * nR + 1);
+    const bool bExact32 = bIntegerGuide && (uint64_t)peak * peak * nMaxN <= UINT32_MAX;
+    const bool bExact = bIntegerGuide && (uint64_t)peak * nMaxN <= UINT32_MAX;
+
+    // A strip continues the cumulative sums of the strip above, with one carried row per box filtered plane.
+    // The coefficients are filtered over their valid rows only.
+    int nPlane = 0;
+    auto box = [&](float* pfIn, float* pfOut) {
+        if (pStrip == nullptr)
+            BoxFilter(arena, pfIn, nR, width, height, pfOut);
+        else
+            BoxFilterStrip(arena, pfIn, nR, width, height, pStrip->nTop, pStrip->nNextTop, pStrip->nFrameHeight,
+                pStrip->pfCarry + width * nPlane++, pfOut);
+    };
+    auto boxCoef = [&](float* pfIn, float* pfOut) {
+        if (pStrip == nullptr)
+        {
+            BoxFilter(arena, pfIn, nR, width, height, pfOut);
+        }
+        else
+        {
+            const int nOffset = (pStrip->nCoefTop - pStrip->nTop) * width;
+            BoxFilterStrip(arena, pfIn + nOffset, nR, width, pStrip->nCoefEnd - pStrip->nCoefTop, pStrip->nCoefTop, pStrip->nNextCoefTop,
+                pStrip->nFrameHeight, pStrip->pfCarry + width * nPlane++, pfOut + nOffset);
+        }
+    };
+
+    const size_t nMark = arena.Mark();
+
+    float* pfInitN = arena.Alloc<float>(width * height);
+    float* pfInitMeanIpR = arena.Alloc<float>(width * height);
+    float* pfInitMeanIpG = arena.Alloc<float>(width * height);
+    float* pfInitMeanIpB = arena.Alloc<float>(width * height);
+    float* pfMeanP = arena.Alloc<float>(width * height);
+
+    float* pfN = arena.Alloc<float>(width * height);
+    float* pfMeanIr = arena.Alloc<float>(width * height);
+    float* pfMeanIg = arena.Alloc<float>(width * height);
+    float* pfMeanIb = arena.Alloc<float>(width * height);
+    float* pfMeanIpR = arena.Alloc<float>(width * height);
+    float* pfMeanIpG = arena.Alloc<float>(width * height);
+    float* pfMeanIpB = arena.Alloc<float>(width * height);
+    float* pfCovIpR = arena.Alloc<float>(width * height);
+    float* pfCovIpG = arena.Alloc<float>(width * height);
+    float* pfCovIpB = arena.Alloc<float>(width * height);
+
+    float* pfCovEntire = arena.Alloc<float>(width * height * 3);
+
+    float* pfInitVarIrr = arena.Alloc<float>(width * height);
+    float* pfInitVarIrg = arena.Alloc<float>(width * height);
+    float* pfInitVarIrb = arena.Alloc<float>(width * height);
+    float* pfInitVarIgg = arena.Alloc<float>(width * height);
+    float* pfInitVarIgb = arena.Alloc<float>(width * height);
+    float* pfInitVarIbb = arena.Alloc<float>(width * height);
+
+    float* pfVarIrr = arena.Alloc<float>(width * height);
+    float* pfVarIrg = arena.Alloc<float>(width * height);
+    float* pfVarIrb = arena.Alloc<float>(width * height);
+    float* pfVarIgg = arena.Alloc<float>(width * height);
+    float* pfVarIgb = arena.Alloc<float>(width * height);
+    float* pfVarIbb = arena.Alloc<float>(width * height);
+
+    float* pfA1 = arena.Alloc<float>(width * height);
+    float* pfA2 = arena.Alloc<float>(width * height);
+    float* pfA3 = arena.Alloc<float>(width * height);
+
+    float* pfSigmaEntire = arena.Alloc<float>(width * height * 9);
+
+    float* pfB = arena.Alloc<float>(width * height);
+
+    // Make an integral image
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            pfInitN[nIdx] = 1.f;
+
+            pfInitMeanIpR[nIdx] = pfImageR[nIdx] * pfP[nIdx];
+            pfInitMeanIpG[nIdx] = pfImageG[nIdx] * pfP[nIdx];
+            pfInitMeanIpB[nIdx] = pfImageB[nIdx] * pfP[nIdx];
+        }
+    });
+
+    box(pfInitN, pfN);
+    box(pfP, pfMeanP);
+
+    if (bExact32)
+        GuideStatistics<uint32_t>(arena, pfImageR, pfImageG, pfImageB, width, height, nR,
+            pfMeanIr, pfMeanIg, pfMeanIb, pfVarIrr, pfVarIrg, pfVarIrb, pfVarIgg, pfVarIgb, pfVarIbb);
+    else if (bExact)
+        GuideStatistics<uint64_t>(arena, pfImageR, pfImageG, pfImageB, width, height, nR,
+            pfMeanIr, pfMeanIg, pfMeanIb, pfVarIrr, pfVarIrg, pfVarIrb, pfVarIgg, pfVarIgb, pfVarIbb);
+    else
     {
-        pfOutArray1[nIdx] = pfArrayCum1[nIdx + nR * width];
-        pfOutArray2[nIdx] = pfArrayCum2[nIdx + nR * width];
-        pfOutArray3[nIdx] = pfArrayCum3[nIdx + nR * width];
+        box(pfImageR, pfMeanIr);
+        box(pfImageG, pfMeanIg);
+        box(pfImageB, pfMeanIb);
     }
 
-    for (auto nIdx = (nR + 1) * width; nIdx < (height - nR) * width; nIdx++)
+    box(pfInitMeanIpR, pfMeanIpR);
+    box(pfInitMeanIpG, pfMeanIpG);
+    box(pfInitMeanIpB, pfMeanIpB);
+
+    // Covariance of (I, pfTrans) in each local patch
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            if (!bExact)
+            {
+                pfMeanIr[nIdx] = pfMeanIr[nIdx] / pfN[nIdx];
+                pfMeanIg[nIdx] = pfMeanIg[nIdx] / pfN[nIdx];
+                pfMeanIb[nIdx] = pfMeanIb[nIdx] / pfN[nIdx];
+            }
+
+            pfMeanP[nIdx] = pfMeanP[nIdx] / pfN[nIdx];
+
+            pfMeanIpR[nIdx] = pfMeanIpR[nIdx] / pfN[nIdx];
+            pfMeanIpG[nIdx] = pfMeanIpG[nIdx] / pfN[nIdx];
+            pfMeanIpB[nIdx] = pfMeanIpB[nIdx] / pfN[nIdx];
+
+            pfCovIpR[nIdx] = pfMeanIpR[nIdx] - pfMeanIr[nIdx] * pfMeanP[nIdx];
+            pfCovIpG[nIdx] = pfMeanIpG[nIdx] - pfMeanIg[nIdx] * pfMeanP[nIdx];
+            pfCovIpB[nIdx] = pfMeanIpB[nIdx] - pfMeanIb[nIdx] * pfMeanP[nIdx];
+
+            pfCovEntire[nIdx * 3] = pfCovIpR[nIdx];
+            pfCovEntire[nIdx * 3 + 1] = pfCovIpG[nIdx];
+            pfCovEntire[nIdx * 3 + 2] = pfCovIpB[nIdx];
+
+            if (bExact)
+                continue;
+
+            pfInitVarIrr[nIdx] = pfImageR[nIdx] * pfImageR[nIdx];
+            pfInitVarIrg[nIdx] = pfImageR[nIdx] * pfImageG[nIdx];
+            pfInitVarIrb[nIdx] = pfImageR[nIdx] * pfImageB[nIdx];
+            pfInitVarIgg[nIdx] = pfImageG[nIdx] * pfImageG[nIdx];
+            pfInitVarIgb[nIdx] = pfImageG[nIdx] * pfImageB[nIdx];
+            pfInitVarIbb[nIdx] = pfImageB[nIdx] * pfImageB[nIdx];
+        }
+    });
+
+    // Variance of I in each local patch: the matrix Sigma.
+    // 		    rr, rg, rb
+    // pfSigma  rg, gg, gb
+    //	 	    rb, gb, bb
+
+    if (!bExact)
     {
-        pfOutArray1[nIdx] = pfArrayCum1[nIdx + nR * width] - pfArrayCum1[nIdx - (nR + 1) * width];
-        pfOutArray2[nIdx] = pfArrayCum2[nIdx + nR * width] - pfArrayCum2[nIdx - (nR + 1) * width];
-        pfOutArray3[nIdx] = pfArrayCum3[nIdx + nR * width] - pfArrayCum3[nIdx - (nR + 1) * width];
+        box(pfInitVarIrr, pfVarIrr);
+        box(pfInitVarIrg, pfVarIrg);
+        box(pfInitVarIrb, pfVarIrb);
+        box(pfInitVarIgg, pfVarIgg);
+        box(pfInitVarIgb, pfVarIgb);
+        box(pfInitVarIbb, pfVarIbb);
     }
 
-    for (auto j = height - nR; j < height; j++)
-    {
-        for (auto i = 0; i < width; i++)
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
         {
-            pfOutArray1[j * width + i] = pfArrayCum1[(height - 1) * width + i] - pfArrayCum1[(j - nR - 1) * width + i];
-            pfOutArray2[j * width + i] = pfArrayCum2[(height - 1) * width + i] - pfArrayCum2[(j - nR - 1) * width + i];
-            pfOutArray3[j * width + i] = pfArrayCum3[(height - 1) * width + i] - pfArrayCum3[(j - nR - 1) * width + i];
+            if (!bExact)
+            {
+                pfVarIrr[nIdx] = pfVarIrr[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIr[nIdx];
+                pfVarIrg[nIdx] = pfVarIrg[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIg[nIdx];
+                pfVarIrb[nIdx] = pfVarIrb[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIb[nIdx];
+                pfVarIgg[nIdx] = pfVarIgg[nIdx] / pfN[nIdx] - pfMeanIg[nIdx] * pfMeanIg[nIdx];
+                pfVarIgb[nIdx] = pfVarIgb[nIdx] / pfN[nIdx] - pfMeanIg[nIdx] * pfMeanIb[nIdx];
+                pfVarIbb[nIdx] = pfVarIbb[nIdx] / pfN[nIdx] - pfMeanIb[nIdx] * pfMeanIb[nIdx];
+            }
+
+            pfSigmaEntire[nIdx * 9 + 0] = pfVarIrr[nIdx] + fEps * 2.f;
+            pfSigmaEntire[nIdx * 9 + 1] = pfVarIrg[nIdx];
+            pfSigmaEntire[nIdx * 9 + 2] = pfVarIrb[nIdx];
+            pfSigmaEntire[nIdx * 9 + 3] = pfVarIrg[nIdx];
+            pfSigmaEntire[nIdx * 9 + 4] = pfVarIgg[nIdx] + fEps * 2.f;
+            pfSigmaEntire[nIdx * 9 + 5] = pfVarIgb[nIdx];
+            pfSigmaEntire[nIdx * 9 + 6] = pfVarIrb[nIdx];
+            pfSigmaEntire[nIdx * 9 + 7] = pfVarIgb[nIdx];
+            pfSigmaEntire[nIdx * 9 + 8] = pfVarIbb[nIdx] + fEps * 2.f;
         }
-    }
+    });
+    // Calculate coefficient a and coefficient b
+    // Coefficienta
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            CalcAcoeff(pfSigmaEntire, pfCovEntire, pfA1, pfA2, pfA3, nIdx);
+        }
+    });
+
+    // Coefficient b
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            pfB[nIdx] = pfMeanP[nIdx] - pfA1[nIdx] * pfMeanIr[nIdx] - pfA2[nIdx] * pfMeanIg[nIdx] - pfA3[nIdx] * pfMeanIb[nIdx];
+        }
+    });
+
+    // Mean coefficients over each local patch
+    boxCoef(pfA1, pfOutA1);
+    boxCoef(pfA2, pfOutA2);
+    boxCoef(pfA3, pfOutA3);
+
+    boxCoef(pfB, pfOutB);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            pfOutA1[nIdx] = pfOutA1[nIdx] / pfN[nIdx];
+            pfOutA2[nIdx] = pfOutA2[nIdx] / pfN[nIdx];
+            pfOutA3[nIdx] = pfOutA3[nIdx] / pfN[nIdx];
+            pfOutB[nIdx] = pfOutB[nIdx] / pfN[nIdx];
+        }
+    });
+
+    arena.Rewind(nMark);
+}
+
+/*
+    Function: LumaStatistics
+    Description: exact local mean and variance of an integer luma guidance image, see GuideStatistics.
+    Parameters:
+        pfImageY - guidance image, integer values
+        nR - radius of filter window
+    Return:
+        pfMeanI - local mean
+        pfVarI - local variance
+ */
+template <typename TSum>
+void dehazing::LumaStatistics(ScratchArena& arena, const float* pfImageY, int width, int height, int nR, float* pfMeanI, float* pfVarI) const
+{
+    // Sums: Y, YY
+    const int nStat = 2;
+
+    // Column sums of each thread
+    const size_t nMark = arena.Mark();
+    TSum* pnColumns = arena.Alloc<TSum>(m_pPool->Threads() * nStat * width);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int nTask) {
+        TSum* anColumn = pnColumns + nTask * nStat * width;
+        std::fill(anColumn, anColumn + nStat * width, (TSum)0);
+
+        auto addRow = [&](int y, bool bAdd) {
+            for (auto i = 0; i < width; i++)
+            {
+                const TSum nLuma = (TSum)pfImageY[y * width + i];
+
+                // Unsigned wrap-around makes the subtraction exact
+                anColumn[i] += bAdd ? nLuma : (TSum)0 - nLuma;
+                anColumn[width + i] += bAdd ? nLuma * nLuma : (TSum)0 - nLuma * nLuma;
+            }
+        };
+
+        for (auto y = std::max(nBegin - nR, 0); y <= std::min(nBegin + nR, height - 1); y++)
+            addRow(y, true);
+
+        for (auto j = nBegin; j < nEnd; j++)
+        {
+            if (j > nBegin)
+            {
+                if (j + nR < height)
+                    addRow(j + nR, true);
+                if (j - nR - 1 >= 0)
+                    addRow(j - nR - 1, false);
+            }
+
+            const uint64_t nCountY = std::min(j + nR, height - 1) - std::max(j - nR, 0) + 1;
+
+            TSum anWindow[nStat] = { 0 };
+            for (auto i = 0; i <= std::min(nR, width - 1); i++)
+                for (auto k = 0; k < nStat; k++)
+                    anWindow[k] += anColumn[k * width + i];
+
+            for (auto i = 0; i < width; i++)
+            {
+                const uint64_t nN = nCountY * (std::min(i + nR, width - 1) - std::max(i - nR, 0) + 1);
+                const double dN = (double)nN;
+                const uint64_t nSum = anWindow[0];
+                const int nIdx = j * width + i;
+
+                pfMeanI[nIdx] = (float)(nSum / dN);
+                pfVarI[nIdx] = (float)((int64_t)(nN * anWindow[1] - nSum * nSum) / (dN * dN));
+
+                if (i + nR + 1 < width)
+                    for (auto k = 0; k < nStat; k++)
+                        anWindow[k] += anColumn[k * width + i + nR + 1];
+                if (i - nR >= 0)
+                    for (auto k = 0; k < nStat; k++)
+                        anWindow[k] -= anColumn[k * width + i - nR];
+            }
+        }
+    });
+
+    arena.Rewind(nMark);
+}
+
+/*
+    Function: LumaCoefficients
+    Description: GuidedCoefficients with a single luma guidance image. The 3x3 covariance matrix becomes
+        the variance of the luma, so a is a scalar division and only 5 statistics are box filtered.
+        The refined value at each pixel is A * I_y + B.
+    Parameter:
+        pfImageY - guidance image
+        pfP - input to be filtered (block-based transmission)
+        width - width of array
+        height - height of array
+        nR - radius of filter window
+        fEps - epsilon
+        bIntegerGuide - the guidance image holds integer samples, its statistics are computed exactly
+        pStrip - rows of the frame held by the arrays, nullptr for the whole frame
+    Return:
+        pfOutA, pfOutB - mean coefficients
+ */
+void dehazing::LumaCoefficients(ScratchArena& arena, float* pfImageY, float* pfP, int width, int height, int nR, float fEps,
+    float* pfOutA, float* pfOutB, bool bIntegerGuide, const StripRows* pStrip) const
+{
+    // Same bounds as GuidedCoefficients
+    const uint64_t nMaxN = (uint64_t)(2 * nR + 1) * (2 * nR + 1);
+    const bool bExact32 = bIntegerGuide && (uint64_t)peak * peak * nMaxN <= UINT32_MAX;
+    const bool bExact = bIntegerGuide && (uint64_t)peak * nMaxN <= UINT32_MAX;
+
+    int nPlane = 0;
+    auto box = [&](float* pfIn, float* pfOut) {
+        if (pStrip == nullptr)
+            BoxFilter(arena, pfIn, nR, width, height, pfOut);
+        else
+            BoxFilterStrip(arena, pfIn, nR, width, height, pStrip->nTop, pStrip->nNextTop, pStrip->nFrameHeight,
+                pStrip->pfCarry + width * nPlane++, pfOut);
+    };
+    auto boxCoef = [&](float* pfIn, float* pfOut) {
+        if (pStrip == nullptr)
+        {
+            BoxFilter(arena, pfIn, nR, width, height, pfOut);
+        }
+        else
+        {
+            const int nOffset = (pStrip->nCoefTop - pStrip->nTop) * width;
+            BoxFilterStrip(arena, pfIn + nOffset, nR, width, pStrip->nCoefEnd - pStrip->nCoefTop, pStrip->nCoefTop, pStrip->nNextCoefTop,
+                pStrip->nFrameHeight, pStrip->pfCarry + width * nPlane++, pfOut + nOffset);
+        }
+    };
+
+    const size_t nMark = arena.Mark();
 
-    //cumulative sum over X axis
-    for (auto j = 0; j < width * height; j += width)
+    float* pfInitN = arena.Alloc<float>(width * height);
+    float* pfInitMeanIp = arena.Alloc<float>(width * height);
+    float* pfInitVarI = arena.Alloc<float>(width * height);
+
+    float* pfN = arena.Alloc<float>(width * height);
+    float* pfMeanI = arena.Alloc<float>(width * height);
+    float* pfMeanP = arena.Alloc<float>(width * height);
+    float* pfMeanIp = arena.Alloc<float>(width * height);
+    float* pfVarI = arena.Alloc<float>(width * height);
+
+    float* pfA = arena.Alloc<float>(width * height);
+    float* pfB = arena.Alloc<float>(width * height);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            pfInitN[nIdx] = 1.f;
+            pfInitMeanIp[nIdx] = pfImageY[nIdx] * pfP[nIdx];
+            if (!bExact)
+                pfInitVarI[nIdx] = pfImageY[nIdx] * pfImageY[nIdx];
+        }
+    });
+
+    box(pfInitN, pfN);
+    box(pfP, pfMeanP);
+
+    if (bExact32)
+        LumaStatistics<uint32_t>(arena, pfImageY, width, height, nR, pfMeanI, pfVarI);
+    else if (bExact)
+        LumaStatistics<uint64_t>(arena, pfImageY, width, height, nR, pfMeanI, pfVarI);
+    else
     {
-        pfArrayCum1[j] = pfOutArray1[j];
-        pfArrayCum2[j] = pfOutArray2[j];
-        pfArrayCum3[j] = pfOutArray3[j];
+        box(pfImageY, pfMeanI);
+        box(pfInitVarI, pfVarI);
     }
 
-    for (auto j = 0; j < width * height; j += width)
-    {
-        for (auto i = 0; i < width; i++)
+    box(pfInitMeanIp, pfMeanIp);
+
+    // Coefficient a and coefficient b
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
         {
-            pfArrayCum1[j + i] = pfArrayCum1[j + i - 1] + pfOutArray1[j + i];
-            pfArrayCum2[j + i] = pfArrayCum2[j + i - 1] + pfOutArray2[j + i];
-            pfArrayCum3[j + i] = pfArrayCum3[j + i - 1] + pfOutArray3[j + i];
+            if (!bExact)
+            {
+                pfMeanI[nIdx] = pfMeanI[nIdx] / pfN[nIdx];
+                pfVarI[nIdx] = pfVarI[nIdx] / pfN[nIdx] - pfMeanI[nIdx] * pfMeanI[nIdx];
+            }
+
+            pfMeanP[nIdx] = pfMeanP[nIdx] / pfN[nIdx];
+            pfMeanIp[nIdx] = pfMeanIp[nIdx] / pfN[nIdx];
+
+            pfA[nIdx] = (pfMeanIp[nIdx] - pfMeanI[nIdx] * pfMeanP[nIdx]) / (pfVarI[nIdx] + fEps * 2.f);
+            pfB[nIdx] = pfMeanP[nIdx] - pfA[nIdx] * pfMeanI[nIdx];
         }
-    }
+    });
 
-    //difference over Y axis
-    for (auto j = 0; j < width * height; j += width)
-    {
-        for (auto i = 0; i < nR + 1; i++)
+    // Mean coefficients over each local patch
+    boxCoef(pfA, pfOutA);
+    boxCoef(pfB, pfOutB);
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
         {
-            pfOutArray1[j + i] = pfArrayCum1[j + i + nR];
-            pfOutArray2[j + i] = pfArrayCum2[j + i + nR];
-            pfOutArray3[j + i] = pfArrayCum3[j + i + nR];
+            pfOutA[nIdx] = pfOutA[nIdx] / pfN[nIdx];
+            pfOutB[nIdx] = pfOutB[nIdx] / pfN[nIdx];
         }
-    }
+    });
 
-    for (auto j = 0; j < width * height; j += width)
+    arena.Rewind(nMark);
+}
+
+/*
+    Function: SubsampleBox
+    Description: box average of nStep x nStep blocks, the blocks at the right and bottom borders are truncated.
+    Parameters:
+        pfInArray - input array (width * height)
+        nStep - sampling step
+        nBegin, nEnd - output rows
+    Return:
+        pfOutArray - output array (nSubW * nSubH)
+ */
+static void SubsampleBox(const float* pfInArray, int width, int height, int nStep, float* pfOutArray, int nSubW, int nBegin, int nEnd)
+{
+    for (auto y = nBegin; y < nEnd; y++)
     {
-        for (auto i = nR + 1; i < width - nR; i++)
+        for (auto x = 0; x < nSubW; x++)
         {
-            pfOutArray1[j + i] = pfArrayCum1[j + i + nR] - pfArrayCum1[j + i - nR - 1];
-            pfOutArray2[j + i] = pfArrayCum2[j + i + nR] - pfArrayCum2[j + i - nR - 1];
-            pfOutArray3[j + i] = pfArrayCum3[j + i + nR] - pfArrayCum3[j + i - nR - 1];
+            float fSum = 0.f;
+            const int nEndY = std::min((y + 1) * nStep, height);
+            const int nEndX = std::min((x + 1) * nStep, width);
+
+            for (auto j = y * nStep; j < nEndY; j++)
+                for (auto i = x * nStep; i < nEndX; i++)
+                    fSum += pfInArray[j * width + i];
+
+            pfOutArray[y * nSubW + x] = fSum * (1.f / ((nEndY - y * nStep) * (nEndX - x * nStep)));
         }
     }
+}
 
-    for (auto j = 0; j < width * height; j += width)
+/*
+    Function: UpsampleCoefficient
+    Description: bilinear upsampling of a coefficient plane computed on the subsampled guide.
+    Parameters:
+        pfInArray - input array (nSubW * nSubH)
+        nStep - sampling step
+        nBegin, nEnd - output rows
+    Return:
+        pfOutArray - output array (width * height)
+ */
+static void UpsampleCoefficient(const float* pfInArray, int nSubW, int nSubH, int nStep, float* pfOutArray, int width, int nBegin, int nEnd)
+{
+    for (auto j = nBegin; j < nEnd; j++)
     {
-        for (auto i = width - nR; i < width; i++)
+        float fY = clamp((j + 0.5f) / nStep - 0.5f, 0.f, (float)(nSubH - 1));
+        int nY0 = (int)fY;
+        int nY1 = std::min(nY0 + 1, nSubH - 1);
+        float fWy = fY - nY0;
+
+        for (auto i = 0; i < width; i++)
         {
-            pfOutArray1[j + i] = pfArrayCum1[j + width - 1] - pfArrayCum1[j + i - nR - 1];
-            pfOutArray2[j + i] = pfArrayCum2[j + width - 1] - pfArrayCum2[j + i - nR - 1];
-            pfOutArray3[j + i] = pfArrayCum3[j + width - 1] - pfArrayCum3[j + i - nR - 1];
+            float fX = clamp((i + 0.5f) / nStep - 0.5f, 0.f, (float)(nSubW - 1));
+            int nX0 = (int)fX;
+            int nX1 = std::min(nX0 + 1, nSubW - 1);
+            float fWx = fX - nX0;
+
+            float fTop    = pfInArray[nY0 * nSubW + nX0] + (pfInArray[nY0 * nSubW + nX1] - pfInArray[nY0 * nSubW + nX0]) * fWx;
+            float fBottom = pfInArray[nY1 * nSubW + nX0] + (pfInArray[nY1 * nSubW + nX1] - pfInArray[nY1 * nSubW + nX0]) * fWx;
+            pfOutArray[j * width + i] = fTop + (fBottom - fTop) * fWy;
         }
     }
-
-    delete[] pfArrayCum1;
-    delete[] pfArrayCum2;
-    delete[] pfArrayCum3;
 }
 
 /*
-	Function: GuidedFilter
-	Description: the original guided filter for rgb color image. This function is used for image dehazing.
-		The video dehazing algorithm uses appoximated filter for fast refinement.
-	Parameter:
-		nW - width of array
-		nH - height of array
-		fEps - epsilon
-	(member variable)
-		m_pfTransmission - initial transmission (block_based)
-		m_pnYImg - guidance image (Y image)
-	Return:
-		m_pfTransmissionR - filtered transmission
+    Function: GuidedFilter
+    Description: the guided filter for rgb color image. This function is used for image dehazing.
+        With StepSize > 1 the fast guided filter is used: the coefficients are calculated on the
+        guidance image subsampled by StepSize and only the mean coefficients are upsampled.
+        In luma guide mode the guidance image is the luma alone, see LumaCoefficients.
+    Parameter:
+        nW - width of array
+        nH - height of array
+        fEps - epsilon
+    (member variable)
+        m_pfTransmission - initial transmission (block_based)
+        m_pfRImg, m_pfGImg, m_pfBImg - guidance image (m_pfYImg in luma guide mode)
+    Return:
+        m_pfTransmissionR - filtered transmission
  */
-void dehazing::GuidedFilter(int width, int height, float fEps)
+void dehazing::GuidedFilter(DehazeContext& ctx, int width, int height, float fEps) const
 {
-    float* pfImageR = new float[width * height];
-    float* pfImageG = new float[width * height];
-    float* pfImageB = new float[width * height];
-
-    float* pfInitN = new float[width * height];
-    float* pfInitMeanIpR = new float[width * height];
-    float* pfInitMeanIpG = new float[width * height];
-    float* pfInitMeanIpB = new float[width * height];
-    float* pfMeanP = new float[width * height];
-
-    float* pfN = new float[width * height];
-    float* pfMeanIr = new float[width * height];
-    float* pfMeanIg = new float[width * height];
-    float* pfMeanIb = new float[width * height];
-    float* pfMeanIpR = new float[width * height];
-    float* pfMeanIpG = new float[width * height];
-    float* pfMeanIpB = new float[width * height];
-    float* pfCovIpR = new float[width * height];
-    float* pfCovIpG = new float[width * height];
-    float* pfCovIpB = new float[width * height];
-
-    float* pfCovEntire = new float[width * height * 3];
-
-    float* pfInitVarIrr = new float[width * height];
-    float* pfInitVarIrg = new float[width * height];
-    float* pfInitVarIrb = new float[width * height];
-    float* pfInitVarIgg = new float[width * height];
-    float* pfInitVarIgb = new float[width * height];
-    float* pfInitVarIbb = new float[width * height];
-
-    float* pfVarIrr = new float[width * height];
-    float* pfVarIrg = new float[width * height];
-    float* pfVarIrb = new float[width * height];
-    float* pfVarIgg = new float[width * height];
-    float* pfVarIgb = new float[width * height];
-    float* pfVarIbb = new float[width * height];
-
-    float* pfA1 = new float[width * height];
-    float* pfA2 = new float[width * height];
-    float* pfA3 = new float[width * height];
-    float* pfOutA1 = new float[width * height];
-    float* pfOutA2 = new float[width * height];
-    float* pfOutA3 = new float[width * height];
-
-    float* pfSigmaEntire = new float[width * height * 9];
-
-    float* pfB = new float[width * height];
-    float* pfOutB = new float[width * height];
-
-    // Converting to float point
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
+    float* pfImageR = ctx.m_pfRImg;
+    float* pfImageG = ctx.m_pfGImg;
+    float* pfImageB = ctx.m_pfBImg;
+    float* pfImageY = ctx.m_pfYImg;
+
+    if (StepSize <= 1 && m_nStripHeight > 0 && m_nStripHeight < height)
     {
-        pfImageR[nIdx] = (float)m_pnRImg[nIdx];
-        pfImageG[nIdx] = (float)m_pnGImg[nIdx];
-        pfImageB[nIdx] = (float)m_pnBImg[nIdx];
+        GuidedFilterStrips(ctx, width, height, fEps);
+        return;
     }
-    //////////////////////////////////////////////////////////////////////////
 
-    // Make an integral image
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
-    {
-        pfInitN[nIdx] = 1.f;
+    // Temporaries of the previous frame are released at once
+    ScratchArena& arena = ctx.m_Scratch;
+    arena.Reset();
+
+    // The luma guide has one coefficient a
+    float* pfOutA1 = arena.Alloc<float>(width * height);
+    float* pfOutA2 = m_LumaGuideFlag ? nullptr : arena.Alloc<float>(width * height);
+    float* pfOutA3 = m_LumaGuideFlag ? nullptr : arena.Alloc<float>(width * height);
+    float* pfOutB = arena.Alloc<float>(width * height);
 
-        pfInitMeanIpR[nIdx] = pfImageR[nIdx] * m_pfTransmission[nIdx];
-        pfInitMeanIpG[nIdx] = pfImageG[nIdx] * m_pfTransmission[nIdx];
-        pfInitMeanIpB[nIdx] = pfImageB[nIdx] * m_pfTransmission[nIdx];
+    if (StepSize <= 1)
+    {
+        int nR = std::min(GBlockSize, (std::min(width, height) - 1) / 2);
+        if (m_LumaGuideFlag)
+            LumaCoefficients(arena, pfImageY, ctx.m_pfTransmission, width, height, nR, fEps, pfOutA1, pfOutB, bits <= 16, nullptr);
+        else
+            GuidedCoefficients(arena, pfImageR, pfImageG, pfImageB, ctx.m_pfTransmission, width, height, nR, fEps, pfOutA1, pfOutA2, pfOutA3, pfOutB, bits <= 16, nullptr);
     }
+    else
+    {
+        const int nSubW = (width + StepSize - 1) / StepSize;
+        const int nSubH = (height + StepSize - 1) / StepSize;
+        const int nR = std::min(std::max(GBlockSize / StepSize, 1), (std::min(nSubW, nSubH) - 1) / 2);
+
+        float* pfSubP = arena.Alloc<float>(nSubW * nSubH);
+        float* pfSubA1 = arena.Alloc<float>(nSubW * nSubH);
+        float* pfSubCoefB = arena.Alloc<float>(nSubW * nSubH);
 
-    BoxFilter(pfInitN, GBlockSize, width, height, pfN);
-    BoxFilter(m_pfTransmission, GBlockSize, width, height, pfMeanP);
+        if (m_LumaGuideFlag)
+        {
+            float* pfSubY = arena.Alloc<float>(nSubW * nSubH);
 
-    BoxFilter(pfImageR, pfImageG, pfImageB, GBlockSize, width, height, pfMeanIr, pfMeanIg, pfMeanIb);
+            // Subsample guidance image and transmission by box averaging
+            ParallelRows(nSubH, 1, [&](int nBegin, int nEnd, int) {
+                SubsampleBox(pfImageY, width, height, StepSize, pfSubY, nSubW, nBegin, nEnd);
+                SubsampleBox(ctx.m_pfTransmission, width, height, StepSize, pfSubP, nSubW, nBegin, nEnd);
+            });
 
-    BoxFilter(pfInitMeanIpR, pfInitMeanIpG, pfInitMeanIpB, GBlockSize, width, height, pfMeanIpR, pfMeanIpG, pfMeanIpB);
+            LumaCoefficients(arena, pfSubY, pfSubP, nSubW, nSubH, nR, fEps, pfSubA1, pfSubCoefB, false, nullptr);
 
-    // Covariance of (I, pfTrans) in each local patch
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
-    {
-        pfMeanIr[nIdx] = pfMeanIr[nIdx] / pfN[nIdx];
-        pfMeanIg[nIdx] = pfMeanIg[nIdx] / pfN[nIdx];
-        pfMeanIb[nIdx] = pfMeanIb[nIdx] / pfN[nIdx];
-
-        pfMeanP[nIdx] = pfMeanP[nIdx] / pfN[nIdx];
-
-        pfMeanIpR[nIdx] = pfMeanIpR[nIdx] / pfN[nIdx];
-        pfMeanIpG[nIdx] = pfMeanIpG[nIdx] / pfN[nIdx];
-        pfMeanIpB[nIdx] = pfMeanIpB[nIdx] / pfN[nIdx];
-
-        pfCovIpR[nIdx] = pfMeanIpR[nIdx] - pfMeanIr[nIdx] * pfMeanP[nIdx];
-        pfCovIpG[nIdx] = pfMeanIpG[nIdx] - pfMeanIg[nIdx] * pfMeanP[nIdx];
-        pfCovIpB[nIdx] = pfMeanIpB[nIdx] - pfMeanIb[nIdx] * pfMeanP[nIdx];
-
-        pfCovEntire[nIdx * 3] = pfCovIpR[nIdx];
-        pfCovEntire[nIdx * 3 + 1] = pfCovIpG[nIdx];
-        pfCovEntire[nIdx * 3 + 2] = pfCovIpB[nIdx];
-
-        pfInitVarIrr[nIdx] = pfImageR[nIdx] * pfImageR[nIdx];
-        pfInitVarIrg[nIdx] = pfImageR[nIdx] * pfImageG[nIdx];
-        pfInitVarIrb[nIdx] = pfImageR[nIdx] * pfImageB[nIdx];
-        pfInitVarIgg[nIdx] = pfImageG[nIdx] * pfImageG[nIdx];
-        pfInitVarIgb[nIdx] = pfImageG[nIdx] * pfImageB[nIdx];
-        pfInitVarIbb[nIdx] = pfImageB[nIdx] * pfImageB[nIdx];
+            ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+                UpsampleCoefficient(pfSubA1, nSubW, nSubH, StepSize, pfOutA1, width, nBegin, nEnd);
+                UpsampleCoefficient(pfSubCoefB, nSubW, nSubH, StepSize, pfOutB, width, nBegin, nEnd);
+            });
+        }
+        else
+        {
+            float* pfSubR = arena.Alloc<float>(nSubW * nSubH);
+            float* pfSubG = arena.Alloc<float>(nSubW * nSubH);
+            float* pfSubB = arena.Alloc<float>(nSubW * nSubH);
+            float* pfSubA2 = arena.Alloc<float>(nSubW * nSubH);
+            float* pfSubA3 = arena.Alloc<float>(nSubW * nSubH);
+
+            // Subsample guidance image and transmission by box averaging
+            ParallelRows(nSubH, 1, [&](int nBegin, int nEnd, int) {
+                SubsampleBox(pfImageR, width, height, StepSize, pfSubR, nSubW, nBegin, nEnd);
+                SubsampleBox(pfImageG, width, height, StepSize, pfSubG, nSubW, nBegin, nEnd);
+                SubsampleBox(pfImageB, width, height, StepSize, pfSubB, nSubW, nBegin, nEnd);
+                SubsampleBox(ctx.m_pfTransmission, width, height, StepSize, pfSubP, nSubW, nBegin, nEnd);
+            });
+
+            GuidedCoefficients(arena, pfSubR, pfSubG, pfSubB, pfSubP, nSubW, nSubH, nR, fEps, pfSubA1, pfSubA2, pfSubA3, pfSubCoefB, false, nullptr);
+
+            ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+                UpsampleCoefficient(pfSubA1, nSubW, nSubH, StepSize, pfOutA1, width, nBegin, nEnd);
+                UpsampleCoefficient(pfSubA2, nSubW, nSubH, StepSize, pfOutA2, width, nBegin, nEnd);
+                UpsampleCoefficient(pfSubA3, nSubW, nSubH, StepSize, pfOutA3, width, nBegin, nEnd);
+                UpsampleCoefficient(pfSubCoefB, nSubW, nSubH, StepSize, pfOutB, width, nBegin, nEnd);
+            });
+        }
     }
 
-    // Variance of I in each local patch: the matrix Sigma.
-    // 		    rr, rg, rb
-    // pfSigma  rg, gg, gb
-    //	 	    rb, gb, bb
+    // Transmission refinement at each pixel
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int) {
+        if (m_LumaGuideFlag)
+        {
+            for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+                ctx.m_pfTransmissionR[nIdx] = pfOutA1[nIdx] * pfImageY[nIdx] + pfOutB[nIdx];
+            return;
+        }
 
-    BoxFilter(pfInitVarIrr, pfInitVarIrg, pfInitVarIrb, GBlockSize, width, height, pfVarIrr, pfVarIrg, pfVarIrb);
-    BoxFilter(pfInitVarIgg, pfInitVarIgb, pfInitVarIbb, GBlockSize, width, height, pfVarIgg, pfVarIgb, pfVarIbb);
+        for (auto nIdx = nBegin * width; nIdx < nEnd * width; nIdx++)
+        {
+            ctx.m_pfTransmissionR[nIdx] = pfOutA1[nIdx] * pfImageR[nIdx] + pfOutA2[nIdx] * pfImageG[nIdx] + pfOutA3[nIdx] * pfImageB[nIdx] + pfOutB[nIdx];
+        }
+    });
+}
 
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
+/*
+    Function: GuidedFilterStrips
+    Description: GuidedFilter in horizontal strips of m_nStripHeight output rows, to bound the scratch memory.
+        A strip reads 2 * nR rows of guidance above and below its output rows, and the box filters carry their
+        cumulative sums from one strip to the next, so the result is the same as the whole frame.
+    Parameter:
+        nW - width of array
+        nH - height of array
+        fEps - epsilon
+    Return:
+        m_pfTransmissionR - filtered transmission
+ */
+void dehazing::GuidedFilterStrips(DehazeContext& ctx, int width, int height, float fEps) const
+{
+    ScratchArena& arena = ctx.m_Scratch;
+    arena.Reset();
+
+    const int nR = std::min(GBlockSize, (std::min(width, height) - 1) / 2);
+
+    StripRows strip;
+    strip.nFrameHeight = height;
+    strip.pfCarry = arena.Alloc<float>(GUIDED_BOX_PLANES * width);
+
+    const size_t nMark = arena.Mark();
+
+    for (auto nFirst = 0; nFirst < height; nFirst += m_nStripHeight)
     {
-        pfVarIrr[nIdx] = pfVarIrr[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIr[nIdx];
-        pfVarIrg[nIdx] = pfVarIrg[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIg[nIdx];
-        pfVarIrb[nIdx] = pfVarIrb[nIdx] / pfN[nIdx] - pfMeanIr[nIdx] * pfMeanIb[nIdx];
-        pfVarIgg[nIdx] = pfVarIgg[nIdx] / pfN[nIdx] - pfMeanIg[nIdx] * pfMeanIg[nIdx];
-        pfVarIgb[nIdx] = pfVarIgb[nIdx] / pfN[nIdx] - pfMeanIg[nIdx] * pfMeanIb[nIdx];
-        pfVarIbb[nIdx] = pfVarIbb[nIdx] / pfN[nIdx] - pfMeanIb[nIdx] * pfMeanIb[nIdx];
-
-        pfSigmaEntire[nIdx * 9 + 0] = pfVarIrr[nIdx] + fEps * 2.f;
-        pfSigmaEntire[nIdx * 9 + 1] = pfVarIrg[nIdx];
-        pfSigmaEntire[nIdx * 9 + 2] = pfVarIrb[nIdx];
-        pfSigmaEntire[nIdx * 9 + 3] = pfVarIrg[nIdx];
-        pfSigmaEntire[nIdx * 9 + 4] = pfVarIgg[nIdx] + fEps * 2.f;
-        pfSigmaEntire[nIdx * 9 + 5] = pfVarIgb[nIdx];
-        pfSigmaEntire[nIdx * 9 + 6] = pfVarIrb[nIdx];
-        pfSigmaEntire[nIdx * 9 + 7] = pfVarIgb[nIdx];
-        pfSigmaEntire[nIdx * 9 + 8] = pfVarIbb[nIdx] + fEps * 2.f;
+        const int nLast = std::min(nFirst + m_nStripHeight, height);
+
+        // Guidance rows of the statistics, then rows of valid coefficients
+        strip.nTop = std::max(nFirst - 2 * nR, 0);
+        strip.nNextTop = std::max(nLast - 2 * nR, 0);
+        strip.nCoefTop = std::max(nFirst - nR, 0);
+        strip.nCoefEnd = std::min(nLast + nR, height);
+        strip.nNextCoefTop = std::max(nLast - nR, 0);
+
+        const int nRows = std::min(nLast + 2 * nR, height) - strip.nTop;
+        const int nOffset = strip.nTop * width;
+
+        float* pfOutA1 = arena.Alloc<float>(width * nRows);
+        float* pfOutA2 = m_LumaGuideFlag ? nullptr : arena.Alloc<float>(width * nRows);
+        float* pfOutA3 = m_LumaGuideFlag ? nullptr : arena.Alloc<float>(width * nRows);
+        float* pfOutB = arena.Alloc<float>(width * nRows);
+
+        if (m_LumaGuideFlag)
+            LumaCoefficients(arena, ctx.m_pfYImg + nOffset, ctx.m_pfTransmission + nOffset, width, nRows, nR, fEps, pfOutA1, pfOutB, bits <= 16, &strip);
+        else
+            GuidedCoefficients(arena, ctx.m_pfRImg + nOffset, ctx.m_pfGImg + nOffset, ctx.m_pfBImg + nOffset, ctx.m_pfTransmission + nOffset,
+                width, nRows, nR, fEps, pfOutA1, pfOutA2, pfOutA3, pfOutB, bits <= 16, &strip);
+
+        // Transmission refinement of the output rows
+        ParallelRows(nLast - nFirst, 1, [&](int nBegin, int nEnd, int) {
+            if (m_LumaGuideFlag)
+            {
+                for (auto nIdx = (nFirst + nBegin) * width; nIdx < (nFirst + nEnd) * width; nIdx++)
+                    ctx.m_pfTransmissionR[nIdx] = pfOutA1[nIdx - nOffset] * ctx.m_pfYImg[nIdx] + pfOutB[nIdx - nOffset];
+                return;
+            }
+
+            for (auto nIdx = (nFirst + nBegin) * width; nIdx < (nFirst + nEnd) * width; nIdx++)
+            {
+                const int nStripIdx = nIdx - nOffset;
+                ctx.m_pfTransmissionR[nIdx] = pfOutA1[nStripIdx] * ctx.m_pfRImg[nIdx] + pfOutA2[nStripIdx] * ctx.m_pfGImg[nIdx]
+                    + pfOutA3[nStripIdx] * ctx.m_pfBImg[nIdx] + pfOutB[nStripIdx];
+            }
+        });
+
+        arena.Rewind(nMark);
     }
-    // Calculate coefficient a and coefficient b
-    // Coefficienta
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
+}
+
+/*
+    Function: BoxFilterRow
+    Description: sliding window sum over one row, the window is truncated at the borders like BoxFilter.
+    Parameters:
+        pfInArray - input row
+        width - width of row
+        nR - radius of filter window
+    Return:
+        pfOutArray - output row
+ */
+static void BoxFilterRow(const float* pfInArray, float* pfOutArray, int width, int nR)
+{
+    double dSum = 0.0;
+    for (auto i = 0; i <= nR; i++)
+        dSum += pfInArray[i];
+
+    for (auto i = 0; i < width; i++)
     {
-        CalcAcoeff(pfSigmaEntire, pfCovEntire, pfA1, pfA2, pfA3, nIdx);
+        pfOutArray[i] = (float)dSum;
+
+        if (i + nR + 1 < width)
+            dSum += pfInArray[i + nR + 1];
+        if (i - nR >= 0)
+            dSum -= pfInArray[i - nR];
     }
+}
 
-    // Coefficient b
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
+/*
+    Function: GuidedFilterStream
+    Description: row-streaming version of GuidedFilter. The rows are processed top to bottom in one pass,
+        only a ring of 2 * GBlockSize + 1 horizontally filtered rows is kept for each statistic and for
+        each coefficient, so the memory is bounded by the width instead of the frame area.
+        Each thread streams its own strip of rows, see GuidedFilterStreamStrip.
+    Parameter:
+        nW - width of array
+        nH - height of array
+        fEps - epsilon
+    (member variable)
+        m_pfTransmission - initial transmission (block_based)
+        m_pfRImg, m_pfGImg, m_pfBImg - guidance image (m_pfYImg in luma guide mode)
+    Return:
+        m_pfTransmissionR - filtered transmission
+ */
+void dehazing::GuidedFilterStream(DehazeContext& ctx, int width, int height, float fEps) const
+{
+    // Each strip takes its rings from its own part of the arena
+    ScratchArena& arena = ctx.m_Scratch;
+    arena.Reset();
+
+    const size_t nStripSize = StreamStripSize(width, height);
+    uint8_t* pStrips = arena.Alloc<uint8_t>(nStripSize * m_pPool->Threads());
+
+    ParallelRows(height, 1, [&](int nBegin, int nEnd, int nTask) {
+        ScratchArena strip(pStrips + nStripSize * nTask, nStripSize);
+        GuidedFilterStreamStrip(strip, ctx, width, height, fEps, nBegin, nEnd);
+    });
+}
+
+/*
+    Function: StreamStripSize
+    Description: bytes of scratch taken by one strip of GuidedFilterStreamStrip.
+ */
+size_t dehazing::StreamStripSize(int width, int height) const
+{
+    const int nStat = m_LumaGuideFlag ? 4 : 13;
+    const int nCoef = m_LumaGuideFlag ? 2 : 4;
+    const int nR = std::min(GBlockSize, (std::min(width, height) - 1) / 2);
+    const int nRing = 2 * nR + 1;
+
+    return ScratchArena::Bytes<float>(nRing * nStat * width) + ScratchArena::Bytes<float>(nRing * nCoef * width) +
+           ScratchArena::Bytes<double>(nStat * width) + ScratchArena::Bytes<double>(nCoef * width) +
+           ScratchArena::Bytes<float>(nStat * width) + ScratchArena::Bytes<int>(width);
+}
+
+/*
+    Function: GuidedScratchSize
+    Description: bytes of scratch taken by the guided filter of one frame, the size of DehazeContext::m_Scratch.
+        Mirrors the slices of GuidedFilter, GuidedFilterStrips, GuidedCoefficients, BoxFilter and GuideStatistics,
+        or of the strips of GuidedFilterStream.
+    Parameter:
+        nStripHeight - output rows of a strip of GuidedFilterStrips, 0 for the whole frame
+ */
+size_t dehazing::GuidedScratchSize(int nStripHeight) const
+{
+    const int nThreads = m_pPool->Threads();
+
+    if (m_StreamFlag && StepSize <= 1)
+        return StreamStripSize(width, height) * nThreads;
+
+    // GuidedCoefficients: 31 planes, the covariance and Sigma entries, then the cumulative plane of BoxFilter
+    // or the column sums of GuideStatistics. LumaCoefficients: 10 planes and the column sums of LumaStatistics.
+    auto coefficients = [&](int nW, int nH) {
+        const size_t nPlane = ScratchArena::Bytes<float>(nW * nH);
+        if (m_LumaGuideFlag)
+            return nPlane * 10 + std::max(nPlane, ScratchArena::Bytes<uint64_t>(nThreads * 2 * nW));
+        return nPlane * 31 + ScratchArena::Bytes<float>(nW * nH * 3) + ScratchArena::Bytes<float>(nW * nH * 9) +
+               std::max(nPlane, ScratchArena::Bytes<uint64_t>(nThreads * 9 * nW));
+    };
+    const int nOut = m_LumaGuideFlag ? 2 : 4;
+
+    if (StepSize <= 1 && nStripHeight > 0 && nStripHeight < height)
     {
-        pfB[nIdx] = pfMeanP[nIdx] - pfA1[nIdx] * pfMeanIr[nIdx] - pfA2[nIdx] * pfMeanIg[nIdx] - pfA3[nIdx] * pfMeanIb[nIdx];
+        // Carried rows, then the output coefficients and GuidedCoefficients of one strip with its halo
+        const int nR = std::min(GBlockSize, (std::min(width, height) - 1) / 2);
+        const int nRows = std::min(nStripHeight + 4 * nR, height);
+
+        return ScratchArena::Bytes<float>(GUIDED_BOX_PLANES * width) + ScratchArena::Bytes<float>(width * nRows) * nOut + coefficients(width, nRows);
     }
 
-    // Transmission refinement at each pixel
-    BoxFilter(pfA1, pfA2, pfA3, GBlockSize, width, height, pfOutA1, pfOutA2, pfOutA3);
+    const int nSubW = StepSize <= 1 ? width : (width + StepSize - 1) / StepSize;
+    const int nSubH = StepSize <= 1 ? height : (height + StepSize - 1) / StepSize;
+
+    // GuidedFilter: the output coefficients, and the subsampled planes of the fast guided filter
+    return ScratchArena::Bytes<float>(width * height) * nOut + (StepSize <= 1 ? 0 : ScratchArena::Bytes<float>(nSubW * nSubH) * nOut * 2) +
+           coefficients(nSubW, nSubH);
+}
+
+/*
+    Function: GuidedFilterStreamStrip
+    Description: GuidedFilterStream of the output rows nFirst to nLast - 1. The strip starts streaming
+        GBlockSize coefficient rows and 2 * GBlockSize statistics rows above nFirst, so that its windows
+        are complete without reading the rings of the neighbouring strips.
+ */
+void dehazing::GuidedFilterStreamStrip(ScratchArena& arena, DehazeContext& ctx, int width, int height, float fEps, int nFirst, int nLast) const
+{
+    // Statistics: I_r, I_g, I_b, p, I_r*p, I_g*p, I_b*p, I_rr, I_rg, I_rb, I_gg, I_gb, I_bb,
+    // or I_y, p, I_y*p, I_yy with the luma guide
+    const int nStat = m_LumaGuideFlag ? 4 : 13;
+    // Coefficients: A1, A2, A3, B, or A, B
+    const int nCoef = m_LumaGuideFlag ? 2 : 4;
+
+    const int nR = std::min(GBlockSize, (std::min(width, height) - 1) / 2);
+    const int nRing = 2 * nR + 1;
+
+    float* pfStatRing = arena.Alloc<float>(nRing * nStat * width);
+    float* pfCoefRing = arena.Alloc<float>(nRing * nCoef * width);
+    double* pdStatSum = arena.Alloc<double>(nStat * width);
+    double* pdCoefSum = arena.Alloc<double>(nCoef * width);
+    float* pfRow = arena.Alloc<float>(nStat * width);
+    int* pnCountX = arena.Alloc<int>(width);
+
+    std::fill(pdStatSum, pdStatSum + nStat * width, 0.0);
+    std::fill(pdCoefSum, pdCoefSum + nCoef * width, 0.0);
+
+    for (auto i = 0; i < width; i++)
+        pnCountX[i] = std::min(i + nR, width - 1) - std::max(i - nR, 0) + 1;
+
+    // First rows of the halo above the strip
+    const int nFirstCoef = std::max(nFirst - nR, 0);
+    const int nFirstIn = std::max(nFirstCoef - nR, 0);
 
-    BoxFilter(pfB, GBlockSize, width, height, pfOutB);
+    int nNextIn = nFirstIn;      // Next guidance row entering the statistics window
+    int nNextCoef = nFirstCoef;  // Next coefficient row entering the coefficient window
 
-    for (auto nIdx = 0; nIdx < width * height; nIdx++)
+    for (auto nOut = nFirst; nOut < nLast; nOut++)
     {
-        m_pfTransmissionR[nIdx] = (pfOutA1[nIdx] * pfImageR[nIdx] + pfOutA2[nIdx] * pfImageG[nIdx] + pfOutA3[nIdx] * pfImageB[nIdx] + pfOutB[nIdx]) / pfN[nIdx];
-    }
+        // Coefficient row leaving the window
+        if (nOut - nR - 1 >= nFirstCoef)
+        {
+            const float* pfSlot = pfCoefRing + ((nOut - nR - 1) % nRing) * nCoef * width;
+            for (auto nIdx = 0; nIdx < nCoef * width; nIdx++)
+                pdCoefSum[nIdx] -= pfSlot[nIdx];
+        }
+
+        for (; nNextCoef <= std::min(nOut + nR, height - 1); nNextCoef++)
+        {
+            const int nC = nNextCoef;
+
+            // Statistics row leaving the window
+            if (nC - nR - 1 >= nFirstIn)
+            {
+                const float* pfSlot = pfStatRing + ((nC - nR - 1) % nRing) * nStat * width;
+                for (auto nIdx = 0; nIdx < nStat * width; nIdx++)
+                    pdStatSum[nIdx] -= pfSlot[nIdx];
+            }
+
+            // Statistics rows entering the window
+            for (; nNextIn <= std::min(nC + nR, height - 1); nNextIn++)
+            {
+                const int nY = nNextIn;
+                float* pfSlot = pfStatRing + (nY % nRing) * nStat * width;
+
+                if (m_LumaGuideFlag)
+                {
+                    for (auto i = 0; i < width; i++)
+                    {
+                        const float fY = ctx.m_pfYImg[nY * width + i];
+                        const float fP = ctx.m_pfTransmission[nY * width + i];
+
+                        pfRow[i] = fY;
+                        pfRow[width + i] = fP;
+                        pfRow[2 * width + i] = fY * fP;
+                        pfRow[3 * width + i] = fY * fY;
+                    }
+                }
+                else
+                {
+                    for (auto i = 0; i < width; i++)
+                    {
+                        const float fR = ctx.m_pfRImg[nY * width + i];
+                        const float fG = ctx.m_pfGImg[nY * width + i];
+                        const float fB = ctx.m_pfBImg[nY * width + i];
+                        const float fP = ctx.m_pfTransmission[nY * width + i];
+
+                        pfRow[i] = fR;
+                        pfRow[width + i] = fG;
+                        pfRow[2 * width + i] = fB;
+                        pfRow[3 * width + i] = fP;
+                        pfRow[4 * width + i] = fR * fP;
+                        pfRow[5 * width + i] = fG * fP;
+                        pfRow[6 * width + i] = fB * fP;
+                        pfRow[7 * width + i] = fR * fR;
+                        pfRow[8 * width + i] = fR * fG;
+                        pfRow[9 * width + i] = fR * fB;
+                        pfRow[10 * width + i] = fG * fG;
+                        pfRow[11 * width + i] = fG * fB;
+                        pfRow[12 * width + i] = fB * fB;
+                    }
+                }
+
+                for (auto k = 0; k < nStat; k++)
+                    BoxFilterRow(pfRow + k * width, pfSlot + k * width, width, nR);
 
-    delete[] pfInitN;
-    delete[] pfInitMeanIpR;
-    delete[] pfInitMeanIpG;
-    delete[] pfInitMeanIpB;
-    delete[] pfMeanP;
-
-    delete[] pfN;
-    delete[] pfMeanIr;
-    delete[] pfMeanIg;
-    delete[] pfMeanIb;
-    delete[] pfMeanIpR;
-    delete[] pfMeanIpG;
-    delete[] pfMeanIpB;
-    delete[] pfCovIpR;
-    delete[] pfCovIpG;
-    delete[] pfCovIpB;
-    delete[] pfCovEntire;
-    delete[] pfInitVarIrr;
-    delete[] pfInitVarIrg;
-    delete[] pfInitVarIrb;
-    delete[] pfInitVarIgg;
-    delete[] pfInitVarIgb;
-    delete[] pfInitVarIbb;
-    delete[] pfVarIrr;
-    delete[] pfVarIrg;
-    delete[] pfVarIrb;
-    delete[] pfVarIgg;
-    delete[] pfVarIgb;
-    delete[] pfVarIbb;
-    delete[] pfA1;
-    delete[] pfA2;
-    delete[] pfA3;
-    delete[] pfOutA1;
-    delete[] pfOutA2;
-    delete[] pfOutA3;
-    delete[] pfSigmaEntire;
-    delete[] pfB;
-    delete[] pfOutB;
-
-    delete[] pfImageR;
-    delete[] pfImageG;
-    delete[] pfImageB;
+                for (auto nIdx = 0; nIdx < nStat * width; nIdx++)
+                    pdStatSum[nIdx] += pfSlot[nIdx];
+            }
+
+            // Coefficient a and coefficient b of row nC
+            const int nCountY = std::min(nC + nR, height - 1) - std::max(nC - nR, 0) + 1;
+
+            if (m_LumaGuideFlag)
+            {
+                for (auto i = 0; i < width; i++)
+                {
+                    const double dScale = 1.0 / ((double)pnCountX[i] * nCountY);
+
+                    const double dMeanY = pdStatSum[i] * dScale;
+                    const double dMeanP = pdStatSum[width + i] * dScale;
+
+                    const float fCov = (float)(pdStatSum[2 * width + i] * dScale - dMeanY * dMeanP);
+                    const float fVar = (float)(pdStatSum[3 * width + i] * dScale - dMeanY * dMeanY) + fEps * 2.f;
+                    const float fA = fCov / fVar;
+
+                    pfRow[i] = fA;
+                    pfRow[width + i] = (float)(dMeanP - fA * dMeanY);
+                }
+            }
+            else
+            {
+                for (auto i = 0; i < width; i++)
+                {
+                    const double dScale = 1.0 / ((double)pnCountX[i] * nCountY);
+
+                    const double dMeanR = pdStatSum[i] * dScale;
+                    const double dMeanG = pdStatSum[width + i] * dScale;
+                    const double dMeanB = pdStatSum[2 * width + i] * dScale;
+                    const double dMeanP = pdStatSum[3 * width + i] * dScale;
+
+                    float afCov[3];
+                    afCov[0] = (float)(pdStatSum[4 * width + i] * dScale - dMeanR * dMeanP);
+                    afCov[1] = (float)(pdStatSum[5 * width + i] * dScale - dMeanG * dMeanP);
+                    afCov[2] = (float)(pdStatSum[6 * width + i] * dScale - dMeanB * dMeanP);
+
+                    float afSigma[9];
+                    afSigma[0] = (float)(pdStatSum[7 * width + i] * dScale - dMeanR * dMeanR) + fEps * 2.f;
+                    afSigma[1] = (float)(pdStatSum[8 * width + i] * dScale - dMeanR * dMeanG);
+                    afSigma[2] = (float)(pdStatSum[9 * width + i] * dScale - dMeanR * dMeanB);
+                    afSigma[3] = afSigma[1];
+                    afSigma[4] = (float)(pdStatSum[10 * width + i] * dScale - dMeanG * dMeanG) + fEps * 2.f;
+                    afSigma[5] = (float)(pdStatSum[11 * width + i] * dScale - dMeanG * dMeanB);
+                    afSigma[6] = afSigma[2];
+                    afSigma[7] = afSigma[5];
+                    afSigma[8] = (float)(pdStatSum[12 * width + i] * dScale - dMeanB * dMeanB) + fEps * 2.f;
+
+                    float fA1, fA2, fA3;
+                    CalcAcoeff(afSigma, afCov, &fA1, &fA2, &fA3, 0);
+
+                    pfRow[i] = fA1;
+                    pfRow[width + i] = fA2;
+                    pfRow[2 * width + i] = fA3;
+                    pfRow[3 * width + i] = (float)(dMeanP - fA1 * dMeanR - fA2 * dMeanG - fA3 * dMeanB);
+                }
+            }
+
+            float* pfSlot = pfCoefRing + (nC % nRing) * nCoef * width;
+            for (auto k = 0; k < nCoef; k++)
+                BoxFilterRow(pfRow + k * width, pfSlot + k * width, width, nR);
+
+            for (auto nIdx = 0; nIdx < nCoef * width; nIdx++)
+                pdCoefSum[nIdx] += pfSlot[nIdx];
+        }
+
+        // Transmission refinement of row nOut
+        const int nCountY = std::min(nOut + nR, height - 1) - std::max(nOut - nR, 0) + 1;
+
+        for (auto i = 0; i < width; i++)
+        {
+            const int nIdx = nOut * width + i;
+            const double dScale = 1.0 / ((double)pnCountX[i] * nCountY);
+
+            if (m_LumaGuideFlag)
+            {
+                ctx.m_pfTransmissionR[nIdx] = (float)((pdCoefSum[i] * ctx.m_pfYImg[nIdx] + pdCoefSum[width + i]) * dScale);
+                continue;
+            }
+
+            ctx.m_pfTransmissionR[nIdx] = (float)((pdCoefSum[i] * ctx.m_pfRImg[nIdx] + pdCoefSum[width + i] * ctx.m_pfGImg[nIdx]
+                + pdCoefSum[2 * width + i] * ctx.m_pfBImg[nIdx] + pdCoefSum[3 * width + i]) * dScale);
+        }
+    }
 }
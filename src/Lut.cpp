@@ -1,17 +1,20 @@
 #include <cmath>
+#include <map>
+#include <utility>
 
 #include "DehazingCE.hpp"
 
 /*
     Function: MakeExpLUT
     Description: Make a Look Up Table(LUT) for applying previous information.
+        The table is indexed by differences scaled to 8 bit.
 
     Return:
         ExpLUT - output table
 */
 void dehazing::MakeExpLUT()
 {
-    for (auto i = 0; i < peak + 1; i++)
+    for (auto i = 0; i < 256; i++)
     {
         ExpLUT[i] = exp(-(i * i) / 10.f);
     }
@@ -26,6 +29,9 @@ void dehazing::MakeExpLUT()
 */
 void dehazing::GuideLUTMaker()
 {
+    if (m_pfGuidedLUT == nullptr)
+        m_pfGuidedLUT = new float[GBlockSize * GBlockSize];
+
     for (auto nX = 0; nX < GBlockSize / 2; nX++)
     {
         for (auto nY = 0; nY < GBlockSize / 2; nY++)
@@ -51,17 +57,119 @@ void dehazing::GuideLUTMaker()
 
 /*
     Function: GammaLUTMaker
-    Description: Make a Look Up Table(LUT) for gamma correction
+    Description: Take the shared Look Up Table(LUT) for gamma correction, the table itself is built on first use
 
     parameter:
         fParameter - gamma value.
     Return:
-        m_pucGammaLUT - output table
+        m_pGammaLUT - shared table, integer input only
+        m_fGammaExp - exponent of the correction, for float input
 */
 void dehazing::GammaLUTMaker(float fParameter)
 {
-    for (auto i = 0; i < peak + 1; i++)
+    m_fGammaExp = 1.f / fParameter;
+
+    if (m_pGammaLUT != nullptr)
+        GammaLUT::Release(m_pGammaLUT);
+    m_pGammaLUT = bits == 32 ? nullptr : GammaLUT::Acquire(bits, fParameter);
+}
+
+// Tables in use, keyed by bit depth and gamma
+static std::mutex g_GammaLUTMutex;
+static std::map<std::pair<int, float>, GammaLUT*> g_GammaLUTs;
+
+GammaLUT::GammaLUT(int nBits, float fGamma)
+{
+    m_nBits = nBits;
+    m_fGamma = fGamma;
+    m_nRefCount = 0;
+    m_pTable = nullptr;
+}
+
+GammaLUT::~GammaLUT()
+{
+    delete[] m_pTable;
+}
+
+/*
+    Function: Acquire
+    Description: Get the table of a bit depth and gamma, creating it if no instance uses it yet
+*/
+GammaLUT* GammaLUT::Acquire(int nBits, float fGamma)
+{
+    std::lock_guard<std::mutex> lock(g_GammaLUTMutex);
+
+    GammaLUT*& pLUT = g_GammaLUTs[std::make_pair(nBits, fGamma)];
+    if (pLUT == nullptr)
+        pLUT = new GammaLUT(nBits, fGamma);
+    pLUT->m_nRefCount++;
+
+    return pLUT;
+}
+
+/*
+    Function: Release
+    Description: Drop a reference taken by Acquire, the last one frees the table
+*/
+void GammaLUT::Release(GammaLUT* pLUT)
+{
+    std::lock_guard<std::mutex> lock(g_GammaLUTMutex);
+
+    if (--pLUT->m_nRefCount == 0)
+    {
+        g_GammaLUTs.erase(std::make_pair(pLUT->m_nBits, pLUT->m_fGamma));
+        delete pLUT;
+    }
+}
+
+/*
+    Function: Build
+    Description: Fill the table, 8 bit depth holds 8 bit samples and higher depths 16 bit samples.
+        2 bytes of padding are kept for the 32 bit gathers of the SIMD kernels.
+*/
+void GammaLUT::Build()
+{
+    const int nPeak = (1 << m_nBits) - 1;
+    const int nSize = m_nBits == 8 ? 1 : 2;
+
+    m_pTable = new uint8_t[(nPeak + 1) * nSize + 2]();
+
+    for (auto i = 0; i < nPeak + 1; i++)
+    {
+        const float fValue = pow((i / (float)nPeak), 1.f / m_fGamma) * (float)nPeak;
+
+        if (nSize == 1)
+            m_pTable[i] = (uint8_t)fValue;
+        else
+            reinterpret_cast<uint16_t*>(m_pTable)[i] = (uint16_t)fValue;
+    }
+}
+
+/*
+    Function: RestoreLUTMaker
+    Description: Make the Look Up Tables(LUT) of the quantized transmission for RestoreImage.
+        The levels are spaced evenly in log scale between RESTORE_TRANS_MIN and 1,
+        so 1 / transmission has the same relative error at every level.
+
+    Return:
+        m_pfRestoreScale - 1 / transmission of each level
+        m_pnRestoreLevel - nearest level of each transmission bin in [0, 1]
+*/
+void dehazing::RestoreLUTMaker()
+{
+    const float fLogMin = log(RESTORE_TRANS_MIN);
+
+    for (auto nLevel = 0; nLevel < RESTORE_LEVELS; nLevel++)
+    {
+        m_pfRestoreScale[nLevel] = exp(-fLogMin * (1.f - nLevel / (float)(RESTORE_LEVELS - 1)));
+    }
+
+    for (auto nBin = 0; nBin < RESTORE_BINS; nBin++)
     {
-        m_pucGammaLUT[i] = pow((i / (float)peak), 1.f / fParameter) * (float)peak;
+        const float fTrans = nBin / (float)(RESTORE_BINS - 1);
+        if (fTrans <= RESTORE_TRANS_MIN)
+            m_pnRestoreLevel[nBin] = 0;
+        else
+            m_pnRestoreLevel[nBin] = (uint16_t)((1.f - log(fTrans) / fLogMin) * (RESTORE_LEVELS - 1) + 0.5f);
     }
 }
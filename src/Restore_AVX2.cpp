@@ -0,0 +1,126 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <immintrin.h>
+
+/*
+    Function: RestoreRow16_AVX2
+    Description: RestoreRow16_C on 8 samples at a time, the gamma table is read with a 32 bit gather and masked.
+ */
+void RestoreRow16_AVX2(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount,
+    const float* pfAirlight, const uint16_t* pnGammaLUT, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR)
+{
+    const __m256 vOne = _mm256_set1_ps(1.f);
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256 vTransMin = _mm256_set1_ps(RESTORE_TRANS_MIN);
+    const __m256 vPeak = _mm256_set1_ps((float)nPeak);
+    const __m256i vLowMask = _mm256_set1_epi32(0xFFFF);
+    const __m256 vAirlight[3] = { _mm256_set1_ps(pfAirlight[0]), _mm256_set1_ps(pfAirlight[1]), _mm256_set1_ps(pfAirlight[2]) };
+    const uint16_t* apnSrc[3] = { pnSrcB, pnSrcG, pnSrcR };
+    uint16_t* apnDst[3] = { pnDstB, pnDstG, pnDstR };
+
+    int i = 0;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        const __m256 vTrans = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(pfTrans + i), vTransMin), vOne);
+        const __m256 vScale = _mm256_div_ps(vOne, vTrans);
+
+        for (auto c = 0; c < 3; c++)
+        {
+            const __m256 vIn = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(apnSrc[c] + i))));
+            __m256 vOut = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(vIn, vAirlight[c]), vScale), vAirlight[c]);
+            vOut = _mm256_min_ps(_mm256_max_ps(vOut, vZero), vPeak);
+
+            const __m256i vResult = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(pnGammaLUT), _mm256_cvttps_epi32(vOut), 2), vLowMask);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(apnDst[c] + i),
+                _mm_packus_epi32(_mm256_castsi256_si128(vResult), _mm256_extracti128_si256(vResult, 1)));
+        }
+    }
+
+    if (i < nCount)
+        RestoreRow16_C(pnSrcB + i, pnSrcG + i, pnSrcR + i, pfTrans + i, nCount - i, pfAirlight, pnGammaLUT, nPeak, pnDstB + i, pnDstG + i, pnDstR + i);
+}
+
+/*
+    Function: RestoreTableGather_AVX2
+    Description: RestoreTableRow on 8 samples, the level and table entries are read with gathers.
+        The gathers read 32 bits, the tables are padded and only the low sizeof(T) bytes are kept.
+    Return:
+        vResult - restored samples of each channel, 32 bit lanes
+ */
+template <typename T>
+static inline void RestoreTableGather_AVX2(const T* const* apSrc, const __m256 vTrans, const uint16_t* pnLevel, const T* const* apTable,
+    int nPeak, int i, __m256i* vResult)
+{
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256 vOne = _mm256_set1_ps(1.f);
+    const __m256i vLowMask = _mm256_set1_epi32(sizeof(T) == 1 ? 0xFF : 0xFFFF);
+    const __m256i vPeak = _mm256_set1_epi32(nPeak);
+
+    const __m256 vBin = _mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(vTrans, vZero), vOne), _mm256_set1_ps((float)(RESTORE_BINS - 1))),
+        _mm256_set1_ps(0.5f));
+    const __m256i vLevel = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(pnLevel), _mm256_cvttps_epi32(vBin), 2), _mm256_set1_epi32(0xFFFF));
+    const __m256i vRow = _mm256_mullo_epi32(vLevel, _mm256_set1_epi32(nPeak + 1));
+
+    for (auto c = 0; c < 3; c++)
+    {
+        const __m256i vIn = sizeof(T) == 1 ?
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(apSrc[c] + i))) :
+            _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(apSrc[c] + i)));
+        const __m256i vIndex = _mm256_add_epi32(vRow, _mm256_min_epi32(vIn, vPeak));
+
+        vResult[c] = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(apTable[c]), vIndex, sizeof(T)), vLowMask);
+    }
+}
+
+void RestoreTableRow8_AVX2(const uint8_t* pnSrcB, const uint8_t* pnSrcG, const uint8_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint8_t* pnTableB, const uint8_t* pnTableG, const uint8_t* pnTableR, int nPeak, uint8_t* pnDstB, uint8_t* pnDstG, uint8_t* pnDstR)
+{
+    const uint8_t* apnSrc[3] = { pnSrcB, pnSrcG, pnSrcR };
+    const uint8_t* apnTable[3] = { pnTableB, pnTableG, pnTableR };
+    uint8_t* apnDst[3] = { pnDstB, pnDstG, pnDstR };
+
+    int i = 0;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        __m256i vResult[3];
+        RestoreTableGather_AVX2(apnSrc, _mm256_loadu_ps(pfTrans + i), pnLevel, apnTable, nPeak, i, vResult);
+
+        for (auto c = 0; c < 3; c++)
+        {
+            const __m128i vWord = _mm_packus_epi32(_mm256_castsi256_si128(vResult[c]), _mm256_extracti128_si256(vResult[c], 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(apnDst[c] + i), _mm_packus_epi16(vWord, vWord));
+        }
+    }
+
+    if (i < nCount)
+        RestoreTableRow8_C(pnSrcB + i, pnSrcG + i, pnSrcR + i, pfTrans + i, nCount - i, pnLevel, pnTableB, pnTableG, pnTableR, nPeak, pnDstB + i, pnDstG + i, pnDstR + i);
+}
+
+void RestoreTableRow16_AVX2(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint16_t* pnTableB, const uint16_t* pnTableG, const uint16_t* pnTableR, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR)
+{
+    const uint16_t* apnSrc[3] = { pnSrcB, pnSrcG, pnSrcR };
+    const uint16_t* apnTable[3] = { pnTableB, pnTableG, pnTableR };
+    uint16_t* apnDst[3] = { pnDstB, pnDstG, pnDstR };
+
+    int i = 0;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        __m256i vResult[3];
+        RestoreTableGather_AVX2(apnSrc, _mm256_loadu_ps(pfTrans + i), pnLevel, apnTable, nPeak, i, vResult);
+
+        for (auto c = 0; c < 3; c++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(apnDst[c] + i),
+                _mm_packus_epi32(_mm256_castsi256_si128(vResult[c]), _mm256_extracti128_si256(vResult[c], 1)));
+        }
+    }
+
+    if (i < nCount)
+        RestoreTableRow16_C(pnSrcB + i, pnSrcG + i, pnSrcR + i, pfTrans + i, nCount - i, pnLevel, pnTableB, pnTableG, pnTableR, nPeak, pnDstB + i, pnDstG + i, pnDstR + i);
+}
+
+#endif
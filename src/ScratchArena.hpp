@@ -0,0 +1,64 @@
+#ifndef SCRATCHARENA_HPP_
+#define SCRATCHARENA_HPP_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+// Bump allocator for the temporary planes of one frame. The buffer is allocated once, slices are handed out
+// in order and released all at once by rewinding to an earlier mark, so a frame makes no heap allocation.
+// A view on part of another arena does not own its buffer, it gives each thread of a stage its own slices.
+class ScratchArena
+{
+public:
+    static const size_t ALIGNMENT = 64;
+
+    explicit ScratchArena(size_t nSize) : m_nSize(nSize), m_nUsed(0), m_bOwner(true)
+    {
+        m_pAllocation = new uint8_t[nSize + ALIGNMENT];
+        m_pBuffer = m_pAllocation + (ALIGNMENT - reinterpret_cast<uintptr_t>(m_pAllocation) % ALIGNMENT) % ALIGNMENT;
+    }
+
+    ScratchArena(uint8_t* pBuffer, size_t nSize) : m_pAllocation(nullptr), m_pBuffer(pBuffer), m_nSize(nSize), m_nUsed(0), m_bOwner(false) {}
+
+    ~ScratchArena()
+    {
+        if (m_bOwner)
+            delete[] m_pAllocation;
+    }
+
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    // Bytes taken by a slice of nCount elements, sizes of arenas are sums of these
+    template <typename T>
+    static size_t Bytes(size_t nCount)
+    {
+        return (nCount * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    // Uninitialized slice of nCount elements, aligned to ALIGNMENT
+    template <typename T>
+    T* Alloc(size_t nCount)
+    {
+        const size_t nBytes = Bytes<T>(nCount);
+        assert(m_nUsed + nBytes <= m_nSize);
+
+        T* pSlice = reinterpret_cast<T*>(m_pBuffer + m_nUsed);
+        m_nUsed += nBytes;
+        return pSlice;
+    }
+
+    size_t Mark() const { return m_nUsed; }
+    void Rewind(size_t nMark) { m_nUsed = nMark; }
+    void Reset() { m_nUsed = 0; }
+
+private:
+    uint8_t* m_pAllocation;
+    uint8_t* m_pBuffer;
+    size_t m_nSize;
+    size_t m_nUsed;
+    bool m_bOwner;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef SIMD_HPP_
+#define SIMD_HPP_
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DEHAZING_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+enum SimdLevel
+{
+    SIMD_NONE = 0,
+    SIMD_SSE41 = 1,
+    SIMD_AVX2 = 2
+};
+
+// One pass of BoxFilter over a width x height region of arrays with a row stride of stride floats.
+// pfArrayCum is scratch of the same layout, pfInArray and pfOutArray may alias
+typedef void (*BoxFilterPass)(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+
+// Number of transmission candidates evaluated by one TransCostRow call
+constexpr int TRANS_CANDIDATES = 8;
+
+// Cost terms of one block row for all transmission candidates, see TransCostRow_C
+typedef void (*TransCostRow)(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare);
+
+// Lower bound of the transmission when restoring, also the lowest level of the restore tables
+constexpr float RESTORE_TRANS_MIN = 1.f / 32;
+
+// Levels of the quantized transmission in the restore tables, and bins mapping a transmission in [0, 1] to its level
+constexpr int RESTORE_LEVELS = 512;
+constexpr int RESTORE_BINS = 4096;
+
+// Restore one row of 16 bit samples by multiplying with the reciprocal of the transmission, see RestoreRow16_C
+typedef void (*RestoreRow16)(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount,
+    const float* pfAirlight, const uint16_t* pnGammaLUT, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+
+// Restore one row of 8-10 bit samples from the restore tables, see RestoreTableRow in DehazingCE.cpp
+typedef void (*RestoreTableRow8)(const uint8_t* pnSrcB, const uint8_t* pnSrcG, const uint8_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint8_t* pnTableB, const uint8_t* pnTableG, const uint8_t* pnTableR, int nPeak, uint8_t* pnDstB, uint8_t* pnDstG, uint8_t* pnDstR);
+typedef void (*RestoreTableRow16)(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint16_t* pnTableB, const uint16_t* pnTableG, const uint16_t* pnTableR, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+
+// Add one row of samples to the column sums of the ref downscaler, see AccumulateRow_C in DehazingCE.cpp
+typedef void (*AccumulateRow8)(const uint8_t* pnSrc, int nCount, uint32_t* pnSum);
+typedef void (*AccumulateRow16)(const uint16_t* pnSrc, int nCount, uint32_t* pnSum);
+
+void BoxFilterVertical_C(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void BoxFilterHorizontal_C(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void TransCostRow_C(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare);
+void RestoreRow16_C(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount,
+    const float* pfAirlight, const uint16_t* pnGammaLUT, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+void RestoreTableRow8_C(const uint8_t* pnSrcB, const uint8_t* pnSrcG, const uint8_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint8_t* pnTableB, const uint8_t* pnTableG, const uint8_t* pnTableR, int nPeak, uint8_t* pnDstB, uint8_t* pnDstG, uint8_t* pnDstR);
+void RestoreTableRow16_C(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint16_t* pnTableB, const uint16_t* pnTableG, const uint16_t* pnTableR, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+void AccumulateRow8_C(const uint8_t* pnSrc, int nCount, uint32_t* pnSum);
+void AccumulateRow16_C(const uint16_t* pnSrc, int nCount, uint32_t* pnSum);
+
+#if defined(DEHAZING_X86)
+void BoxFilterVertical_SSE41(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void BoxFilterHorizontal_SSE41(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void BoxFilterVertical_AVX2(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void BoxFilterHorizontal_AVX2(const float* pfInArray, float* pfArrayCum, float* pfOutArray, int width, int height, int stride, int nR);
+void TransCostRow_SSE41(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare);
+void TransCostRow_AVX2(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare);
+void RestoreRow16_AVX2(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount,
+    const float* pfAirlight, const uint16_t* pnGammaLUT, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+void RestoreTableRow8_AVX2(const uint8_t* pnSrcB, const uint8_t* pnSrcG, const uint8_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint8_t* pnTableB, const uint8_t* pnTableG, const uint8_t* pnTableR, int nPeak, uint8_t* pnDstB, uint8_t* pnDstG, uint8_t* pnDstR);
+void RestoreTableRow16_AVX2(const uint16_t* pnSrcB, const uint16_t* pnSrcG, const uint16_t* pnSrcR, const float* pfTrans, int nCount, const uint16_t* pnLevel,
+    const uint16_t* pnTableB, const uint16_t* pnTableG, const uint16_t* pnTableR, int nPeak, uint16_t* pnDstB, uint16_t* pnDstG, uint16_t* pnDstR);
+void AccumulateRow8_AVX2(const uint8_t* pnSrc, int nCount, uint32_t* pnSum);
+void AccumulateRow16_AVX2(const uint16_t* pnSrc, int nCount, uint32_t* pnSum);
+#endif
+
+// Highest instruction set supported by both the CPU and the OS
+static inline SimdLevel GetSimdLevel()
+{
+#if defined(DEHAZING_X86)
+#if defined(_MSC_VER)
+    int anInfo[4];
+
+    __cpuid(anInfo, 0);
+    const int nIds = anInfo[0];
+
+    __cpuid(anInfo, 1);
+    const bool bSSE41 = (anInfo[2] & (1 << 19)) != 0;
+    const bool bAVX = (anInfo[2] & (1 << 28)) != 0 && (anInfo[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+
+    if (bAVX && nIds >= 7)
+    {
+        __cpuidex(anInfo, 7, 0);
+        if (anInfo[1] & (1 << 5))
+            return SIMD_AVX2;
+    }
+    if (bSSE41)
+        return SIMD_SSE41;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#endif
+#endif
+    return SIMD_NONE;
+}
+
+#endif
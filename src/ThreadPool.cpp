@@ -0,0 +1,97 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(int nThreads)
+{
+    m_nThreads = nThreads < 1 ? 1 : nThreads;
+    m_bStop = false;
+
+    // The thread calling Run is the last worker
+    for (auto i = 1; i < m_nThreads; i++)
+        m_Workers.emplace_back(&ThreadPool::Worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_bStop = true;
+    }
+    m_cvWork.notify_all();
+
+    for (auto& worker : m_Workers)
+        worker.join();
+}
+
+/*
+    Function: RunNext
+    Description: take the next task of a batch and run it with the lock released.
+        The batch leaves the queue when its last task is taken.
+    Return:
+        false if every task of the batch was already taken
+ */
+bool ThreadPool::RunNext(std::unique_lock<std::mutex>& lock, Batch& batch)
+{
+    if (batch.nNext >= batch.nTasks)
+        return false;
+
+    const int nTask = batch.nNext++;
+    if (batch.nNext == batch.nTasks)
+    {
+        for (auto it = m_Queue.begin(); it != m_Queue.end(); ++it)
+        {
+            if (*it == &batch)
+            {
+                m_Queue.erase(it);
+                break;
+            }
+        }
+    }
+
+    lock.unlock();
+    (*batch.pfnTask)(nTask);
+    lock.lock();
+
+    if (++batch.nDone == batch.nTasks)
+        batch.cvDone.notify_all();
+
+    return true;
+}
+
+void ThreadPool::Worker()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    for (;;)
+    {
+        m_cvWork.wait(lock, [this] { return m_bStop || !m_Queue.empty(); });
+        if (m_Queue.empty())
+            return;
+
+        RunNext(lock, *m_Queue.front());
+    }
+}
+
+void ThreadPool::Run(int nTasks, const std::function<void(int)>& fnTask)
+{
+    if (nTasks <= 1 || m_Workers.empty())
+    {
+        for (auto i = 0; i < nTasks; i++)
+            fnTask(i);
+        return;
+    }
+
+    Batch batch;
+    batch.pfnTask = &fnTask;
+    batch.nTasks = nTasks;
+    batch.nNext = 0;
+    batch.nDone = 0;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Queue.push_back(&batch);
+    m_cvWork.notify_all();
+
+    while (RunNext(lock, batch))
+        ;
+
+    batch.cvDone.wait(lock, [&batch] { return batch.nDone == batch.nTasks; });
+}
@@ -0,0 +1,46 @@
+#ifndef THREADPOOL_HPP_
+#define THREADPOOL_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads running the strips of one frame. Several frames may submit work at the same time,
+// the submitting thread always takes part in its own batch so a batch never waits for a free worker.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int nThreads);
+    ~ThreadPool();
+
+    int Threads() const { return m_nThreads; }
+
+    // Run fnTask(0) ... fnTask(nTasks - 1) and return when all of them are done
+    void Run(int nTasks, const std::function<void(int)>& fnTask);
+
+private:
+    struct Batch
+    {
+        const std::function<void(int)>* pfnTask;
+        int nTasks;
+        int nNext;
+        int nDone;
+        std::condition_variable cvDone;
+    };
+
+    void Worker();
+    bool RunNext(std::unique_lock<std::mutex>& lock, Batch& batch);
+
+    int m_nThreads;
+    bool m_bStop;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_cvWork;
+    std::deque<Batch*> m_Queue;
+    std::vector<std::thread> m_Workers;
+};
+
+#endif
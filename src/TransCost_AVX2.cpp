@@ -0,0 +1,48 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <immintrin.h>
+
+/*
+    Function: TransCostRow_AVX2
+    Description: TransCostRow_C with the candidates in the 8 lanes of one vector.
+ */
+void TransCostRow_AVX2(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare)
+{
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256 vPeak = _mm256_set1_ps(fPeak);
+    const __m256 vScale = _mm256_loadu_ps(pfScale);
+    const __m256 vAirlight[3] = { _mm256_set1_ps(pfAirlight[0]), _mm256_set1_ps(pfAirlight[1]), _mm256_set1_ps(pfAirlight[2]) };
+    const float* apfIn[3] = { pfB, pfG, pfR };
+
+    __m256 vLoss = vZero;
+    __m256 vSum = vZero;
+    __m256 vSquare = vZero;
+
+    for (auto i = 0; i < nCount; i++)
+    {
+        for (auto c = 0; c < nChannels; c++)
+        {
+            const __m256 vOut = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(apfIn[c][i] - pfAirlight[c]), vScale), vAirlight[c]);
+            const __m256 vOver = _mm256_max_ps(_mm256_sub_ps(vOut, vPeak), vZero);
+            const __m256 vUnder = _mm256_min_ps(vOut, vZero);
+
+            vLoss = _mm256_add_ps(vLoss, _mm256_add_ps(_mm256_mul_ps(vOver, vOver), _mm256_mul_ps(vUnder, vUnder)));
+            vSum = _mm256_add_ps(vSum, vOut);
+            vSquare = _mm256_add_ps(vSquare, _mm256_mul_ps(vOut, vOut));
+        }
+    }
+
+    _mm256_storeu_pd(pdLoss, _mm256_add_pd(_mm256_loadu_pd(pdLoss), _mm256_cvtps_pd(_mm256_castps256_ps128(vLoss))));
+    _mm256_storeu_pd(pdLoss + 4, _mm256_add_pd(_mm256_loadu_pd(pdLoss + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(vLoss, 1))));
+    _mm256_storeu_pd(pdSum, _mm256_add_pd(_mm256_loadu_pd(pdSum), _mm256_cvtps_pd(_mm256_castps256_ps128(vSum))));
+    _mm256_storeu_pd(pdSum + 4, _mm256_add_pd(_mm256_loadu_pd(pdSum + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(vSum, 1))));
+    _mm256_storeu_pd(pdSquare, _mm256_add_pd(_mm256_loadu_pd(pdSquare), _mm256_cvtps_pd(_mm256_castps256_ps128(vSquare))));
+    _mm256_storeu_pd(pdSquare + 4, _mm256_add_pd(_mm256_loadu_pd(pdSquare + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(vSquare, 1))));
+
+    _mm256_zeroupper();
+}
+
+#endif
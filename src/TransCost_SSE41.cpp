@@ -0,0 +1,62 @@
+#include "Simd.hpp"
+
+#if defined(DEHAZING_X86)
+
+#include <smmintrin.h>
+
+/*
+    Function: TransCostRow_SSE41
+    Description: TransCostRow_C with the candidates in two vectors of 4 lanes.
+ */
+void TransCostRow_SSE41(const float* pfB, const float* pfG, const float* pfR, int nChannels, int nCount, const float* pfAirlight, const float* pfScale, float fPeak,
+    double* pdLoss, double* pdSum, double* pdSquare)
+{
+    const __m128 vZero = _mm_setzero_ps();
+    const __m128 vPeak = _mm_set1_ps(fPeak);
+    const __m128 vScale[2] = { _mm_loadu_ps(pfScale), _mm_loadu_ps(pfScale + 4) };
+    const __m128 vAirlight[3] = { _mm_set1_ps(pfAirlight[0]), _mm_set1_ps(pfAirlight[1]), _mm_set1_ps(pfAirlight[2]) };
+    const float* apfIn[3] = { pfB, pfG, pfR };
+
+    __m128 vLoss[2] = { vZero, vZero };
+    __m128 vSum[2] = { vZero, vZero };
+    __m128 vSquare[2] = { vZero, vZero };
+
+    for (auto i = 0; i < nCount; i++)
+    {
+        for (auto c = 0; c < nChannels; c++)
+        {
+            const __m128 vDiff = _mm_set1_ps(apfIn[c][i] - pfAirlight[c]);
+
+            for (auto h = 0; h < 2; h++)
+            {
+                const __m128 vOut = _mm_add_ps(_mm_mul_ps(vDiff, vScale[h]), vAirlight[c]);
+                const __m128 vOver = _mm_max_ps(_mm_sub_ps(vOut, vPeak), vZero);
+                const __m128 vUnder = _mm_min_ps(vOut, vZero);
+
+                vLoss[h] = _mm_add_ps(vLoss[h], _mm_add_ps(_mm_mul_ps(vOver, vOver), _mm_mul_ps(vUnder, vUnder)));
+                vSum[h] = _mm_add_ps(vSum[h], vOut);
+                vSquare[h] = _mm_add_ps(vSquare[h], _mm_mul_ps(vOut, vOut));
+            }
+        }
+    }
+
+    for (auto h = 0; h < 2; h++)
+    {
+        for (auto l = 0; l < 2; l++)
+        {
+            double* pdL = pdLoss + h * 4 + l * 2;
+            double* pdS = pdSum + h * 4 + l * 2;
+            double* pdQ = pdSquare + h * 4 + l * 2;
+
+            const __m128 vL = l ? _mm_movehl_ps(vLoss[h], vLoss[h]) : vLoss[h];
+            const __m128 vS = l ? _mm_movehl_ps(vSum[h], vSum[h]) : vSum[h];
+            const __m128 vQ = l ? _mm_movehl_ps(vSquare[h], vSquare[h]) : vSquare[h];
+
+            _mm_storeu_pd(pdL, _mm_add_pd(_mm_loadu_pd(pdL), _mm_cvtps_pd(vL)));
+            _mm_storeu_pd(pdS, _mm_add_pd(_mm_loadu_pd(pdS), _mm_cvtps_pd(vS)));
+            _mm_storeu_pd(pdQ, _mm_add_pd(_mm_loadu_pd(pdQ), _mm_cvtps_pd(vQ)));
+        }
+    }
+}
+
+#endif
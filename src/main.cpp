@@ -1,98 +1,468 @@
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "AnalysisCache.hpp"
 #include "DehazingCE.hpp"
 #include "DehazingCE.cpp"
 
+// Functions registered by the plugin, passed to filterCreate as user data
+enum FilterMode
+{
+    MODE_DEHAZE,          // Dehazing: restored clip
+    MODE_TRANSMISSION,    // Transmission: refined transmission as a gray clip
+    MODE_RESTORE          // Restore: restored clip from the transmission of an analysis pass
+};
+
 struct FilterData
 {
     VSNodeRef* node;
     const VSVideoInfo* vi;
+    VSVideoInfo out_vi;
     VSNodeRef* rnode;
     const VSVideoInfo* rvi;
     bool rdef;
     dehazing* dehazing_clip;
+
+    // YUV input, the transmission is estimated and refined on the luma
+    bool yuv;
+
+    // The ref is made from src by the internal downscaler, at the size given by ref_width and ref_height or ref_scale
+    bool downscale;
+
+    // Pool of per-frame working states, grows to the number of frames in flight
+    std::mutex ctx_mutex;
+    std::vector<DehazeContext*> ctx_pool;
+
+    // Temporal coherence mode, frames are processed in order and each one reads the state of the previous
+    bool temporal;
+    TemporalState* temporal_state = nullptr;
+
+    // Airlight cache, refreshed on a scene change, after a seek or every air_interval frames (0: every frame)
+    int air_interval;
+    int air_frame = -1;     // Last frame that read the cache
+    int air_age = 0;        // Frames since the last refresh
+    bool air_cut = false;   // _SceneChangeNext of air_frame
+    float air[3];
+
+    FilterMode mode;
+
+    // Airlight and block transmission of each frame kept in a file, nullptr without cache_file
+    AnalysisCache* cache = nullptr;
+
+    // Restore mode: transmission clip, and airlight (B, G, R, or V, U, Y) given by the user instead of the frame properties
+    VSNodeRef* tnode = nullptr;
+    bool air_def = false;
+    float air_value[3];
+
+    // Attach the stage timings, airlight and mean transmission to each output frame
+    bool stats;
 };
 
+// Frame properties of the stage timings, in the order of DehazeStage
+static const char* const STAGE_PROPS[STAGE_COUNT] = {
+    "DehazeTimeAirlight",
+    "DehazeTimeTransmission",
+    "DehazeTimeUpsample",
+    "DehazeTimeGuidedFilter",
+    "DehazeTimeRestore",
+    "DehazeTimePostProcessing"
+};
+
+// Weight of a periodic estimate against the cached airlight
+constexpr float AIR_SMOOTH = 0.5f;
+
+static DehazeContext* acquireContext(FilterData* d)
+{
+    {
+        std::lock_guard<std::mutex> lock(d->ctx_mutex);
+        if (!d->ctx_pool.empty())
+        {
+            DehazeContext* ctx = d->ctx_pool.back();
+            d->ctx_pool.pop_back();
+            return ctx;
+        }
+    }
+
+    return d->dehazing_clip->CreateContext();
+}
+
+static void releaseContext(FilterData* d, DehazeContext* ctx)
+{
+    std::lock_guard<std::mutex> lock(d->ctx_mutex);
+    d->ctx_pool.push_back(ctx);
+}
+
 static void VS_CC filterInit(VSMap* in, VSMap* out, void** instanceData, VSNode* node, VSCore* core, const VSAPI* vsapi)
 {
     FilterData* d = static_cast<FilterData*>(*instanceData);
-    vsapi->setVideoInfo(d->vi, 1, node);
+    vsapi->setVideoInfo(&d->out_vi, 1, node);
+}
+
+template<typename T>
+static void estimateAirlight(const VSFrameRef* src, DehazeContext* ctx, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    const int stride = vsapi->getStride(src, 0) / sizeof(T);
+
+    const T* srcp0 = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 0));
+    const T* srcp1 = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 1));
+    const T* srcp2 = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 2));
+
+    if (d->yuv)
+        d->dehazing_clip->AirlightEstimationYUV(*ctx, srcp0, srcp1, srcp2, stride, vsapi->getStride(src, 1) / sizeof(T));
+    else
+        d->dehazing_clip->AirlightEstimation(*ctx, srcp2, srcp1, srcp0, stride);
 }
 
 template<typename T>
-static void process(const VSFrameRef* src, const VSFrameRef* ref, VSFrameRef* dst, const FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+static void airlight(int n, const VSFrameRef* src, DehazeContext* ctx, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
 {
-    int width = vsapi->getFrameWidth(src, 0);
-    int height = vsapi->getFrameHeight(src, 0);
-    int stride = vsapi->getStride(dst, 0) / sizeof(T);
+    if (d->air_interval == 0)
+    {
+        estimateAirlight<T>(src, ctx, d, vsapi);
+        return;
+    }
+
+    const VSMap* props = vsapi->getFramePropsRO(src);
+    int err;
+
+    // A new shot or a seek discards the cached value, a periodic refresh is blended into it
+    const bool reset = d->air_frame < 0 || d->air_frame != n - 1 || d->air_cut ||
+                       vsapi->propGetInt(props, "_SceneChangePrev", 0, &err) != 0;
+
+    if (reset || d->air_age >= d->air_interval)
+    {
+        estimateAirlight<T>(src, ctx, d, vsapi);
+        for (auto c = 0; c < 3; c++)
+            d->air[c] = reset ? ctx->m_afAirlight[c] : AIR_SMOOTH * ctx->m_afAirlight[c] + (1.f - AIR_SMOOTH) * d->air[c];
+        d->air_age = 0;
+    }
+
+    for (auto c = 0; c < 3; c++)
+        ctx->m_afAirlight[c] = d->air[c];
+
+    d->air_age++;
+    d->air_frame = n;
+    d->air_cut = vsapi->propGetInt(props, "_SceneChangeNext", 0, &err) != 0;
+}
+
+// A frame read from the cache file keeps the airlight cache in step, as if it had been estimated
+static void cachedAirlight(int n, const VSFrameRef* src, const DehazeContext* ctx, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    if (d->air_interval == 0)
+        return;
+
+    int err;
+    for (auto c = 0; c < 3; c++)
+        d->air[c] = ctx->m_afAirlight[c];
+
+    d->air_age++;
+    d->air_frame = n;
+    d->air_cut = vsapi->propGetInt(vsapi->getFramePropsRO(src), "_SceneChangeNext", 0, &err) != 0;
+}
+
+// Planes B, G, R of the ref and their stride, from the ref clip or made from it by the internal downscaler.
+// YUV input passes its luma in the places of R, G and B
+template<typename T>
+static int refPlanes(const VSFrameRef* ref, DehazeContext* ctx, FilterData* const VS_RESTRICT d, const VSAPI* vsapi, const T* (&refp)[3]) noexcept
+{
+    const int stride = vsapi->getStride(ref, 0) / sizeof(T);
+
+    refp[2] = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, 0));
+    refp[1] = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, d->yuv ? 0 : 1));
+    refp[0] = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, d->yuv ? 0 : 2));
+
+    if (!d->downscale)
+        return stride;
+
+    d->dehazing_clip->DownscaleRef(*ctx, refp[0], refp[1], refp[2], stride);
+    for (auto c = 0; c < 3; c++)
+        refp[c] = d->dehazing_clip->RefPlane<T>(*ctx, c);
+
+    return d->dehazing_clip->RefStride();
+}
+
+// Airlight and block transmission of frame n, read from the cache file when an earlier run analysed it
+template<typename T>
+static void analyze(int n, const VSFrameRef* src, const VSFrameRef* ref, DehazeContext* ctx, const TemporalState* prev,
+    FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    const T* refp[3];
+    const int ref_stride = refPlanes(ref, ctx, d, vsapi, refp);
+    const T* refpB = refp[0];
+    const T* refpG = refp[1];
+    const T* refpR = refp[2];
+
+    if (d->cache && d->cache->Load(n, ctx->m_afAirlight, ctx->m_pfSmallTrans))
+    {
+        cachedAirlight(n, src, ctx, d, vsapi);
+        d->dehazing_clip->ReuseTransmission(*ctx, refpB, refpG, refpR, ref_stride);
+        return;
+    }
+
+    airlight<T>(n, src, ctx, d, vsapi);
+    d->dehazing_clip->EstimateTransmission(*ctx, refpB, refpG, refpR, ref_stride, prev);
+
+    if (d->cache)
+        d->cache->Store(n, ctx->m_afAirlight, ctx->m_pfSmallTrans);
+}
+
+template<typename T>
+static void analyzePrevious(int n, const VSFrameRef* src, const VSFrameRef* ref, DehazeContext* ctx, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    const T* refp[3];
+    const int ref_stride = refPlanes(ref, ctx, d, vsapi, refp);
+    const T* refpB = refp[0];
+    const T* refpG = refp[1];
+    const T* refpR = refp[2];
+
+    // Without the state of frame n - 1 the estimate differs from a linear pass, so it is not written to the cache
+    if (d->cache && d->cache->Load(n, ctx->m_afAirlight, ctx->m_pfSmallTrans))
+    {
+        d->dehazing_clip->ReuseTransmission(*ctx, refpB, refpG, refpR, ref_stride);
+    }
+    else
+    {
+        estimateAirlight<T>(src, ctx, d, vsapi);
+        d->dehazing_clip->EstimateTransmission(*ctx, refpB, refpG, refpR, ref_stride, nullptr);
+    }
+    d->dehazing_clip->StoreTemporalState(*ctx, *d->temporal_state, n);
+}
+
+// Airlight in plane order (R, G, B, or Y, U, V)
+static void writeAirlight(VSMap* props, const DehazeContext* ctx, const VSAPI* vsapi)
+{
+    for (auto c = 2; c >= 0; c--)
+        vsapi->propSetFloat(props, "DehazeAirlight", ctx->m_afAirlight[c], c == 2 ? paReplace : paAppend);
+}
+
+static void writeStats(VSFrameRef* dst, const DehazeContext* ctx, int64_t total, FilterData* const VS_RESTRICT d, const VSAPI* vsapi)
+{
+    VSMap* props = vsapi->getFramePropsRW(dst);
+
+    for (auto stage = 0; stage < STAGE_COUNT; stage++)
+        vsapi->propSetInt(props, STAGE_PROPS[stage], ctx->m_anStageTime[stage], paReplace);
+    vsapi->propSetInt(props, "DehazeTimeTotal", total, paReplace);
+
+    writeAirlight(props, ctx, vsapi);
+    vsapi->propSetFloat(props, "DehazeTransmission", d->dehazing_clip->MeanTransmission(*ctx), paReplace);
+    vsapi->propSetInt(props, "DehazeMemory", (int64_t)d->dehazing_clip->FrameFootprint(d->dehazing_clip->StripHeight()), paReplace);
+}
+
+// Transmission and airlight of an analysis pass, read back by the restore mode
+static void readTransmission(const VSFrameRef* trans, DehazeContext* ctx, const VSAPI* vsapi)
+{
+    const int width = vsapi->getFrameWidth(trans, 0);
+    const int height = vsapi->getFrameHeight(trans, 0);
+    const int stride = vsapi->getStride(trans, 0);
+    const uint8_t* transp = vsapi->getReadPtr(trans, 0);
+
+    for (auto j = 0; j < height; j++)
+    {
+        float* pfTrans = ctx->m_pfTransmissionR + j * width;
+
+        if (vsapi->getFrameFormat(trans)->sampleType == stFloat)
+        {
+            const float* pfSrc = reinterpret_cast<const float*>(transp + j * stride);
+            std::copy(pfSrc, pfSrc + width, pfTrans);
+        }
+        else
+        {
+            const uint16_t* pnSrc = reinterpret_cast<const uint16_t*>(transp + j * stride);
+            for (auto i = 0; i < width; i++)
+                pfTrans[i] = pnSrc[i] / 65535.f;
+        }
+    }
+}
+
+// Refined transmission as float, or scaled from [0, 1] to [0, 65535] for 16 bit output
+static void writeTransmission(VSFrameRef* dst, const DehazeContext* ctx, const VSAPI* vsapi)
+{
+    const int width = vsapi->getFrameWidth(dst, 0);
+    const int height = vsapi->getFrameHeight(dst, 0);
+    const int stride = vsapi->getStride(dst, 0);
+    uint8_t* dstp = vsapi->getWritePtr(dst, 0);
+
+    for (auto j = 0; j < height; j++)
+    {
+        const float* pfTrans = ctx->m_pfTransmissionR + j * width;
+
+        if (vsapi->getFrameFormat(dst)->sampleType == stFloat)
+        {
+            std::copy(pfTrans, pfTrans + width, reinterpret_cast<float*>(dstp + j * stride));
+        }
+        else
+        {
+            uint16_t* pnDst = reinterpret_cast<uint16_t*>(dstp + j * stride);
+            for (auto i = 0; i < width; i++)
+                pnDst[i] = (uint16_t)(clamp(pfTrans[i], 0.f, 1.f) * 65535.f + 0.5f);
+        }
+    }
+
+    writeAirlight(vsapi->getFramePropsRW(dst), ctx, vsapi);
+}
+
+template<typename T>
+static void process(int n, const VSFrameRef* src, const VSFrameRef* ref, const VSFrameRef* prev_src, const VSFrameRef* prev_ref,
+    VSFrameRef* dst, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    const int src_stride = vsapi->getStride(src, 0) / sizeof(T);
 
-    // Convert RGB to 1-D ararry
     const T* srcpR = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 0));
     const T* srcpG = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 1));
     const T* srcpB = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 2));
 
-    const T* refpR = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, 0));
-    const T* refpG = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, 1));
-    const T* refpB = reinterpret_cast<const T*>(vsapi->getReadPtr(ref, 2));
+    DehazeContext* ctx = acquireContext(d);
+    const auto start = std::chrono::steady_clock::now();
 
-    // Interleaved
-    T* srcInterleaved = new (std::nothrow) T[(d->vi->width) * d->vi->height * 3];
-    T* dstInterleaved = new (std::nothrow) T[(d->vi->width) * d->vi->height * 3];
+    const TemporalState* prev = nullptr;
+    if (d->temporal && n > 0)
+    {
+        // After a seek the state belongs to another frame, rebuild it from frame n - 1
+        if (d->temporal_state->m_nFrame != n - 1)
+            analyzePrevious<T>(n - 1, prev_src, prev_ref, ctx, d, vsapi);
+        prev = d->temporal_state;
+    }
 
-    for (auto y = 0; y < height; y++)
+    // The cached airlight or transmission skips the estimation, its stage then reports 0
+    std::fill(ctx->m_anStageTime, ctx->m_anStageTime + STAGE_COUNT, 0);
+
+    analyze<T>(n, src, ref, ctx, prev, d, vsapi);
+    if (d->yuv)
+        d->dehazing_clip->RefineTransmission(*ctx, srcpR, srcpR, srcpR, src_stride);
+    else
+        d->dehazing_clip->RefineTransmission(*ctx, srcpB, srcpG, srcpR, src_stride);
+
+    if (d->mode == MODE_TRANSMISSION)
     {
-        for (auto x = 0; x < width; x++)
-        {
-            const auto pos = (x + y * width) * 3;
-            srcInterleaved[pos] = srcpB[x];
-            srcInterleaved[pos + 1] = srcpG[x];
-            srcInterleaved[pos + 2] = srcpR[x];
-        }
-        srcpB += stride;
-        srcpG += stride;
-        srcpR += stride;
+        writeTransmission(dst, ctx, vsapi);
     }
+    else
+    {
+        const int dst_stride = vsapi->getStride(dst, 0) / sizeof(T);
+
+        T* VS_RESTRICT dstpR = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
+        T* VS_RESTRICT dstpG = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 1));
+        T* VS_RESTRICT dstpB = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 2));
 
-    d->dehazing_clip->RemoveHaze((const T*)srcInterleaved, refpB, refpG, refpR, dstInterleaved, stride);
+        if (d->yuv)
+            d->dehazing_clip->RestoreImageYUV(*ctx, srcpR, srcpG, srcpB, src_stride, vsapi->getStride(src, 1) / (int)sizeof(T),
+                dstpR, dstpG, dstpB, dst_stride, vsapi->getStride(dst, 1) / (int)sizeof(T));
+        else
+            d->dehazing_clip->RestoreImage(*ctx, srcpB, srcpG, srcpR, src_stride, dstpB, dstpG, dstpR, dst_stride);
+    }
+
+    if (d->temporal)
+        d->dehazing_clip->StoreTemporalState(*ctx, *d->temporal_state, n);
+
+    if (d->stats)
+        writeStats(dst, ctx, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), d, vsapi);
+
+    releaseContext(d, ctx);
+}
+
+template<typename T>
+static void restore(const VSFrameRef* src, const VSFrameRef* trans, const float* air, VSFrameRef* dst, FilterData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+{
+    const int src_stride = vsapi->getStride(src, 0) / sizeof(T);
+    const int dst_stride = vsapi->getStride(dst, 0) / sizeof(T);
+
+    const T* srcpR = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 0));
+    const T* srcpG = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 1));
+    const T* srcpB = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 2));
 
-    // Change back from Interleaved
     T* VS_RESTRICT dstpR = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
     T* VS_RESTRICT dstpG = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 1));
     T* VS_RESTRICT dstpB = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 2));
 
-    for (auto y = 0; y < height; y++)
-    {
-        for (auto x = 0; x < width; x++)
-        {
-            const unsigned pos = (x + y * width) * 3;
-            dstpB[x] = dstInterleaved[pos];
-            dstpG[x] = dstInterleaved[pos + 1];
-            dstpR[x] = dstInterleaved[pos + 2];
-        }
-        dstpB += stride;
-        dstpG += stride;
-        dstpR += stride;
-    }
+    DehazeContext* ctx = acquireContext(d);
+    const auto start = std::chrono::steady_clock::now();
+
+    std::fill(ctx->m_anStageTime, ctx->m_anStageTime + STAGE_COUNT, 0);
+
+    for (auto c = 0; c < 3; c++)
+        ctx->m_afAirlight[c] = air[c];
+    readTransmission(trans, ctx, vsapi);
+
+    if (d->yuv)
+        d->dehazing_clip->RestoreImageYUV(*ctx, srcpR, srcpG, srcpB, src_stride, vsapi->getStride(src, 1) / (int)sizeof(T),
+            dstpR, dstpG, dstpB, dst_stride, vsapi->getStride(dst, 1) / (int)sizeof(T));
+    else
+        d->dehazing_clip->RestoreImage(*ctx, srcpB, srcpG, srcpR, src_stride, dstpB, dstpG, dstpR, dst_stride);
 
-    delete[] srcInterleaved;
-    delete[] dstInterleaved;
+    if (d->stats)
+        writeStats(dst, ctx, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), d, vsapi);
+
+    releaseContext(d, ctx);
 }
 
 static const VSFrameRef* VS_CC filterGetFrame(int n, int activationReason, void** instanceData, void** frameData,
     VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi)
 {
-    const FilterData* d = static_cast<const FilterData*>(*instanceData);
+    FilterData* d = static_cast<FilterData*>(*instanceData);
     if (activationReason == arInitial)
     {
+        // The previous frame is needed to rebuild the temporal state after a seek
+        if (d->temporal && n > 0)
+        {
+            vsapi->requestFrameFilter(n - 1, d->node, frameCtx);
+            if (d->rdef)
+                vsapi->requestFrameFilter(n - 1, d->rnode, frameCtx);
+        }
+
         vsapi->requestFrameFilter(n, d->node, frameCtx);
         if (d->rdef)
             vsapi->requestFrameFilter(n, d->rnode, frameCtx);
+        if (d->tnode)
+            vsapi->requestFrameFilter(n, d->tnode, frameCtx);
+    }
+    else if (activationReason == arAllFramesReady && d->mode == MODE_RESTORE)
+    {
+        const VSFrameRef* src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const VSFrameRef* trans = vsapi->getFrameFilter(n, d->tnode, frameCtx);
+
+        // Airlight in plane order (R, G, B, or Y, U, V), from the user or from the analysis pass
+        float air[3];
+        for (auto c = 0; c < 3; c++)
+            air[c] = d->air_value[c];
+
+        if (!d->air_def)
+        {
+            const VSMap* props = vsapi->getFramePropsRO(trans);
+            if (vsapi->propNumElements(props, "DehazeAirlight") != 3)
+            {
+                vsapi->setFilterError("Restore: frame property \"DehazeAirlight\" of clip \"transmission\" not found, specify \"airlight\"", frameCtx);
+                vsapi->freeFrame(src);
+                vsapi->freeFrame(trans);
+                return 0;
+            }
+
+            for (auto c = 0; c < 3; c++)
+                air[c] = (float)vsapi->propGetFloat(props, "DehazeAirlight", 2 - c, nullptr);
+        }
+
+        VSFrameRef* dst = vsapi->newVideoFrame(d->out_vi.format, d->out_vi.width, d->out_vi.height, src, core);
+
+        if (d->vi->format->bytesPerSample == 1)
+            restore<uint8_t>(src, trans, air, dst, d, vsapi);
+        else if (d->vi->format->bytesPerSample == 2)
+            restore<uint16_t>(src, trans, air, dst, d, vsapi);
+        else
+            restore<float>(src, trans, air, dst, d, vsapi);
+
+        vsapi->freeFrame(src);
+        vsapi->freeFrame(trans);
+
+        return dst;
     }
     else if (activationReason == arAllFramesReady)
     {
         const VSFrameRef* src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        VSFrameRef* dst = vsapi->newVideoFrame(d->vi->format, d->vi->width, d->vi->height, src, core);
+        VSFrameRef* dst = vsapi->newVideoFrame(d->out_vi.format, d->out_vi.width, d->out_vi.height, src, core);
 
         const VSFrameRef* ref;
         if (d->rdef)
@@ -100,14 +470,30 @@ static const VSFrameRef* VS_CC filterGetFrame(int n, int activationReason, void*
         else
             ref = src;
 
+        const VSFrameRef* prev_src = nullptr;
+        const VSFrameRef* prev_ref = nullptr;
+        if (d->temporal && n > 0)
+        {
+            prev_src = vsapi->getFrameFilter(n - 1, d->node, frameCtx);
+            prev_ref = d->rdef ? vsapi->getFrameFilter(n - 1, d->rnode, frameCtx) : prev_src;
+        }
+
         if (d->vi->format->bytesPerSample == 1)
-            process<uint8_t>(src, ref, dst, d, vsapi);
+            process<uint8_t>(n, src, ref, prev_src, prev_ref, dst, d, vsapi);
         else if (d->vi->format->bytesPerSample == 2)
-            process<uint16_t>(src, ref, dst, d, vsapi);
+            process<uint16_t>(n, src, ref, prev_src, prev_ref, dst, d, vsapi);
+        else
+            process<float>(n, src, ref, prev_src, prev_ref, dst, d, vsapi);
 
         vsapi->freeFrame(src);
         if (d->rdef)
             vsapi->freeFrame(ref);
+        if (prev_src)
+        {
+            vsapi->freeFrame(prev_src);
+            if (d->rdef)
+                vsapi->freeFrame(prev_ref);
+        }
 
         return dst;
     }
@@ -119,6 +505,17 @@ static void VS_CC filterFree(void* instanceData, VSCore* core, const VSAPI* vsap
 {
     FilterData* d = static_cast<FilterData*>(instanceData);
     vsapi->freeNode(d->node);
+    if (d->rdef)
+        vsapi->freeNode(d->rnode);
+    if (d->tnode)
+        vsapi->freeNode(d->tnode);
+
+    for (auto ctx : d->ctx_pool)
+        delete ctx;
+    delete d->temporal_state;
+    delete d->cache;
+    delete d->dehazing_clip;
+
     delete d;
 }
 
@@ -127,8 +524,12 @@ static void VS_CC filterCreate(const VSMap* in, VSMap* out, void* userData, VSCo
     std::unique_ptr<FilterData> d = std::make_unique<FilterData>();
     int err;
 
+    d->mode = static_cast<FilterMode>(reinterpret_cast<intptr_t>(userData));
+    const std::string name = d->mode == MODE_TRANSMISSION ? "Transmission" : d->mode == MODE_RESTORE ? "Restore" : "Dehazing";
+
     d->node = vsapi->propGetNode(in, "src", 0, 0);
     d->vi = vsapi->getVideoInfo(d->node);
+    d->out_vi = *d->vi;
 
     int width = d->vi->width;
     int height = d->vi->height;
@@ -136,9 +537,12 @@ static void VS_CC filterCreate(const VSMap* in, VSMap* out, void* userData, VSCo
 
     try
     {
-        if (!isConstantFormat(d->vi) || d->vi->format->colorFamily != cmRGB ||
-            (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16))
-            throw std::string{ "only constant format RGB 8-16 bit integer input supported" };
+        if (!isConstantFormat(d->vi) || (d->vi->format->colorFamily != cmRGB && d->vi->format->colorFamily != cmYUV) ||
+            (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16) ||
+            (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 32))
+            throw std::string{ "only constant format RGB or YUV 8-16 bit integer or 32 bit float input supported" };
+
+        d->yuv = d->vi->format->colorFamily == cmYUV;
 
         // Donwscale clip for trans estimation
         d->rnode = vsapi->propGetNode(in, "ref", 0, &err);
@@ -163,13 +567,85 @@ static void VS_CC filterCreate(const VSMap* in, VSMap* out, void* userData, VSCo
                 throw std::string("input clip and clip \"ref\" must have the same number of frames");
         }
 
+        // Transmission of an analysis pass, which replaces the estimation in restore mode
+        if (d->mode == MODE_RESTORE)
+        {
+            d->tnode = vsapi->propGetNode(in, "transmission", 0, 0);
+            const VSVideoInfo* tvi = vsapi->getVideoInfo(d->tnode);
+
+            if (!isConstantFormat(tvi) || tvi->format->colorFamily != cmGray ||
+                !((tvi->format->sampleType == stInteger && tvi->format->bitsPerSample == 16) ||
+                  (tvi->format->sampleType == stFloat && tvi->format->bitsPerSample == 32)))
+                throw std::string("clip \"transmission\" must be constant format GRAY16 or GRAYS");
+            if (tvi->width != width || tvi->height != height)
+                throw std::string("input clip and clip \"transmission\" must have the same size");
+            if (tvi->numFrames != d->vi->numFrames)
+                throw std::string("input clip and clip \"transmission\" must have the same number of frames");
+
+            const int air_count = vsapi->propNumElements(in, "airlight");
+            if (air_count > 0)
+            {
+                if (air_count != 3)
+                    throw std::string("\"airlight\" must have 3 values (R, G, B, or Y, U, V)");
+
+                d->air_def = true;
+                for (auto c = 0; c < 3; c++)
+                    d->air_value[c] = (float)vsapi->propGetFloat(in, "airlight", 2 - c, nullptr);
+            }
+        }
+
         int ref_width = d->rvi->width;
         int ref_height = d->rvi->height;
 
+        // Size of the ref made by the internal downscaler, in place of a ref clip
+        const int ref_width_in = int64ToIntS(vsapi->propGetInt(in, "ref_width", 0, &err));
+        const bool ref_width_def = !err;
+        const int ref_height_in = int64ToIntS(vsapi->propGetInt(in, "ref_height", 0, &err));
+        const bool ref_height_def = !err;
+        const double ref_scale = vsapi->propGetFloat(in, "ref_scale", 0, &err);
+        const bool ref_scale_def = !err;
+
+        if (ref_width_def || ref_height_def || ref_scale_def)
+        {
+            if (d->rdef)
+                throw std::string("clip \"ref\" and \"ref_width\", \"ref_height\" or \"ref_scale\" cannot be used together");
+
+            if (ref_scale_def)
+            {
+                if (ref_width_def || ref_height_def)
+                    throw std::string("\"ref_scale\" and \"ref_width\", \"ref_height\" cannot be used together");
+                if (ref_scale <= 0.0 || ref_scale > 1.0)
+                    throw std::string("\"ref_scale\" must be in (0, 1]");
+
+                ref_width = std::max((int)(width * ref_scale + 0.5), 1);
+                ref_height = std::max((int)(height * ref_scale + 0.5), 1);
+            }
+            else
+            {
+                if (!ref_width_def || !ref_height_def)
+                    throw std::string("\"ref_width\" and \"ref_height\" must be given together");
+                if (ref_width_in < 1 || ref_width_in > width || ref_height_in < 1 || ref_height_in > height)
+                    throw std::string("\"ref_width\" and \"ref_height\" must be between 1 and the size of the input clip");
+
+                ref_width = ref_width_in;
+                ref_height = ref_height_in;
+            }
+        }
+
+        // Without a ref clip, a ref of the size of src is src itself
+        d->downscale = !d->rdef && (ref_width != width || ref_height != height);
+
         float TransInit = (float)(vsapi->propGetFloat(in, "trans", 0, &err));
         if (err)
             TransInit = 0.3f;
 
+        float TransStep = (float)(vsapi->propGetFloat(in, "trans_step", 0, &err));
+        if (err)
+            TransStep = 0.1f;
+
+        if (TransStep <= 0.f)
+            throw std::string("\"trans_step\" must be positive");
+
 		float gamma = (float)(vsapi->propGetFloat(in, "gamma", 0, &err));
         if (err)
             gamma = 1.5f;
@@ -186,6 +662,26 @@ static void VS_CC filterCreate(const VSMap* in, VSMap* out, void* userData, VSCo
         if (err)
             GBlockSize = 40;
 
+        int GStepSize = int64ToIntS(vsapi->propGetInt(in, "guide_step", 0, &err));
+        if (err)
+            GStepSize = 1;
+
+        if (GStepSize < 1)
+            throw std::string("\"guide_step\" must be at least 1");
+
+        bool StreamFlag = vsapi->propGetInt(in, "stream", 0, &err) == 0 ? false : true;
+        if (err)
+            StreamFlag = false;
+
+        int GuideMode = int64ToIntS(vsapi->propGetInt(in, "guide_mode", 0, &err));
+        if (err)
+            GuideMode = d->yuv ? 1 : 0;
+
+        if (GuideMode < 0 || GuideMode > 1)
+            throw std::string("\"guide_mode\" must be 0 (RGB) or 1 (luma)");
+        if (d->yuv && GuideMode == 0)
+            throw std::string("YUV input is guided by its luma, \"guide_mode\" must be 1");
+
         bool PostFlag = vsapi->propGetInt(in, "post", 0, &err) == 0 ? false : true;
         if (err)
             PostFlag = false;
@@ -194,20 +690,106 @@ static void VS_CC filterCreate(const VSMap* in, VSMap* out, void* userData, VSCo
         if (err)
             lamdaA = 5.0;
 
-        d->dehazing_clip = new dehazing(width, height, ref_width, ref_height, bits, ABlockSize, TBlockSize, TransInit, false, PostFlag, lamdaA, 1.f, GBlockSize);
+        d->temporal = vsapi->propGetInt(in, "temporal", 0, &err) == 0 ? false : true;
+        if (err)
+            d->temporal = false;
+
+        d->air_interval = int64ToIntS(vsapi->propGetInt(in, "air_interval", 0, &err));
+        if (err)
+            d->air_interval = 0;
+
+        if (d->air_interval < 0)
+            throw std::string("\"air_interval\" must not be negative");
+
+        float lamdaT = (float)(vsapi->propGetFloat(in, "lamda_t", 0, &err));
+        if (err)
+            lamdaT = 1.f;
+
+        if (lamdaT < 0.f)
+            throw std::string("\"lamda_t\" must not be negative");
+
+        int threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+        if (err)
+            threads = 1;
+
+        if (threads < 0)
+            throw std::string("\"threads\" must not be negative");
+        if (threads == 0)
+            threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
 
-        //d->dehazing_clip->MakeExpLUT();    // Called in NFTrsEstimationPColor(), NFTrsEstimationP()
+        d->stats = vsapi->propGetInt(in, "stats", 0, &err) == 0 ? false : true;
+        if (err)
+            d->stats = false;
+
+        int max_memory = int64ToIntS(vsapi->propGetInt(in, "max_memory", 0, &err));
+        if (err)
+            max_memory = 0;
+
+        if (max_memory < 0)
+            throw std::string("\"max_memory\" must not be negative");
+
+        // The transmission is returned as 32 bit float or 16 bit integer gray
+        if (d->mode == MODE_TRANSMISSION)
+        {
+            int out_bits = int64ToIntS(vsapi->propGetInt(in, "bits", 0, &err));
+            if (err)
+                out_bits = 32;
+
+            if (out_bits != 16 && out_bits != 32)
+                throw std::string("\"bits\" must be 16 or 32");
+
+            d->out_vi.format = vsapi->getFormatPreset(out_bits == 16 ? pfGray16 : pfGrayS, core);
+        }
+
+        // Analysis of earlier runs, keyed by the parameters that change the airlight or the block transmission
+        const char* cache_file = vsapi->propGetData(in, "cache_file", 0, &err);
+        if (!err && cache_file[0] != '\0')
+        {
+            const AnalysisKey key = { width, height, ref_width, ref_height, bits, d->vi->format->id, d->vi->numFrames, ABlockSize, d->air_interval, TBlockSize,
+                                      d->temporal ? 1 : 0, TransInit, TransStep, (float)lamdaA, d->temporal ? lamdaT : 0.f };
+            d->cache = new AnalysisCache(cache_file, key);
+        }
+
+        d->dehazing_clip = new dehazing(width, height, ref_width, ref_height, bits, ABlockSize, TBlockSize, TransInit, TransStep, d->temporal, PostFlag, lamdaA, lamdaT, GBlockSize, GStepSize, StreamFlag, GuideMode == 1, threads);
+        if (d->yuv)
+            d->dehazing_clip->SetYUV(d->vi->format->subSamplingW, d->vi->format->subSamplingH);
+        if (d->downscale)
+            d->dehazing_clip->SetRefDownscale();
+        if (d->mode == MODE_RESTORE)
+            d->dehazing_clip->SetRestoreOnly();
+
+        // Memory of each frame in flight, the guided filter is split into strips to fit
+        if (max_memory > 0 && !d->dehazing_clip->FitMemory((size_t)max_memory << 20))
+        {
+            const size_t minimum = d->dehazing_clip->FrameFootprint(d->dehazing_clip->StripHeight());
+            delete d->dehazing_clip;
+            throw std::string("\"max_memory\" is below the footprint of a frame, " + std::to_string((minimum >> 20) + 1) + " MB");
+        }
+
+        if (d->temporal)
+        {
+            d->dehazing_clip->MakeExpLUT();
+            d->temporal_state = d->dehazing_clip->CreateTemporalState();
+        }
         //d->dehazing_clip->GuideLUTMaker(); // Called in FastGuideFilter()
-        d->dehazing_clip->GammaLUTMaker(gamma);
+        if (d->mode != MODE_TRANSMISSION)
+            d->dehazing_clip->GammaLUTMaker(gamma);
     }
     catch (const std::string & error)
     {
-        vsapi->setError(out, ("Dehazing: " + error).c_str());
+        vsapi->setError(out, (name + ": " + error).c_str());
         vsapi->freeNode(d->node);
+        if (d->tnode)
+            vsapi->freeNode(d->tnode);
+        delete d->cache;
         return;
     }
 
-    vsapi->createFilter(in, out, "Dehazing", filterInit, filterGetFrame, filterFree, fmParallel, 0, d.release(), core);
+    // The temporal state and the airlight cache chain the frames, so they have to be processed one at a time and in order
+    const bool serial = d->temporal || d->air_interval > 0;
+    const VSFilterMode mode = serial ? fmSerial : fmParallel;
+    const int flags = serial ? nfMakeLinear : 0;
+    vsapi->createFilter(in, out, name.c_str(), filterInit, filterGetFrame, filterFree, mode, flags, d.release(), core);
 }
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin* plugin)
@@ -217,12 +799,61 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     registerFunc("Dehazing",
         "src:clip;"
         "ref:clip:opt;"
+        "ref_width:int:opt;"
+        "ref_height:int:opt;"
+        "ref_scale:float:opt;"
         "trans:float:opt;"
+        "trans_step:float:opt;"
         "gamma:float:opt;"
         "air_size:int:opt;"
+        "air_interval:int:opt;"
+        "trans_size:int:opt;"
+        "guide_size:int:opt;"
+        "guide_step:int:opt;"
+        "stream:int:opt;"
+        "guide_mode:int:opt;"
+        "post:int:opt;"
+        "lamda:float:opt;"
+        "temporal:int:opt;"
+        "lamda_t:float:opt;"
+        "threads:int:opt;"
+        "stats:int:opt;"
+        "cache_file:data:opt;"
+        "max_memory:int:opt",
+        filterCreate, reinterpret_cast<void*>(MODE_DEHAZE), plugin);
+
+    registerFunc("Transmission",
+        "src:clip;"
+        "ref:clip:opt;"
+        "ref_width:int:opt;"
+        "ref_height:int:opt;"
+        "ref_scale:float:opt;"
+        "trans:float:opt;"
+        "trans_step:float:opt;"
+        "air_size:int:opt;"
+        "air_interval:int:opt;"
         "trans_size:int:opt;"
         "guide_size:int:opt;"
+        "guide_step:int:opt;"
+        "stream:int:opt;"
+        "guide_mode:int:opt;"
+        "lamda:float:opt;"
+        "temporal:int:opt;"
+        "lamda_t:float:opt;"
+        "threads:int:opt;"
+        "stats:int:opt;"
+        "cache_file:data:opt;"
+        "bits:int:opt;"
+        "max_memory:int:opt",
+        filterCreate, reinterpret_cast<void*>(MODE_TRANSMISSION), plugin);
+
+    registerFunc("Restore",
+        "src:clip;"
+        "transmission:clip;"
+        "airlight:float[]:opt;"
+        "gamma:float:opt;"
         "post:int:opt;"
-        "lamda:float:opt",
-        filterCreate, 0, plugin);
+        "threads:int:opt;"
+        "stats:int:opt",
+        filterCreate, reinterpret_cast<void*>(MODE_RESTORE), plugin);
 }